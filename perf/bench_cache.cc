@@ -0,0 +1,160 @@
+/*
+  Cache shard microbenchmark.
+
+  Cost: for each policy and cache size a single CacheShard is filled (its
+  memory limit is set to hold about that many entries), then a mix of gets
+  (80%) and sets (20%) is run over a key space twice the cache size, so
+  about half of the gets miss and most sets evict an entry. Prints the
+  average cost per operation, it should stay flat as the cache grows,
+  along with the cache memory per entry and the slab fragmentation (part
+  of the reserved slab memory not holding entry data).
+
+  Hit ratio: replays a read-through workload (a missed key is set) of
+  zipfian distributed keys, interrupted by sequential scans of keys never
+  seen before, and prints the hit ratio of each policy.
+*/
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/app-template.hh>
+#include <seastar/core/coroutine.hh>
+#include <seastar/coroutine/maybe_yield.hh>
+#include <seastar/core/print.hh>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "../server/store_cache.hh"
+#include "bench_util.hh"
+
+using namespace seastar;
+using namespace kvdb;
+
+namespace bpo = boost::program_options;
+
+// cache limit holding about the given number of entries, entry bookkeeping is well below 128 bytes
+static size_t cache_bytes(size_t entries, size_t value_size) {
+    return entries * (value_size + 128);
+}
+
+static future<> bench_cost(CachePolicy policy, size_t size, size_t ops, Value& value, std::mt19937_64& rnd) {
+    CacheShard shard(cache_bytes(size, value.size()), policy);
+    for (size_t i = 0; i < size; ++i) {
+        co_await shard.set(fmt::format("key{:0>12}", i), value.share());
+    }
+
+    // keys are generated up front, only the cache operations are timed
+    std::vector<std::string> keys(ops);
+    std::vector<bool> is_get(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        keys[i] = fmt::format("key{:0>12}", rnd() % (2 * size));
+        is_get[i] = rnd() % 5 != 0;
+    }
+
+    size_t gets = 0, hits = 0;
+    const auto started = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < ops; ++i) {
+        if (is_get[i]) {
+            ++gets;
+            const Value v = co_await shard.get(keys[i]);
+            hits += !v.empty();
+        } else {
+            co_await shard.set(keys[i], value.share());
+        }
+    }
+    const double elapsed = seconds_since(started);
+    const auto& slab = shard.slab_stats();
+    fmt::print("{:>8} {:>12} {:>12} {:>10.3f} {:>12.1f} {:>10.1f} {:>8.3f}\n", cache_policy_name(policy), size, shard.size(),
+               gets ? double(hits) / gets : 0.0, elapsed * 1e9 / ops,
+               double(shard.memory_usage()) / std::max<size_t>(shard.size(), 1),
+               slab.reserved ? 1 - double(slab.requested) / slab.reserved : 0.0);
+    co_await shard.stop();
+}
+
+int main(int ac, char** av) {
+    app_template app;
+
+    app.add_options()
+        ("policies", bpo::value<std::vector<std::string>>()->multitoken()->default_value({"lru", "tinylfu"}, "lru tinylfu"), "cache policies to compare")
+        ("sizes", bpo::value<std::vector<size_t>>()->multitoken()->default_value({20, 1000, 100000, 1000000}, "20 1000 100000 1000000"), "cache sizes (max. records)")
+        ("ops", bpo::value<size_t>()->default_value(2000000), "operations per cache size")
+        ("value-size", bpo::value<unsigned>()->default_value(100), "value size in bytes")
+        ("zipf-keys", bpo::value<size_t>()->default_value(1000000), "hit ratio: zipfian key space size")
+        ("zipf-s", bpo::value<double>()->default_value(0.99), "hit ratio: zipfian skew")
+        ("zipf-cache", bpo::value<size_t>()->default_value(10000), "hit ratio: cache size (max. records)")
+        ("scan-every", bpo::value<size_t>()->default_value(200000), "hit ratio: operations between scan starts")
+        ("scan-length", bpo::value<size_t>()->default_value(50000), "hit ratio: keys per scan");
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        const auto sizes = config["sizes"].as<std::vector<size_t>>();
+        const auto ops = config["ops"].as<size_t>();
+        const auto value_size = config["value-size"].as<unsigned>();
+        const auto zipf_keys = config["zipf-keys"].as<size_t>();
+        const auto zipf_s = config["zipf-s"].as<double>();
+        const auto zipf_cache = config["zipf-cache"].as<size_t>();
+        const auto scan_every = config["scan-every"].as<size_t>();
+        const auto scan_length = std::min(config["scan-length"].as<size_t>(), scan_every);
+        // shared by all sets, the cache copies it
+        Value value(value_size);
+        memset(value.get_write(), 'v', value.size());
+
+        std::vector<CachePolicy> policies;
+        for (const auto& name : config["policies"].as<std::vector<std::string>>()) {
+            CachePolicy policy;
+            if (!parse_cache_policy(name, policy)) {
+                fmt::print("unknown cache policy {}\n", name);
+                co_return 1;
+            }
+            policies.push_back(policy);
+        }
+
+        fmt::print("========== cache benchmark ============\n");
+        fmt::print("{:>8} {:>12} {:>12} {:>10} {:>12} {:>10} {:>8}\n", "policy", "cache size", "entries", "hit ratio", "ns/op", "B/entry", "frag");
+        std::mt19937_64 rnd(1);
+        for (auto policy : policies) {
+            for (size_t size : sizes) {
+                co_await bench_cost(policy, size, ops, value, rnd);
+                co_await coroutine::maybe_yield();
+            }
+        }
+
+        // zipfian key ranks: inverse of the cumulative distribution
+        std::vector<double> cdf(zipf_keys);
+        double sum = 0;
+        for (size_t i = 0; i < zipf_keys; ++i) {
+            sum += 1 / std::pow(double(i + 1), zipf_s);
+            cdf[i] = sum;
+        }
+        std::vector<std::string> keys(ops);
+        size_t scanned = 0;
+        for (size_t i = 0; i < ops; ++i) {
+            if (i % scan_every < scan_length) {
+                keys[i] = fmt::format("scan{:0>12}", scanned++);
+            } else {
+                const double u = std::uniform_real_distribution<double>(0, sum)(rnd);
+                keys[i] = fmt::format("key{:0>12}", std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+            }
+        }
+
+        fmt::print("========== hit ratio: zipf {} keys (s {}), scan {} of every {} ops ============\n",
+                   zipf_keys, zipf_s, scan_length, scan_every);
+        fmt::print("{:>8} {:>12} {:>10}\n", "policy", "cache size", "hit ratio");
+        for (auto policy : policies) {
+            CacheShard shard(cache_bytes(zipf_cache, value.size()), policy);
+            size_t hits = 0;
+            for (const auto& key : keys) {
+                if (!(co_await shard.get(key)).empty()) {
+                    ++hits;
+                } else {
+                    co_await shard.set(key, value.share());
+                }
+            }
+            fmt::print("{:>8} {:>12} {:>10.3f}\n", cache_policy_name(policy), zipf_cache, double(hits) / keys.size());
+            co_await shard.stop();
+            co_await coroutine::maybe_yield();
+        }
+        co_return 0;
+    });
+}
@@ -0,0 +1,136 @@
+/*
+  Disk index memory benchmark.
+
+  Builds the index of the same key set with the old
+  std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> and with
+  DiskIndex, then prints the heap bytes per key (allocator overhead
+  included) and the insert/lookup times. DiskIndex lookups find the slot by
+  the fingerprint and the secondary hash, like the disk shard writes do.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <malloc.h>
+
+#include "../server/disk_index.hh"
+#include "bench_util.hh"
+
+using namespace kvdb;
+
+// live heap bytes, as reported by the allocator
+static size_t g_heap_bytes = 0;
+
+void *operator new(size_t size) {
+  void *p = malloc(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  g_heap_bytes += malloc_usable_size(p);
+  return p;
+}
+
+void operator delete(void *p) noexcept {
+  if (p) {
+    g_heap_bytes -= malloc_usable_size(p);
+    free(p);
+  }
+}
+
+void operator delete(void *p, size_t) noexcept {
+  operator delete(p);
+}
+
+struct Result {
+  double bytes_per_key;
+  double insert_ns;
+  double lookup_ns;
+};
+
+static Result bench_map(const std::vector<std::string> &keys) {
+  const size_t heap_before = g_heap_bytes;
+  auto start = std::chrono::steady_clock::now();
+  std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> index;
+  uint64_t pos = 0;
+  for (const auto &key : keys) {
+    index[key] = std::make_pair<>(pos, uint64_t(100));
+    pos += 128;
+  }
+  const double insert_s = seconds_since(start);
+  const size_t heap = g_heap_bytes - heap_before;
+
+  start = std::chrono::steady_clock::now();
+  uint64_t sum = 0;
+  for (const auto &key : keys) {
+    sum += index.find(key)->second.first;
+  }
+  const double lookup_s = seconds_since(start);
+  if (sum == 1) {
+    printf("\n");  // keep the lookups
+  }
+  return Result{double(heap) / keys.size(), insert_s * 1e9 / keys.size(), lookup_s * 1e9 / keys.size()};
+}
+
+static Result bench_index(const std::vector<std::string> &keys) {
+  const size_t heap_before = g_heap_bytes;
+  auto start = std::chrono::steady_clock::now();
+  DiskIndex index;
+  // record i is at i * 128, its key is keys[i]
+  uint64_t pos = 0;
+  for (const auto &key : keys) {
+    index.insert(DiskIndex::fingerprint(key), pos, 128, DiskIndex::secondary_hash(key));
+    pos += 128;
+  }
+  const double insert_s = seconds_since(start);
+  const size_t heap = g_heap_bytes - heap_before;
+
+  start = std::chrono::steady_clock::now();
+  uint64_t found = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const size_t slot = index.find_key(DiskIndex::fingerprint(keys[i]), DiskIndex::secondary_hash(keys[i]));
+    if (slot != DiskIndex::npos && index.entry(slot).rec_pos == i * 128) {
+      ++found;
+    }
+  }
+  const double lookup_s = seconds_since(start);
+  if (found != keys.size()) {
+    printf("lookup error: %lu of %lu keys found\n", found, keys.size());
+  }
+  return Result{double(heap) / keys.size(), insert_s * 1e9 / keys.size(), lookup_s * 1e9 / keys.size()};
+}
+
+int main(int argc, char **argv) {
+  // key counts from the command line
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i) {
+    sizes.push_back(strtoull(argv[i], nullptr, 10));
+  }
+  if (sizes.empty()) {
+    sizes = {100000, 1000000, 10000000};
+  }
+
+  printf("========== index memory benchmark ============\n");
+  printf("%12s %10s | %14s %10s %10s | %14s %10s %10s\n", "keys", "key size",
+         "map [B/key]", "ins [ns]", "get [ns]", "index [B/key]", "ins [ns]", "get [ns]");
+  for (size_t count : sizes) {
+    std::vector<std::string> keys;
+    keys.reserve(count);
+    char buf[32];
+    for (size_t i = 0; i < count; ++i) {
+      snprintf(buf, sizeof(buf), "key%012lu", i);
+      keys.emplace_back(buf);
+    }
+
+    const Result map = bench_map(keys);
+    const Result index = bench_index(keys);
+    printf("%12lu %10lu | %14.1f %10.1f %10.1f | %14.1f %10.1f %10.1f\n", count, keys[0].size(),
+           map.bytes_per_key, map.insert_ns, map.lookup_ns,
+           index.bytes_per_key, index.insert_ns, index.lookup_ns);
+  }
+  return 0;
+}
@@ -0,0 +1,130 @@
+/*
+  Request body parsing benchmark.
+
+  Parses typical request bodies (set with small, 1KB and 64KB values,
+  a value full of escapes, mget with 100 keys) with the former
+  extract_json_value (body copied and searched once per member) and with
+  the single pass JSON scanner at each supported SIMD level, then prints
+  the parse time per body (decoded strings included) and the throughput.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "../server/json_scan.hh"
+#include "bench_util.hh"
+
+using namespace kvdb;
+
+// former parser: copy of the body, search pattern built for each member
+static bool extract_json_value(std::string data, const std::string &key, std::string &out) {
+  const std::string pattern = "\"" + key + "\" : \"";
+  size_t start = data.find(pattern);
+  if (start != std::string::npos) {
+    start += pattern.size();
+    const size_t end = data.find("\"", start);
+    if (end != std::string::npos) {
+      out = data.substr(start, end - start);
+      return true;
+    }
+  }
+  return false;
+}
+
+struct Body {
+  const char *name;
+  std::string text;
+  bool keys;      // mget body, otherwise set
+};
+
+static std::string set_body(const std::string &value) {
+  return "{ \"key\" : \"key000000000042\", \"value\" : \"" + value + "\" }";
+}
+
+// parse as the handler does, returns the bytes of the values taken
+static size_t parse_scan(const Body &body) {
+  if (body.keys) {
+    JsonField fields[] = {{"keys"}};
+    std::vector<JsonValue> keys;
+    if (!scan_json_object(body.text, fields) || !scan_json_array(fields[0].value.text, keys)) {
+      abort();
+    }
+    size_t bytes = 0;
+    for (const auto &key : keys) {
+      bytes += key.str().size();
+    }
+    return bytes;
+  }
+  JsonField fields[] = {{"key"}, {"value"}};
+  if (!scan_json_object(body.text, fields)) {
+    abort();
+  }
+  return fields[0].value.str().size() + fields[1].value.str().size();
+}
+
+static size_t parse_old(const Body &body) {
+  std::string key, value;
+  extract_json_value(body.text, "key", key);
+  extract_json_value(body.text, "value", value);
+  return key.size() + value.size();
+}
+
+template <typename Parse>
+static void run(const char *parser, const Body &body, size_t iterations, Parse parse) {
+  size_t bytes = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iterations; ++i) {
+    bytes += parse(body);
+  }
+  const double elapsed = seconds_since(start);
+  if (bytes == 0) {
+    printf("nothing parsed\n");
+  }
+  printf("%-14s %-8s %10lu %12.1f %12.1f\n", body.name, parser, body.text.size(),
+         elapsed * 1e9 / iterations, body.text.size() * iterations / elapsed / 1e6);
+}
+
+int main(int argc, char **argv) {
+  // total bytes parsed for each body and parser
+  const size_t total = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1ull << 30;
+
+  std::string escaped;
+  while (escaped.size() < 1024) {
+    escaped += "line \\\"quoted\\\"\\n";
+  }
+  std::string mget = "{ \"keys\" : [ ";
+  for (unsigned i = 0; i < 100; ++i) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s\"key%012u\"", i ? ", " : "", i);
+    mget += key;
+  }
+  mget += " ] }";
+
+  const std::vector<Body> bodies = {
+    {"set 16B", set_body(std::string(16, 'v')), false},
+    {"set 1KB", set_body(std::string(1024, 'v')), false},
+    {"set 64KB", set_body(std::string(64 * 1024, 'v')), false},
+    {"set escaped", set_body(escaped), false},
+    {"mget 100", mget, true},
+  };
+
+  printf("========== request body parsing benchmark ============\n");
+  printf("%-14s %-8s %10s %12s %12s\n", "body", "parser", "bytes", "ns/body", "MB/s");
+  for (const auto &body : bodies) {
+    const size_t iterations = std::max<size_t>(total / body.text.size(), 1);
+    // the former parser had no arrays and stopped at the first escaped quote
+    if (!body.keys) {
+      run("old", body, iterations, parse_old);
+    }
+    for (auto level : {JsonSimd::scalar, JsonSimd::sse2, JsonSimd::avx2}) {
+      if (set_json_simd(level)) {
+        run(json_simd_name(level), body, iterations, parse_scan);
+      }
+    }
+  }
+  return 0;
+}
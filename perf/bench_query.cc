@@ -0,0 +1,110 @@
+/*
+  Prefix query benchmark.
+
+  For each shard size, the same key set is kept in an unordered_map (the
+  former query did a full scan checking starts_with) and in the ordered
+  KeyIndex. Queries with prefixes matching 1, 100 and 10000 keys are timed
+  on both, the ordered index memory per key is printed as well.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "../server/key_index.hh"
+#include "bench_util.hh"
+
+using namespace kvdb;
+
+static std::string make_key(size_t i) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "key%012lu", i);
+  return buf;
+}
+
+int main(int argc, char **argv) {
+  // shard sizes from the command line
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i) {
+    sizes.push_back(strtoull(argv[i], nullptr, 10));
+  }
+  if (sizes.empty()) {
+    sizes = {100000, 1000000, 5000000};
+  }
+
+  printf("========== prefix query benchmark ============\n");
+  printf("%12s %10s %14s | %14s %14s\n", "keys", "matching", "index [B/key]", "scan [us]", "index [us]");
+  std::mt19937_64 rnd(1);
+  for (size_t count : sizes) {
+    // random insertion order
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+      order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rnd);
+
+    std::unordered_map<std::string, std::string> map;
+    KeyIndex index;
+    for (size_t i : order) {
+      const std::string key = make_key(i);
+      map.emplace(key, std::string());
+      index.insert(key);
+    }
+    const double bytes_per_key = double(index.memory_usage()) / count;
+
+    // prefix of a key without its last digits matches 10^digits keys
+    for (unsigned digits : {0u, 2u, 4u}) {
+      size_t matching = 1;
+      for (unsigned d = 0; d < digits; ++d) {
+        matching *= 10;
+      }
+      if (matching > count) {
+        continue;
+      }
+      const unsigned scan_queries = 3;
+      const unsigned index_queries = 1000;
+      std::vector<std::string> prefixes;
+      for (unsigned q = 0; q < index_queries; ++q) {
+        std::string key = make_key(rnd() % count);
+        key.resize(key.size() - digits);
+        prefixes.push_back(std::move(key));
+      }
+
+      size_t found = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (unsigned q = 0; q < scan_queries; ++q) {
+        std::set<std::string> res;
+        for (auto &[key, val] : map) {
+          if (key.starts_with(prefixes[q])) {
+            res.insert(key);
+          }
+        }
+        found += res.size();
+      }
+      const double scan_us = seconds_since(start) * 1e6 / scan_queries;
+
+      start = std::chrono::steady_clock::now();
+      for (unsigned q = 0; q < index_queries; ++q) {
+        std::set<std::string> res;
+        index.scan(prefixes[q], std::string_view(), [&res] (std::string_view key) {
+          res.emplace_hint(res.end(), key);
+          return true;
+        });
+        found += res.size();
+      }
+      const double index_us = seconds_since(start) * 1e6 / index_queries;
+      if (found == 0) {
+        printf("no keys found\n");
+      }
+
+      printf("%12lu %10lu %14.1f | %14.1f %14.1f\n", count, matching, bytes_per_key, scan_us, index_us);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+  Disk storage restart benchmark.
+
+  For each dataset size the disk storage is filled with keys and stopped
+  (which writes the index hint files), then it is restarted twice:
+  once using the hint files and once after removing them, i.e. with the
+  full log replay. Data files are kept in a separate working directory.
+*/
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/app-template.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/print.hh>
+#include <boost/range/irange.hpp>
+#include <chrono>
+#include <unistd.h>
+
+#include "../server/store_disk.hh"
+#include "bench_util.hh"
+
+using namespace seastar;
+using namespace kvdb;
+
+namespace bpo = boost::program_options;
+
+// start and stop the storage, return start duration in seconds
+future<double> timed_restart() {
+  auto store = std::make_unique<DiskStorage>();
+  auto started = std::chrono::steady_clock::now();
+  co_await store->start();
+  const double elapsed = seconds_since(started);
+  co_await store->stop();
+  co_return elapsed;
+}
+
+int main(int ac, char** av) {
+    app_template app;
+
+    app.add_options()
+        ("dir", bpo::value<std::string>()->default_value("/tmp/kvdb_bench"), "working directory (its data files are removed!)")
+        ("sizes", bpo::value<std::vector<unsigned>>()->multitoken()->default_value({10000, 100000, 1000000}, "10000 100000 1000000"), "dataset sizes (number of keys)")
+        ("value-size", bpo::value<unsigned>()->default_value(100), "value size in bytes")
+        ("parallel", bpo::value<unsigned>()->default_value(256), "max. concurrent writes while filling");
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        const auto dir = config["dir"].as<std::string>();
+        const auto sizes = config["sizes"].as<std::vector<unsigned>>();
+        const auto value_size = config["value-size"].as<unsigned>();
+        const auto parallel = config["parallel"].as<unsigned>();
+
+        co_await recursive_touch_directory(dir);
+        if (chdir(dir.c_str()) != 0) {
+            fmt::print("Error: can't change directory to {}\n", dir);
+            co_return -1;
+        }
+
+        std::vector<std::tuple<unsigned, double, double>> results;
+        for (unsigned keys : sizes) {
+            remove_data_files();
+
+            auto store = std::make_unique<DiskStorage>();
+            co_await store->start();
+            const std::string value(value_size, 'v');
+            co_await max_concurrent_for_each(boost::irange(0u, keys), parallel, [&store, &value] (unsigned i) {
+                // a buffer of its own, it may go to another shard
+                return store->set(fmt::format("key{:0>10}", i), Value(value.data(), value.size())).discard_result();
+            });
+            co_await store->stop();
+
+            const double with_hint = co_await timed_restart();
+            remove_data_files(true);
+            const double without_hint = co_await timed_restart();
+            results.emplace_back(keys, with_hint, without_hint);
+        }
+
+        fmt::print("========== restart benchmark ============\n");
+        fmt::print("Shards: {}, value size: {}\n", smp::count, value_size);
+        fmt::print("{:>12} {:>16} {:>16}\n", "keys", "with hint [s]", "log replay [s]");
+        for (auto &[keys, with_hint, without_hint] : results) {
+            fmt::print("{:>12} {:>16.3f} {:>16.3f}\n", keys, with_hint, without_hint);
+        }
+        remove_data_files();
+        co_return 0;
+    });
+}
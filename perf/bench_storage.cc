@@ -0,0 +1,316 @@
+/*
+  Storage engine benchmark suite, no HTTP involved.
+
+  Drives the storage implementations (the cache, the disk storage and the
+  database with both layers) through IStorage, in process. For each key
+  count and value size a fresh storage runs the phases:
+   - set: every key written once
+   - get: every key read back
+   - overwrite: every key written again (dead records on the disk)
+   - query: prefix queries of about 100 keys each (disk storages only,
+     the cache doesn't index its keys)
+   - rebuild: the storage restarted without the hint files, i.e. the
+     whole index rebuilt from the data files (disk storages only)
+   - delete: every key deleted
+  Each shard runs the requests of the keys it owns, through the shard
+  local operations (no cross shard call), concurrently up to parallel.
+  Reported: requests per second, latency percentiles, allocations per
+  request (including the request key and value buffers) and bytes written
+  by the disk batches per request. The shard count is the Seastar --smp.
+*/
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/app-template.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/memory.hh>
+#include <seastar/core/print.hh>
+#include <boost/range/irange.hpp>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <unistd.h>
+
+#include "../server/store_cache.hh"
+#include "../server/store_disk.hh"
+#include "hdr_histogram.hh"
+#include "bench_util.hh"
+
+using namespace seastar;
+using namespace kvdb;
+
+namespace bpo = boost::program_options;
+
+static std::string key_name(uint64_t i) {
+  return fmt::format("key{:0>12}", i);
+}
+
+// storage under test, the disk storage (if any) for its write counters
+struct Target {
+  std::unique_ptr<IStorage> store;
+  DiskStorage *disk{nullptr};
+};
+
+struct TargetOptions {
+  double cache_memory;
+  CachePolicy cache_policy;
+};
+
+static const std::vector<std::string> storage_names = {"cache", "disk", "database"};
+
+static Target make_target(std::string_view name, const TargetOptions &opts) {
+  Target target;
+  if (name == "cache") {
+    target.store = std::make_unique<CacheStorage>(opts.cache_memory, opts.cache_policy);
+  } else if (name == "disk") {
+    auto disk = std::make_unique<DiskStorage>();
+    target.disk = disk.get();
+    target.store = std::move(disk);
+  } else {
+    // the database owns its layers
+    target.disk = new DiskStorage();
+    target.store = std::make_unique<database>(std::vector<IStorage *>{new CacheStorage(opts.cache_memory, opts.cache_policy), target.disk});
+  }
+  return target;
+}
+
+future<uint64_t> written_bytes(const Target &target) {
+  if (!target.disk) {
+    co_return 0;
+  }
+  const IoStats stats = co_await target.disk->io_stats();
+  co_return stats.write_bytes;
+}
+
+struct Result {
+  std::string storage;
+  const char *phase;
+  uint64_t keys;
+  size_t value_size;
+  uint64_t ops{0};
+  double secs{0};
+  hdr_histogram latency;
+  uint64_t mallocs{0};
+  uint64_t written{0};
+  uint64_t misses{0};
+
+  Result of_phase(const char *name) const {
+    Result res = *this;
+    res.phase = name;
+    return res;
+  }
+};
+
+// requests of a shard
+struct ShardRun {
+  hdr_histogram latency;
+  uint64_t ops{0};
+  uint64_t mallocs{0};
+  uint64_t misses{0};
+};
+
+// run op(i, run) for the items of this shard, concurrently up to parallel
+template <typename Op>
+future<ShardRun> run_shard(const std::vector<uint64_t> &items, unsigned parallel, const Op &op) {
+  ShardRun run;
+  const uint64_t mallocs = memory::stats().mallocs();
+  co_await max_concurrent_for_each(items, parallel, [&run, &op] (uint64_t i) {
+    const auto start = std::chrono::steady_clock::now();
+    return op(i, run).then([&run, start] {
+      run.latency.add(std::chrono::steady_clock::now() - start);
+    });
+  });
+  run.ops = items.size();
+  run.mallocs = memory::stats().mallocs() - mallocs;
+  co_return run;
+}
+
+// run a phase on all shards, items[shard] are the items of each shard
+template <typename Op>
+future<Result> measure(Result res, const Target &target, const std::vector<std::vector<uint64_t>> &items,
+                       unsigned parallel, Op op) {
+  const uint64_t written = co_await written_bytes(target);
+  const auto started = std::chrono::steady_clock::now();
+  std::vector<ShardRun> runs(smp::count);
+  co_await parallel_for_each(boost::irange(0u, smp::count), [&] (unsigned shard) {
+    return smp::submit_to(shard, [&items, parallel, &op, shard] {
+      return run_shard(items[shard], parallel, op);
+    }).then([&runs, shard] (ShardRun run) {
+      runs[shard] = std::move(run);
+    });
+  });
+  res.secs = seconds_since(started);
+  res.written = co_await written_bytes(target) - written;
+  for (const auto &run : runs) {
+    res.ops += run.ops;
+    res.latency += run.latency;
+    res.mallocs += run.mallocs;
+    res.misses += run.misses;
+  }
+  co_return res;
+}
+
+// keys with the prefix, all of them read from the stream
+future<size_t> query_prefix(IStorage &store, std::string prefix) {
+  std::unique_ptr<IKeyStream> keys = store.query(std::move(prefix), "");
+  size_t count = 0;
+  while (true) {
+    std::vector<std::string> chunk = co_await keys->next(256);
+    if (chunk.empty()) {
+      co_return count;
+    }
+    count += chunk.size();
+  }
+}
+
+future<uint64_t> mallocs_all_shards() {
+  uint64_t total = 0;
+  for (unsigned shard = 0; shard < smp::count; ++shard) {
+    total += co_await smp::submit_to(shard, [] { return memory::stats().mallocs(); });
+  }
+  co_return total;
+}
+
+struct BenchOptions {
+  TargetOptions target;
+  unsigned parallel;
+  uint64_t queries;
+};
+
+future<> bench_storage(std::string name, uint64_t keys, size_t value_size, const BenchOptions &opts, std::vector<Result> &results) {
+  remove_data_files();
+
+  // keys owned by each shard, queries spread over the shards
+  std::vector<std::vector<uint64_t>> owned(smp::count);
+  for (uint64_t i = 0; i < keys; ++i) {
+    owned[IStorage::shard_of(key_name(i))].push_back(i);
+  }
+  std::vector<std::vector<uint64_t>> queries(smp::count);
+  std::mt19937_64 rng(keys);
+  for (uint64_t q = 0; q < opts.queries && keys > 0; ++q) {
+    queries[q % smp::count].push_back(rng() % keys);
+  }
+
+  Target target = make_target(name, opts.target);
+  co_await target.store->start();
+  IStorage *store = target.store.get();
+  const Result res{name, "", keys, value_size};
+
+  auto set = [&store, value_size] (uint64_t i, ShardRun &) {
+    Value value(value_size);
+    memset(value.get_write(), 'v', value_size);
+    return store->set_local(key_name(i), std::move(value)).discard_result();
+  };
+  auto get = [&store] (uint64_t i, ShardRun &run) {
+    return store->get_local(key_name(i)).then([&run] (Value value) {
+      run.misses += value.empty();
+    });
+  };
+  auto del = [&store] (uint64_t i, ShardRun &) {
+    return store->del_local(key_name(i)).discard_result();
+  };
+  // key000000001234 -> prefix key0000000012, 100 keys
+  auto query = [&store] (uint64_t i, ShardRun &run) {
+    std::string prefix = key_name(i);
+    prefix.resize(prefix.size() - 2);
+    return query_prefix(*store, std::move(prefix)).then([&run] (size_t count) {
+      run.misses += count == 0;
+    });
+  };
+
+  results.push_back(co_await measure(res.of_phase("set"), target, owned, opts.parallel, set));
+  results.push_back(co_await measure(res.of_phase("get"), target, owned, opts.parallel, get));
+  results.push_back(co_await measure(res.of_phase("overwrite"), target, owned, opts.parallel, set));
+  if (target.disk) {
+    results.push_back(co_await measure(res.of_phase("query"), target, queries, opts.parallel, query));
+
+    // restart, the index is rebuilt by replaying the data files
+    co_await store->stop();
+    remove_data_files(true);
+    target = make_target(name, opts.target);
+    store = target.store.get();
+    Result rebuild = res.of_phase("rebuild");
+    const uint64_t mallocs = co_await mallocs_all_shards();
+    const auto started = std::chrono::steady_clock::now();
+    co_await store->start();
+    const auto elapsed = std::chrono::steady_clock::now() - started;
+    rebuild.mallocs = co_await mallocs_all_shards() - mallocs;
+    rebuild.secs = std::chrono::duration<double>(elapsed).count();
+    rebuild.ops = keys;
+    rebuild.latency.add(elapsed);
+    results.push_back(std::move(rebuild));
+  }
+
+  results.push_back(co_await measure(res.of_phase("delete"), target, owned, opts.parallel, del));
+  co_await store->stop();
+  remove_data_files();
+}
+
+int main(int ac, char** av) {
+    app_template app;
+
+    app.add_options()
+        ("dir", bpo::value<std::string>()->default_value("/tmp/kvdb_bench"), "working directory (its data files are removed!)")
+        ("storages", bpo::value<std::vector<std::string>>()->multitoken()->default_value({"cache", "disk", "database"}, "cache disk database"),
+            "storages benchmarked: cache, disk, database (cache and disk layers)")
+        ("keys", bpo::value<std::vector<uint64_t>>()->multitoken()->default_value({10000, 100000}, "10000 100000"), "key counts")
+        ("value-sizes", bpo::value<std::vector<size_t>>()->multitoken()->default_value({100, 4096}, "100 4096"), "value sizes in bytes")
+        ("parallel", bpo::value<unsigned>()->default_value(64), "max. concurrent requests of each shard")
+        ("queries", bpo::value<uint64_t>()->default_value(1000), "prefix queries (of about 100 keys each)")
+        ("cache-memory", bpo::value<double>()->default_value(0.5), "fraction of each shard memory used by the cache")
+        ("cache-policy", bpo::value<std::string>()->default_value("tinylfu"), "cache eviction policy: lru, tinylfu");
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        const auto dir = config["dir"].as<std::string>();
+        const auto storages = config["storages"].as<std::vector<std::string>>();
+        const auto key_counts = config["keys"].as<std::vector<uint64_t>>();
+        const auto value_sizes = config["value-sizes"].as<std::vector<size_t>>();
+
+        BenchOptions opts;
+        opts.parallel = config["parallel"].as<unsigned>();
+        opts.queries = config["queries"].as<uint64_t>();
+        opts.target.cache_memory = config["cache-memory"].as<double>();
+        if (!parse_cache_policy(config["cache-policy"].as<std::string>(), opts.target.cache_policy)) {
+            fmt::print("Error: unknown cache policy {}\n", config["cache-policy"].as<std::string>());
+            co_return -1;
+        }
+        for (const auto &name : storages) {
+            if (std::find(storage_names.begin(), storage_names.end(), name) == storage_names.end()) {
+                fmt::print("Error: unknown storage {}\n", name);
+                co_return -1;
+            }
+        }
+
+        co_await recursive_touch_directory(dir);
+        if (chdir(dir.c_str()) != 0) {
+            fmt::print("Error: can't change directory to {}\n", dir);
+            co_return -1;
+        }
+
+        std::vector<Result> results;
+        for (const auto &name : storages) {
+            for (uint64_t keys : key_counts) {
+                for (size_t value_size : value_sizes) {
+                    co_await bench_storage(name, keys, value_size, opts, results);
+                }
+            }
+        }
+
+        fmt::print("========== storage benchmark ============\n");
+        fmt::print("Shards: {}, parallel: {} per shard, latency in us\n", smp::count, opts.parallel);
+        // misses: gets finding no value (cache evictions), queries finding no key
+        fmt::print("{:>9} {:>9} {:>7} {:>10} {:>12} {:>9} {:>9} {:>9} {:>10} {:>10} {:>12} {:>8}\n", "storage", "keys", "value", "phase",
+                   "ops/s", "p50", "p99", "p99.9", "max", "mallocs/op", "written/op", "misses");
+        for (const auto &r : results) {
+            const double ops = std::max<uint64_t>(r.ops, 1);
+            fmt::print("{:>9} {:>9} {:>7} {:>10} {:>12.0f} {:>9.1f} {:>9.1f} {:>9.1f} {:>10.1f} {:>10.2f} {:>12.1f} {:>8}\n",
+                       r.storage, r.keys, r.value_size, r.phase, r.ops / r.secs,
+                       r.latency.percentile(50).count() / 1000.0, r.latency.percentile(99).count() / 1000.0,
+                       r.latency.percentile(99.9).count() / 1000.0, r.latency.max().count() / 1000.0,
+                       r.mallocs / ops, r.written / ops, r.misses);
+        }
+        co_return 0;
+    });
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+/*
+  Helpers shared by the benchmarks and the storage tests, plain C++.
+*/
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+  Remove the disk storage files of the working directory, of any shard
+  count: data files, hint files and the leftovers of interrupted hint
+  writes (.tmp) and compactions (.compact), same as make cleandb.
+  hints_only keeps the data files, the next start replays the whole log.
+  Blocking calls, only between the measured phases.
+*/
+inline void remove_data_files(bool hints_only = false) {
+  namespace fs = std::filesystem;
+  std::vector<fs::path> victims;
+  for (const auto &entry : fs::directory_iterator(".")) {
+    const std::string name = entry.path().filename().string();
+    if (!name.starts_with("kvdb_data.")) {
+      continue;
+    }
+    const bool hint = name.ends_with(".hint") || name.ends_with(".hint.tmp");
+    const bool data = name.ends_with(".bin") || name.ends_with(".bin.compact");
+    if (hint || (data && !hints_only)) {
+      victims.push_back(entry.path());
+    }
+  }
+  for (const auto &path : victims) {
+    fs::remove(path);
+  }
+}
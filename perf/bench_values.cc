@@ -0,0 +1,157 @@
+/*
+  Value path allocation benchmark.
+
+  For each value size a database with the cache and the disk layers is
+  filled through set, then every key is read back through get (cache
+  hits), then the database is restarted with the disk layer only and
+  every key is read again (disk reads). The requests are issued from
+  shard 0 like the HTTP handlers do, so most keys hop to their owner
+  shard. Keys and values are prepared before each phase, only the
+  requests are measured: time, allocations and frees of memory
+  allocated by another shard per request, summed over all shards.
+*/
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/app-template.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/memory.hh>
+#include <seastar/core/print.hh>
+#include <boost/range/irange.hpp>
+#include <chrono>
+#include <cstring>
+#include <unistd.h>
+
+#include "../server/store_cache.hh"
+#include "../server/store_disk.hh"
+#include "bench_util.hh"
+
+using namespace seastar;
+using namespace kvdb;
+
+namespace bpo = boost::program_options;
+
+struct AllocStats {
+  uint64_t mallocs{0};
+  uint64_t cross_cpu_frees{0};
+
+  AllocStats operator-(const AllocStats &o) const {
+    return AllocStats{mallocs - o.mallocs, cross_cpu_frees - o.cross_cpu_frees};
+  }
+};
+
+// allocator counters summed over all shards
+future<AllocStats> alloc_stats() {
+  AllocStats total;
+  for (unsigned shard = 0; shard < smp::count; ++shard) {
+    const AllocStats s = co_await smp::submit_to(shard, [] {
+      const auto stats = memory::stats();
+      return AllocStats{stats.mallocs(), stats.cross_cpu_frees()};
+    });
+    total.mallocs += s.mallocs;
+    total.cross_cpu_frees += s.cross_cpu_frees;
+  }
+  co_return total;
+}
+
+struct Result {
+  const char *phase;
+  size_t value_size;
+  double ns_per_op;
+  double mallocs_per_op;
+  double cross_cpu_frees_per_op;
+};
+
+// run op(i) for every key, concurrently up to parallel
+template <typename Op>
+future<Result> measure(const char *phase, size_t value_size, size_t ops, unsigned parallel, Op op) {
+  const AllocStats before = co_await alloc_stats();
+  const auto started = std::chrono::steady_clock::now();
+  co_await max_concurrent_for_each(boost::irange<size_t>(0, ops), parallel, std::move(op));
+  const double elapsed = seconds_since(started);
+  const AllocStats used = co_await alloc_stats() - before;
+  co_return Result{phase, value_size, elapsed * 1e9 / ops, double(used.mallocs) / ops, double(used.cross_cpu_frees) / ops};
+}
+
+future<> bench_value_size(size_t value_size, size_t ops, unsigned parallel, std::vector<Result> &results) {
+  std::vector<std::string> keys;
+  keys.reserve(ops);
+  for (size_t i = 0; i < ops; ++i) {
+    keys.push_back(fmt::format("key{:0>12}", i));
+  }
+  // a buffer of its own for each set, it goes to the key owner shard
+  std::vector<Value> values;
+  values.reserve(ops);
+  for (size_t i = 0; i < ops; ++i) {
+    values.emplace_back(value_size);
+    memset(values.back().get_write(), 'v', value_size);
+  }
+  size_t misses = 0;
+
+  {
+    database db({new CacheStorage(0.5, CachePolicy::lru), new DiskStorage()});
+    co_await db.start();
+    results.push_back(co_await measure("set", value_size, ops, parallel, [&] (size_t i) {
+      return db.set(keys[i], std::move(values[i])).discard_result();
+    }));
+    results.push_back(co_await measure("get cache", value_size, ops, parallel, [&] (size_t i) {
+      return db.get(keys[i]).then([&misses] (Value value) {
+        misses += value.empty();
+      });
+    }));
+    co_await db.stop();
+  }
+  {
+    database db({new DiskStorage()});
+    co_await db.start();
+    results.push_back(co_await measure("get disk", value_size, ops, parallel, [&] (size_t i) {
+      return db.get(keys[i]).then([&misses] (Value value) {
+        misses += value.empty();
+      });
+    }));
+    co_await db.stop();
+  }
+  if (misses > 0) {
+    fmt::print("Error: {} keys not found with {}B values\n", misses, value_size);
+  }
+  remove_data_files();
+}
+
+int main(int ac, char** av) {
+    app_template app;
+
+    app.add_options()
+        ("dir", bpo::value<std::string>()->default_value("/tmp/kvdb_bench"), "working directory (its data files are removed!)")
+        ("value-sizes", bpo::value<std::vector<size_t>>()->multitoken()->default_value({100, 4096, 65536}, "100 4096 65536"), "value sizes in bytes")
+        ("ops", bpo::value<size_t>()->default_value(20000), "requests of each kind")
+        ("parallel", bpo::value<unsigned>()->default_value(64), "max. concurrent requests");
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        const auto dir = config["dir"].as<std::string>();
+        const auto value_sizes = config["value-sizes"].as<std::vector<size_t>>();
+        const auto ops = config["ops"].as<size_t>();
+        const auto parallel = config["parallel"].as<unsigned>();
+
+        co_await recursive_touch_directory(dir);
+        if (chdir(dir.c_str()) != 0) {
+            fmt::print("Error: can't change directory to {}\n", dir);
+            co_return -1;
+        }
+        remove_data_files();
+
+        std::vector<Result> results;
+        for (size_t value_size : value_sizes) {
+            co_await bench_value_size(value_size, ops, parallel, results);
+        }
+
+        fmt::print("========== value path benchmark ============\n");
+        fmt::print("Shards: {}, requests: {}, parallel: {}\n", smp::count, ops, parallel);
+        fmt::print("{:>10} {:>10} {:>10} {:>12} {:>16}\n", "request", "value", "ns/op", "mallocs/op", "cross frees/op");
+        for (const auto &r : results) {
+            fmt::print("{:>10} {:>10} {:>10.0f} {:>12.2f} {:>16.2f}\n", r.phase, r.value_size, r.ns_per_op,
+                       r.mallocs_per_op, r.cross_cpu_frees_per_op);
+        }
+        co_return 0;
+    });
+}
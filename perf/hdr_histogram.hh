@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/*
+  Latency histogram with HDR style buckets: exact below 128 ns, then 64
+  linear sub-buckets per power of 2 (values within 1.6% of the recorded
+  ones), up to 2^40 ns. Histograms of the shards are merged by adding them.
+*/
+class hdr_histogram {
+public:
+    static constexpr unsigned SUB_BUCKET_BITS = 7;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t(1) << SUB_BUCKET_BITS;   // 128
+    static constexpr unsigned MAX_BITS = 40;
+    static constexpr size_t BUCKETS = SUB_BUCKETS + (MAX_BITS - SUB_BUCKET_BITS) * (SUB_BUCKETS / 2);
+
+    hdr_histogram() : _counts(BUCKETS) {}
+
+    void add(std::chrono::nanoseconds d) {
+        const uint64_t ns = std::max<int64_t>(0, d.count());
+        ++_counts[index(std::min(ns, (uint64_t(1) << MAX_BITS) - 1))];
+        ++_count;
+        _sum += ns;
+        _max = std::max(_max, ns);
+    }
+
+    hdr_histogram &operator+=(const hdr_histogram &o) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            _counts[i] += o._counts[i];
+        }
+        _count += o._count;
+        _sum += o._sum;
+        _max = std::max(_max, o._max);
+        return *this;
+    }
+
+    uint64_t count() const { return _count; }
+    std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(_max); }
+    std::chrono::nanoseconds mean() const { return std::chrono::nanoseconds(_count ? _sum / _count : 0); }
+
+    // value at or below which the percentile p (0 to 100) of the samples are,
+    // the highest value of its bucket
+    std::chrono::nanoseconds percentile(double p) const {
+        if (_count == 0) {
+            return std::chrono::nanoseconds(0);
+        }
+        const uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(p / 100 * _count)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += _counts[i];
+            if (seen >= rank) {
+                return std::chrono::nanoseconds(std::min(highest_value(i), _max));
+            }
+        }
+        return max();
+    }
+
+private:
+    static size_t index(uint64_t v) {
+        if (v < SUB_BUCKETS) {
+            return v;
+        }
+        // top SUB_BUCKET_BITS bits of the value, the first one always set
+        const unsigned shift = std::bit_width(v) - SUB_BUCKET_BITS;
+        return SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2) + ((v >> shift) - SUB_BUCKETS / 2);
+    }
+
+    static uint64_t highest_value(size_t i) {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        const unsigned shift = (i - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+        const uint64_t sub = (i - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> _counts;
+    uint64_t _count{0};
+    uint64_t _sum{0};
+    uint64_t _max{0};
+};
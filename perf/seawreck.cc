@@ -19,14 +19,39 @@
  * Copyright (C) 2015 Cloudius Systems, Ltd.
  */
 
-#include <seastar/http/response_parser.hh>
+/*
+  Workload driver of the key/value REST API, YCSB style: the key space is
+  preloaded, then each connection runs a mix of get, set, query and delete
+  requests (the YCSB core workloads A-F or custom proportions) on keys picked
+  by a uniform, zipfian or latest distribution, with values of a fixed or
+  uniformly distributed size.
+
+  Closed loop by default: a connection sends its next request once it gets
+  the reply. With a target rate (open loop) the requests of each connection
+  are due on a fixed timeline and their latency is measured from the time
+  they were due, so a server falling behind is charged with the queueing
+  delay it causes (no coordinated omission). Latency percentiles come from
+  the merged per shard histograms, the results can be written as JSON.
+*/
+
 #include <seastar/net/api.hh>
 #include <seastar/core/seastar.hh>
 #include <seastar/core/print.hh>
 #include <seastar/core/app-template.hh>
 #include <seastar/core/distributed.hh>
-#include <seastar/core/semaphore.hh>
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/loop.hh>
+#include <seastar/core/sleep.hh>
+#include <seastar/core/fstream.hh>
+#include <boost/algorithm/string/predicate.hpp>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string_view>
+
+#include "hdr_histogram.hh"
 
 using namespace seastar;
 
@@ -37,25 +62,319 @@ void http_debug(const char* fmt, Args&&... args) {
 #endif
 }
 
+/*
+  Operations of a workload: read (get), update (set of an existing key),
+  insert (set of a new key), scan (query of the keys following a key),
+  read-modify-write (get, then set of the same key) and delete.
+*/
+enum class op_type { read, update, insert, scan, rmw, del };
+static constexpr size_t OP_TYPES = 6;
+static const char *op_names[OP_TYPES] = { "read", "update", "insert", "scan", "rmw", "delete" };
+
+enum class key_distribution { uniform, zipfian, latest };
+
+struct workload {
+    std::array<double, OP_TYPES> proportions{};
+    key_distribution distribution = key_distribution::zipfian;
+};
+
+// YCSB core workloads
+static bool workload_preset(std::string_view name, workload &w) {
+    w = workload{};
+    auto &p = w.proportions;
+    if (name == "a") {          // update heavy
+        p[size_t(op_type::read)] = 0.5;
+        p[size_t(op_type::update)] = 0.5;
+    } else if (name == "b") {   // read mostly
+        p[size_t(op_type::read)] = 0.95;
+        p[size_t(op_type::update)] = 0.05;
+    } else if (name == "c") {   // read only
+        p[size_t(op_type::read)] = 1;
+    } else if (name == "d") {   // read latest
+        p[size_t(op_type::read)] = 0.95;
+        p[size_t(op_type::insert)] = 0.05;
+        w.distribution = key_distribution::latest;
+    } else if (name == "e") {   // short ranges
+        p[size_t(op_type::scan)] = 0.95;
+        p[size_t(op_type::insert)] = 0.05;
+    } else if (name == "f") {   // read-modify-write
+        p[size_t(op_type::read)] = 0.5;
+        p[size_t(op_type::rmw)] = 0.5;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parse_distribution(std::string_view name, key_distribution &d) {
+    if (name == "uniform") {
+        d = key_distribution::uniform;
+    } else if (name == "zipfian") {
+        d = key_distribution::zipfian;
+    } else if (name == "latest") {
+        d = key_distribution::latest;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+struct workload_options {
+    workload mix;
+    std::string host;
+    uint64_t keys{0};                 // preloaded key space
+    double zipf_theta{0.99};
+    size_t value_size{100};
+    size_t value_size_max{100};       // sizes uniform in [value_size, value_size_max]
+    unsigned scan_max{100};           // scan lengths uniform in [1, scan_max]
+    uint64_t seed{0};
+    double rate{0};                   // requests per second of all connections, 0 - closed loop
+};
+
+/*
+  Zipfian ranks in [0, n), rank 0 the most popular (Gray et al., "Quickly
+  generating billion-record synthetic databases", as in YCSB). The item
+  count may grow (inserts), zeta is then extended by the new terms only.
+*/
+class zipfian_generator {
+public:
+    explicit zipfian_generator(double theta)
+        : _theta(theta), _alpha(1 / (1 - theta)), _zeta2(1 + std::pow(0.5, theta)) {}
+
+    // u uniform in [0, 1)
+    uint64_t next(uint64_t n, double u) {
+        if (n != _n) {
+            resize(n);
+        }
+        const double uz = u * _zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, _theta)) {
+            return 1;
+        }
+        return std::min<uint64_t>(n - 1, uint64_t(n * std::pow(_eta * u - _eta + 1, _alpha)));
+    }
+
+private:
+    void resize(uint64_t n) {
+        if (n < _n) {
+            _zetan = 0;
+            _n = 0;
+        }
+        for (uint64_t i = _n + 1; i <= n; ++i) {
+            _zetan += 1 / std::pow(double(i), _theta);
+        }
+        _n = n;
+        _eta = (1 - std::pow(2.0 / n, 1 - _theta)) / (1 - _zeta2 / _zetan);
+    }
+
+    double _theta;
+    double _alpha;
+    double _zeta2;
+    uint64_t _n{0};
+    double _zetan{0};
+    double _eta{0};
+};
+
+// popular keys spread over the key space rather than the first ones
+static uint64_t scramble(uint64_t rank) {
+    // FNV-1a of the rank bytes
+    uint64_t h = 0xcbf29ce484222325;
+    for (int i = 0; i < 8; ++i) {
+        h ^= (rank >> (i * 8)) & 0xff;
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+// keys sort in their index order, scans follow it
+static std::string key_name(uint64_t index) {
+    return fmt::format("user{:0>12}", index);
+}
+
+/*
+  Incremental HTTP/1.1 reply parser: status line, headers, then a body of
+  Content-Length bytes or chunks (chunked transfer encoding, used by the
+  streamed replies). The body is skipped.
+*/
+class reply_parser {
+public:
+    void init() {
+        _state = state::status_line;
+        _line.clear();
+        _status = 0;
+        _remaining = 0;
+        _chunked = false;
+    }
+
+    // parse the next bytes of the reply, returns the bytes consumed
+    // (less than size once the reply is done, the rest is the next reply)
+    size_t feed(const char *data, size_t size) {
+        size_t pos = 0;
+        while (pos < size && !done()) {
+            if (_state == state::body || _state == state::chunk_data) {
+                const size_t n = std::min<uint64_t>(_remaining, size - pos);
+                pos += n;
+                _remaining -= n;
+                if (_remaining == 0) {
+                    _state = _state == state::body ? state::done : state::chunk_end;
+                }
+                continue;
+            }
+            const char *eol = static_cast<const char*>(memchr(data + pos, '\n', size - pos));
+            if (!eol) {
+                _line.append(data + pos, size - pos);
+                pos = size;
+                break;
+            }
+            _line.append(data + pos, eol - (data + pos));
+            pos = eol - data + 1;
+            if (!_line.empty() && _line.back() == '\r') {
+                _line.pop_back();
+            }
+            on_line();
+            _line.clear();
+        }
+        return pos;
+    }
+
+    bool done() const { return _state == state::done || _state == state::error; }
+    bool failed() const { return _state == state::error; }
+    unsigned status() const { return _status; }
+
+private:
+    enum class state { status_line, header, body, chunk_size, chunk_data, chunk_end, trailer, done, error };
+
+    void on_line() {
+        switch (_state) {
+        case state::status_line: {
+            // HTTP/1.1 200 OK
+            const size_t sp = _line.find(' ');
+            if (!_line.starts_with("HTTP/") || sp == std::string::npos) {
+                _state = state::error;
+                return;
+            }
+            _status = std::atoi(_line.c_str() + sp + 1);
+            _state = state::header;
+            break;
+        }
+        case state::header: {
+            if (_line.empty()) {
+                _state = _chunked ? state::chunk_size : _remaining > 0 ? state::body : state::done;
+                return;
+            }
+            const size_t colon = _line.find(':');
+            if (colon == std::string::npos) {
+                _state = state::error;
+                return;
+            }
+            const std::string_view name(_line.data(), colon);
+            std::string_view value = std::string_view(_line).substr(colon + 1);
+            value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+            if (boost::iequals(name, "Content-Length")) {
+                _remaining = std::strtoull(value.data(), nullptr, 10);
+            } else if (boost::iequals(name, "Transfer-Encoding")) {
+                _chunked = boost::iequals(value, "chunked");
+            }
+            break;
+        }
+        case state::chunk_size: {
+            char *end;
+            _remaining = std::strtoull(_line.c_str(), &end, 16);
+            if (end == _line.c_str()) {
+                _state = state::error;
+                return;
+            }
+            _state = _remaining > 0 ? state::chunk_data : state::trailer;
+            break;
+        }
+        case state::chunk_end:
+            _state = _line.empty() ? state::chunk_size : state::error;
+            break;
+        case state::trailer:
+            if (_line.empty()) {
+                _state = state::done;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    state _state{state::status_line};
+    std::string _line;
+    unsigned _status{0};
+    uint64_t _remaining{0};
+    bool _chunked{false};
+};
+
+struct op_stats {
+    uint64_t ops{0};
+    uint64_t misses{0};               // key not found (404)
+    uint64_t errors{0};
+    hdr_histogram latency;
+
+    op_stats &operator+=(const op_stats &o) {
+        ops += o.ops;
+        misses += o.misses;
+        errors += o.errors;
+        latency += o.latency;
+        return *this;
+    }
+};
+
+using workload_stats = std::array<op_stats, OP_TYPES>;
+
 class http_client {
 private:
+    workload_options _opts;
     unsigned _duration;
     unsigned _conn_per_core;
     unsigned _reqs_per_conn;
-    std::vector<connected_socket> _sockets;
-    semaphore _conn_connected{0};
-    semaphore _conn_finished{0};
+    // open loop: time between the requests of a connection, 0 - closed loop
+    std::chrono::nanoseconds _send_interval{0};
     timer<> _run_timer;
     bool _timer_based;
     bool _timer_done{false};
     uint64_t _total_reqs{0};
+    std::mt19937_64 _rng;
+    std::uniform_real_distribution<double> _uniform{0, 1};
+    zipfian_generator _zipf;
+    std::array<double, OP_TYPES> _op_cdf{};
+    // keys inserted by this shard, shard s inserts keys + i * shards + s
+    uint64_t _inserted{0};
+    uint64_t _preload_next;
+    // values are slices of random letters
+    std::string _value_pool;
+    workload_stats _stats;
 public:
-    http_client(unsigned duration, unsigned total_conn, unsigned reqs_per_conn)
-        : _duration(duration)
+    http_client(workload_options opts, unsigned duration, unsigned total_conn, unsigned reqs_per_conn)
+        : _opts(std::move(opts))
+        , _duration(duration)
         , _conn_per_core(total_conn / smp::count)
         , _reqs_per_conn(reqs_per_conn)
         , _run_timer([this] { _timer_done = true; })
-        , _timer_based(reqs_per_conn == 0) {
+        , _timer_based(reqs_per_conn == 0)
+        , _rng(_opts.seed * 1000003 + this_shard_id())
+        , _zipf(_opts.zipf_theta)
+        , _preload_next(this_shard_id()) {
+        if (_opts.rate > 0) {
+            _send_interval = std::chrono::nanoseconds(uint64_t(1e9 * total_conn / _opts.rate));
+        }
+        double sum = 0;
+        for (double p : _opts.mix.proportions) {
+            sum += p;
+        }
+        double cdf = 0;
+        for (size_t i = 0; i < OP_TYPES; ++i) {
+            cdf += _opts.mix.proportions[i] / sum;
+            _op_cdf[i] = cdf;
+        }
+        _value_pool.resize(_opts.value_size_max * 2 + 1);
+        for (char &c : _value_pool) {
+            c = 'a' + _rng() % 26;
+        }
     }
 
     class connection {
@@ -63,59 +382,205 @@ public:
         connected_socket _fd;
         input_stream<char> _read_buf;
         output_stream<char> _write_buf;
-        http_response_parser _parser;
+        reply_parser _parser;
+        // received bytes not parsed yet
+        temporary_buffer<char> _unparsed;
         http_client* _http_client;
+        // open loop: timeline offset of the connection among all the connections
+        std::chrono::nanoseconds _send_offset;
         uint64_t _nr_done{0};
     public:
-        connection(connected_socket&& fd, http_client* client)
+        connection(connected_socket&& fd, http_client* client, std::chrono::nanoseconds send_offset)
             : _fd(std::move(fd))
             , _read_buf(_fd.input())
             , _write_buf(_fd.output())
-            , _http_client(client){
+            , _http_client(client)
+            , _send_offset(send_offset) {
         }
 
         uint64_t nr_done() {
             return _nr_done;
         }
 
-        future<> do_req() {
-            return _write_buf.write("GET / HTTP/1.1\r\nHost: 127.0.0.1:10000\r\n\r\n").then([this] {
-                return _write_buf.flush();
-            }).then([this] {
-                _parser.init();
-                return _read_buf.consume(_parser).then([this] {
-                    // Read HTTP response header first
-                    if (_parser.eof()) {
-                        return make_ready_future<>();
+        // POST a request, returns the reply status
+        future<unsigned> request(std::string_view path, std::string_view body) {
+            co_await _write_buf.write(fmt::format("POST {} HTTP/1.1\r\nHost: {}\r\nContent-Length: {}\r\n\r\n{}",
+                                                  path, _http_client->host(), body.size(), body));
+            co_await _write_buf.flush();
+            _parser.init();
+            while (!_parser.done()) {
+                if (_unparsed.empty()) {
+                    _unparsed = co_await _read_buf.read();
+                    if (_unparsed.empty()) {
+                        throw std::runtime_error("connection closed by the server");
                     }
-                    auto _rsp = _parser.get_parsed_response();
-                    auto it = _rsp->_headers.find("Content-Length");
-                    if (it == _rsp->_headers.end()) {
-                        fmt::print("Error: HTTP response does not contain: Content-Length\n");
-                        return make_ready_future<>();
+                }
+                _unparsed.trim_front(_parser.feed(_unparsed.get(), _unparsed.size()));
+            }
+            if (_parser.failed()) {
+                throw std::runtime_error("malformed HTTP reply");
+            }
+            http_debug("%s %d\n", std::string(path).c_str(), _parser.status());
+            co_return _parser.status();
+        }
+
+        future<unsigned> set(uint64_t key) {
+            return request("/v1/set", fmt::format("{{ \"key\" : \"{}\", \"value\" : \"{}\" }}",
+                                                  key_name(key), _http_client->next_value()));
+        }
+
+        future<unsigned> get(uint64_t key) {
+            return request("/v1/get", fmt::format("{{ \"key\" : \"{}\" }}", key_name(key)));
+        }
+
+        // run the next operation of the mix, its latency counts from start
+        future<> do_op(std::chrono::steady_clock::time_point start) {
+            const op_type op = _http_client->next_op();
+            unsigned status = 0;
+            switch (op) {
+            case op_type::read:
+                status = co_await get(_http_client->next_key());
+                break;
+            case op_type::update:
+                status = co_await set(_http_client->next_key());
+                break;
+            case op_type::insert:
+                status = co_await set(_http_client->next_insert_key());
+                break;
+            case op_type::scan:
+                status = co_await request("/v1/query", fmt::format("{{ \"prefix\" : \"user\", \"cursor\" : \"{}\", \"limit\" : {} }}",
+                                                                   key_name(_http_client->next_key()), _http_client->next_scan_length()));
+                break;
+            case op_type::rmw: {
+                const uint64_t key = _http_client->next_key();
+                status = co_await get(key);
+                const unsigned set_status = co_await set(key);
+                if (set_status >= 400) {
+                    status = set_status;
+                }
+                break;
+            }
+            case op_type::del:
+                status = co_await request("/v1/delete", fmt::format("{{ \"key\" : \"{}\" }}", key_name(_http_client->next_key())));
+                break;
+            }
+            _http_client->record(op, status, std::chrono::steady_clock::now() - start);
+        }
+
+        future<> run() {
+            const auto interval = _http_client->send_interval();
+            auto due = std::chrono::steady_clock::now() + _send_offset;
+            while (!_http_client->done(_nr_done)) {
+                if (interval.count() == 0) {
+                    // closed loop: the next request is sent once the reply is received
+                    co_await do_op(std::chrono::steady_clock::now());
+                } else {
+                    // open loop: a request late because of the previous reply
+                    // is sent at once, its latency still counts from its due time
+                    const auto now = std::chrono::steady_clock::now();
+                    if (now < due) {
+                        co_await seastar::sleep(due - now);
                     }
-                    auto content_len = std::stoi(it->second);
-                    http_debug("Content-Length = %d\n", content_len);
-                    // Read HTTP response body
-                    return _read_buf.read_exactly(content_len).then([this] (temporary_buffer<char> buf) {
-                        _nr_done++;
-                        http_debug("%s\n", buf.get());
-                        if (_http_client->done(_nr_done)) {
-                            return make_ready_future();
-                        } else {
-                            return do_req();
-                        }
-                    });
-                });
-            });
+                    co_await do_op(due);
+                    due += interval;
+                }
+                _nr_done++;
+            }
+        }
+
+        future<> preload() {
+            uint64_t key;
+            while (_http_client->next_preload(key)) {
+                const unsigned status = co_await set(key);
+                if (status >= 400) {
+                    throw std::runtime_error(fmt::format("preload set failed with status {}", status));
+                }
+            }
+        }
+
+        future<> close() {
+            return _write_buf.close();
         }
     };
 
+    const std::string &host() const {
+        return _opts.host;
+    }
+
+    std::chrono::nanoseconds send_interval() const {
+        return _send_interval;
+    }
+
+    op_type next_op() {
+        const double u = _uniform(_rng);
+        for (size_t i = 0; i < OP_TYPES - 1; ++i) {
+            if (u < _op_cdf[i]) {
+                return op_type(i);
+            }
+        }
+        return op_type(OP_TYPES - 1);
+    }
+
+    // existing key (inserts of the other shards are assumed as many as the local ones)
+    uint64_t next_key() {
+        const uint64_t n = std::max<uint64_t>(1, _opts.keys + _inserted * smp::count);
+        switch (_opts.mix.distribution) {
+        case key_distribution::uniform:
+            return _rng() % n;
+        case key_distribution::zipfian:
+            return scramble(_zipf.next(n, _uniform(_rng))) % n;
+        case key_distribution::latest:
+            break;
+        }
+        return n - 1 - _zipf.next(n, _uniform(_rng));
+    }
+
+    uint64_t next_insert_key() {
+        return _opts.keys + _inserted++ * smp::count + this_shard_id();
+    }
+
+    std::string_view next_value() {
+        size_t size = _opts.value_size;
+        if (_opts.value_size_max > _opts.value_size) {
+            size += _rng() % (_opts.value_size_max - _opts.value_size + 1);
+        }
+        return std::string_view(_value_pool).substr(_rng() % (_value_pool.size() - size + 1), size);
+    }
+
+    unsigned next_scan_length() {
+        return 1 + _rng() % _opts.scan_max;
+    }
+
+    // next key preloaded by this shard
+    bool next_preload(uint64_t &key) {
+        if (_preload_next >= _opts.keys) {
+            return false;
+        }
+        key = _preload_next;
+        _preload_next += smp::count;
+        return true;
+    }
+
+    void record(op_type op, unsigned status, std::chrono::steady_clock::duration latency) {
+        op_stats &s = _stats[size_t(op)];
+        ++s.ops;
+        s.latency.add(latency);
+        if (status == 404 && op != op_type::update && op != op_type::insert) {
+            ++s.misses;
+        } else if (status >= 400) {
+            ++s.errors;
+        }
+    }
+
     future<uint64_t> total_reqs() {
         fmt::print("Requests on cpu {:2d}: {:d}\n", this_shard_id(), _total_reqs);
         return make_ready_future<uint64_t>(_total_reqs);
     }
 
+    workload_stats stats() const {
+        return _stats;
+    }
+
     bool done(uint64_t nr_done) {
         if (_timer_based) {
             return _timer_done;
@@ -127,14 +592,18 @@ public:
     future<> connect(ipv4_addr server_addr) {
         // Establish all the TCP connections first
         for (unsigned i = 0; i < _conn_per_core; i++) {
-            // Connect in the background, signal _conn_connected when done.
-            (void)seastar::connect(make_ipv4_address(server_addr)).then([this] (connected_socket fd) {
-                _sockets.push_back(std::move(fd));
-                http_debug("Established connection %6d on cpu %3d\n", _conn_connected.current(), this_shard_id());
-                _conn_connected.signal();
-            }).or_terminate();
+            connected_socket fd = co_await seastar::connect(make_ipv4_address(server_addr));
+            // the timelines of all the connections are spread evenly over the interval
+            const auto offset = _send_interval * (i * smp::count + this_shard_id()) / (_conn_per_core * smp::count);
+            _connections.push_back(std::make_unique<connection>(std::move(fd), this, offset));
+            http_debug("Established connection %6d on cpu %3d\n", i, this_shard_id());
         }
-        return _conn_connected.wait(_conn_per_core);
+    }
+
+    future<> preload() {
+        return parallel_for_each(_connections, [] (auto &conn) {
+            return conn->preload();
+        });
     }
 
     future<> run() {
@@ -143,32 +612,73 @@ public:
         if (_timer_based) {
             _run_timer.arm(std::chrono::seconds(_duration));
         }
-        for (auto&& fd : _sockets) {
-            auto conn = new connection(std::move(fd), this);
-            // Run in the background, signal _conn_finished when done.
-            (void)conn->do_req().then_wrapped([this, conn] (auto&& f) {
-                http_debug("Finished connection %6d on cpu %3d\n", _conn_finished.current(), this_shard_id());
-                _total_reqs += conn->nr_done();
-                _conn_finished.signal();
-                delete conn;
-                // FIXME: should _conn_finished.signal be called only after this?
-                // nothing seems to synchronize with this background work.
-                try {
-                    f.get();
-                } catch (std::exception& ex) {
-                    fmt::print("http request error: {}\n", ex.what());
-                }
-            });
-        }
+        return parallel_for_each(_connections, [this] (auto &conn) {
+            return run_connection(*conn);
+        });
+    }
 
-        // All finished
-        return _conn_finished.wait(_conn_per_core);
+    future<> run_connection(connection &conn) {
+        try {
+            co_await conn.run();
+        } catch (std::exception& ex) {
+            fmt::print("http request error: {}\n", ex.what());
+        }
+        _total_reqs += conn.nr_done();
     }
+
     future<> stop() {
-        return make_ready_future();
+        for (auto &conn : _connections) {
+            co_await conn->close();
+        }
     }
+
+private:
+    std::vector<std::unique_ptr<connection>> _connections;
 };
 
+static double us(std::chrono::nanoseconds d) {
+    return d.count() / 1000.0;
+}
+
+struct run_summary {
+    std::string workload;
+    double target_rate;
+    unsigned connections;
+    double secs;
+    uint64_t requests;
+};
+
+// results of a run, for comparing runs with scripts
+static std::string results_json(const run_summary &run, const workload_stats &stats) {
+    std::string out = fmt::format("{{ \"workload\" : \"{}\", \"mode\" : \"{}\", \"target_rate\" : {}, \"shards\" : {}, "
+                                  "\"connections\" : {}, \"duration_s\" : {:.3f}, \"requests\" : {}, \"requests_per_sec\" : {:.1f}, \"ops\" : {{ ",
+                                  run.workload, run.target_rate > 0 ? "open" : "closed", run.target_rate, smp::count,
+                                  run.connections, run.secs, run.requests, run.requests / run.secs);
+    bool first = true;
+    for (size_t i = 0; i < OP_TYPES; ++i) {
+        const op_stats &s = stats[i];
+        if (s.ops == 0) {
+            continue;
+        }
+        const hdr_histogram &h = s.latency;
+        out += fmt::format("{}\"{}\" : {{ \"count\" : {}, \"ops_per_sec\" : {:.1f}, \"misses\" : {}, \"errors\" : {}, "
+                           "\"latency_us\" : {{ \"mean\" : {:.1f}, \"p50\" : {:.1f}, \"p90\" : {:.1f}, \"p99\" : {:.1f}, \"p99.9\" : {:.1f}, \"max\" : {:.1f} }} }}",
+                           first ? "" : ", ", op_names[i], s.ops, s.ops / run.secs, s.misses, s.errors,
+                           us(h.mean()), us(h.percentile(50)), us(h.percentile(90)), us(h.percentile(99)), us(h.percentile(99.9)), us(h.max()));
+        first = false;
+    }
+    out += " } }\n";
+    return out;
+}
+
+future<> write_file(std::string name, std::string content) {
+    file f = co_await open_file_dma(name, open_flags::wo | open_flags::create | open_flags::truncate);
+    output_stream<char> out = co_await make_file_output_stream(std::move(f));
+    co_await out.write(content);
+    co_await out.flush();
+    co_await out.close();
+}
+
 namespace bpo = boost::program_options;
 
 int main(int ac, char** av) {
@@ -180,7 +690,26 @@ int main(int ac, char** av) {
         ("server,s", bpo::value<std::string>()->default_value("127.0.0.1:10000"), "Server address")
         ("conn,c", bpo::value<unsigned>()->default_value(100), "total connections")
         ("reqs,r", bpo::value<unsigned>()->default_value(0), "reqs per connection")
-        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds)");
+        ("duration,d", bpo::value<unsigned>()->default_value(10), "duration of the test in seconds)")
+        ("workload,w", bpo::value<std::string>()->default_value("a"), "YCSB core workload: a (50% read, 50% update), b (95% read, 5% update), "
+            "c (read only), d (95% read, 5% insert, latest keys), e (95% scan, 5% insert), f (50% read, 50% read-modify-write)")
+        ("read", bpo::value<double>(), "proportion of reads (get), instead of the workload one")
+        ("update", bpo::value<double>(), "proportion of updates (set of an existing key)")
+        ("insert", bpo::value<double>(), "proportion of inserts (set of a new key)")
+        ("scan", bpo::value<double>(), "proportion of scans (query of the keys following a key)")
+        ("rmw", bpo::value<double>(), "proportion of read-modify-writes (get and set)")
+        ("delete", bpo::value<double>(), "proportion of deletes")
+        ("distribution", bpo::value<std::string>(), "key distribution: uniform, zipfian, latest (instead of the workload one)")
+        ("zipf-theta", bpo::value<double>()->default_value(0.99), "zipfian distribution skew, in (0, 1)")
+        ("keys,k", bpo::value<uint64_t>()->default_value(100000), "key space size (keys preloaded)")
+        ("value-size", bpo::value<size_t>()->default_value(100), "value size in bytes")
+        ("value-size-max", bpo::value<size_t>()->default_value(0), "values sizes uniform between value-size and this (0 - all value-size)")
+        ("scan-max", bpo::value<unsigned>()->default_value(100), "max. keys of a scan, lengths are uniform from 1")
+        ("preload", bpo::value<bool>()->default_value(true), "set all the keys before running the workload")
+        ("seed", bpo::value<uint64_t>()->default_value(0), "random generator seed")
+        ("rate", bpo::value<double>()->default_value(0), "open loop: target requests per second of all the connections, "
+            "sent on a fixed timeline (0 - closed loop, a connection sends once it has the previous reply)")
+        ("json", bpo::value<std::string>()->default_value(""), "write the results in JSON to this file");
 
     return app.run(ac, av, [&app] () -> future<int> {
         auto& config = app.configuration();
@@ -191,41 +720,104 @@ int main(int ac, char** av) {
 
         if (total_conn % smp::count != 0) {
             fmt::print("Error: conn needs to be n * cpu_nr\n");
-            return make_ready_future<int>(-1);
+            co_return -1;
         }
 
-        auto http_clients = new distributed<http_client>;
+        workload_options opts;
+        const auto workload_name = config["workload"].as<std::string>();
+        if (!workload_preset(workload_name, opts.mix)) {
+            fmt::print("Error: unknown workload {}\n", workload_name);
+            co_return -1;
+        }
+        double proportions = 0;
+        for (size_t i = 0; i < OP_TYPES; ++i) {
+            if (config.count(op_names[i])) {
+                opts.mix.proportions[i] = config[op_names[i]].as<double>();
+            }
+            proportions += opts.mix.proportions[i];
+        }
+        if (proportions <= 0) {
+            fmt::print("Error: no operations in the mix\n");
+            co_return -1;
+        }
+        if (config.count("distribution") && !parse_distribution(config["distribution"].as<std::string>(), opts.mix.distribution)) {
+            fmt::print("Error: unknown key distribution {}\n", config["distribution"].as<std::string>());
+            co_return -1;
+        }
+        opts.host = server;
+        opts.keys = config["keys"].as<uint64_t>();
+        opts.zipf_theta = config["zipf-theta"].as<double>();
+        opts.value_size = config["value-size"].as<size_t>();
+        opts.value_size_max = std::max(opts.value_size, config["value-size-max"].as<size_t>());
+        opts.scan_max = std::max(1u, config["scan-max"].as<unsigned>());
+        opts.seed = config["seed"].as<uint64_t>();
+        opts.rate = config["rate"].as<double>();
+        if (opts.zipf_theta <= 0 || opts.zipf_theta >= 1) {
+            fmt::print("Error: zipf-theta needs to be in (0, 1)\n");
+            co_return -1;
+        }
+
+        auto http_clients = std::make_unique<distributed<http_client>>();
 
-        // Start http requests on all the cores
-        auto started = steady_clock_type::now();
         fmt::print("========== http_client ============\n");
         fmt::print("Server: {}\n", server);
         fmt::print("Connections: {:d}\n", total_conn);
         fmt::print("Requests/connection: {}\n", reqs_per_conn == 0 ? "dynamic (timer based)" : std::to_string(reqs_per_conn));
-        return http_clients->start(std::move(duration), std::move(total_conn), std::move(reqs_per_conn)).then([http_clients, server] {
-            return http_clients->invoke_on_all(&http_client::connect, ipv4_addr{server});
-        }).then([http_clients] {
-            return http_clients->invoke_on_all(&http_client::run);
-        }).then([http_clients] {
-            return http_clients->map_reduce(adder<uint64_t>(), &http_client::total_reqs);
-        }).then([http_clients, started] (auto total_reqs) {
-           // All the http requests are finished
-           auto finished = steady_clock_type::now();
-           auto elapsed = finished - started;
-           auto secs = static_cast<double>(elapsed.count() / 1000000000.0);
-           fmt::print("Total cpus: {:d}\n", smp::count);
-           fmt::print("Total requests: {:d}\n", total_reqs);
-           fmt::print("Total time: {:f}\n", secs);
-           fmt::print("Requests/sec: {:f}\n", static_cast<double>(total_reqs) / secs);
-           fmt::print("==========     done     ============\n");
-           return http_clients->stop().then([http_clients] {
-               // FIXME: If we call engine().exit(0) here to exit when
-               // requests are done. The tcp connection will not be closed
-               // properly, becasue we exit too earily and the FIN packets are
-               // not exchanged.
-                delete http_clients;
-                return make_ready_future<int>(0);
-           });
-        });
+        fmt::print("Workload: {}, keys: {}, values: {}-{} bytes\n", workload_name, opts.keys, opts.value_size, opts.value_size_max);
+        if (opts.rate > 0) {
+            fmt::print("Open loop, target rate: {} requests/sec\n", opts.rate);
+        }
+        co_await http_clients->start(opts, duration, total_conn, reqs_per_conn);
+        co_await http_clients->invoke_on_all(&http_client::connect, ipv4_addr{server});
+
+        if (config["preload"].as<bool>()) {
+            const auto preload_started = steady_clock_type::now();
+            co_await http_clients->invoke_on_all(&http_client::preload);
+            const double secs = std::chrono::duration<double>(steady_clock_type::now() - preload_started).count();
+            fmt::print("Preloaded {} keys in {:f} s\n", opts.keys, secs);
+        }
+
+        // Start http requests on all the cores
+        auto started = steady_clock_type::now();
+        co_await http_clients->invoke_on_all(&http_client::run);
+        // All the http requests are finished
+        auto finished = steady_clock_type::now();
+        const uint64_t total_reqs = co_await http_clients->map_reduce(adder<uint64_t>(), &http_client::total_reqs);
+        const workload_stats stats = co_await http_clients->map_reduce0(std::mem_fn(&http_client::stats), workload_stats{},
+            [] (workload_stats total, const workload_stats &s) {
+                for (size_t i = 0; i < OP_TYPES; ++i) {
+                    total[i] += s[i];
+                }
+                return total;
+            });
+        auto elapsed = finished - started;
+        auto secs = static_cast<double>(elapsed.count() / 1000000000.0);
+        fmt::print("Total cpus: {:d}\n", smp::count);
+        fmt::print("Total requests: {:d}\n", total_reqs);
+        fmt::print("Total time: {:f}\n", secs);
+        fmt::print("Requests/sec: {:f}\n", static_cast<double>(total_reqs) / secs);
+        if (opts.rate > 0 && total_reqs < 0.95 * opts.rate * secs) {
+            fmt::print("Warning: target rate not reached, more connections are needed\n");
+        }
+        fmt::print("Latency in us:\n");
+        fmt::print("{:>8} {:>12} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}\n", "op", "count", "ops/sec", "misses", "errors",
+                   "p50", "p99", "p99.9", "max");
+        for (size_t i = 0; i < OP_TYPES; ++i) {
+            const op_stats &s = stats[i];
+            if (s.ops == 0) {
+                continue;
+            }
+            fmt::print("{:>8} {:>12} {:>12.0f} {:>10} {:>10} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}\n", op_names[i], s.ops, s.ops / secs,
+                       s.misses, s.errors, us(s.latency.percentile(50)), us(s.latency.percentile(99)),
+                       us(s.latency.percentile(99.9)), us(s.latency.max()));
+        }
+        const auto json_name = config["json"].as<std::string>();
+        if (!json_name.empty()) {
+            co_await write_file(json_name, results_json(run_summary{workload_name, opts.rate, total_conn, secs, total_reqs}, stats));
+            fmt::print("Results written to {}\n", json_name);
+        }
+        fmt::print("==========     done     ============\n");
+        co_await http_clients->stop();
+        co_return 0;
     });
 }
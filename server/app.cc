@@ -10,10 +10,15 @@
 #include <seastar/core/print.hh>
 #include <seastar/net/inet_address.hh>
 #include <seastar/http/reply.hh>
+#include <seastar/core/prometheus.hh>
+#include <seastar/core/metrics.hh>
 #include "stop_signal.hh"
 
 #include "store_cache.hh"
 #include "store_disk.hh"
+#include "json_scan.hh"
+#include "resp.hh"
+#include "trace.hh"
 
 namespace bpo = boost::program_options;
 
@@ -23,123 +28,581 @@ using namespace kvdb;
 
 std::unique_ptr<database> g_db;
 
-void extract_json_value(sstring data, std::string_view key, std::string &out) {
-  const std::string pattern = fmt::format("\"{}\" : \"", key);
-  size_t start = data.find(pattern);
-  if (start != std::string::npos) {
-    start += pattern.size();
-    const size_t end = data.find("\"", start);
-    if (end != std::string::npos) {
-      out = data.substr(start, end-start);
-      return;
+// string written escaped into a JSON reply
+struct json_string {
+  std::string_view s;
+};
+
+template <>
+struct fmt::formatter<json_string> : fmt::formatter<std::string_view> {
+  template <typename FormatContext>
+  auto format(const json_string &js, FormatContext &ctx) const {
+    auto out = ctx.out();
+    write_json_escaped(js.s, [&out] (std::string_view chunk) { out = std::copy(chunk.begin(), chunk.end(), out); });
+    return out;
+  }
+};
+
+// request body, scanned in place
+static std::string_view content_of(const http::request &req) {
+  return std::string_view(req.content.data(), req.content.size());
+}
+
+// string member of the request body object
+static bool string_field(const JsonField &field, std::string &out) {
+  if (!field.value.is_string()) {
+    return false;
+  }
+  out = field.value.str();
+  return true;
+}
+
+// key member, at most MAX_KEY_SIZE bytes
+static bool key_field(const JsonField &field, std::string &out) {
+  return string_field(field, out) && out.size() <= MAX_KEY_SIZE;
+}
+
+// keys of an array member
+static bool key_array_field(const JsonField &field, std::vector<std::string> &out) {
+  std::vector<JsonValue> elements;
+  if (!field.value.is_array() || !scan_json_array(field.value.text, elements)) {
+    return false;
+  }
+  out.reserve(elements.size());
+  for (const auto &e : elements) {
+    if (!e.is_string()) {
+      return false;
+    }
+    out.push_back(e.str());
+    if (out.back().size() > MAX_KEY_SIZE) {
+      return false;
     }
   }
-  fmt::print("extract_json_value - failed\n");
+  return true;
+}
+
+// string member copied into a value buffer of its own
+static bool value_field(const JsonField &field, Value &out) {
+  if (!field.value.is_string()) {
+    return false;
+  }
+  if (field.value.escaped) {
+    const std::string value = field.value.str();
+    out = Value(value.data(), value.size());
+  } else {
+    out = Value(field.value.text.data(), field.value.text.size());
+  }
+  return true;
+}
+
+// reply to a request body without the expected members
+static std::unique_ptr<http::reply> bad_request(std::unique_ptr<http::reply> rep) {
+  fmt::print("malformed request body\n");
+  rep->set_status(http::reply::status_type::bad_request);  // 400
+  rep->_skip_body = true;
+  rep->done();
+  return rep;
+}
+
+/*
+  REST operation handler, the requests and their latency are counted per
+  operation and shard (handlers are created on each shard). Streamed replies
+  are timed until their stream is set up. Sampled requests are traced, the
+  trace is current while the handler runs until its first suspension.
+*/
+class rest_handler : public httpd::handler_base {
+public:
+    explicit rest_handler(const char *op) : _op(op) {
+        namespace sm = seastar::metrics;
+        const auto label = sm::label("op")(op);
+        _metrics.add_group("rest", {
+            sm::make_counter("requests", _requests, sm::description("REST requests"), {label}),
+            sm::make_counter("errors", _errors, sm::description("REST requests failed or answered with an error status"), {label}),
+            sm::make_histogram("latency", sm::description("REST request latency in seconds"), {label},
+                               [this] { return _latency.to_metrics(); }),
+        });
+    }
+
+    future<std::unique_ptr<http::reply> > handle(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) final {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<RequestTrace> trace = local_tracer().start(_op);
+        std::unique_ptr<http::reply> reply;
+        std::exception_ptr ex;
+        try {
+            reply = co_await traced(trace.get(), [&] { return handle_request(path, std::move(req), std::move(rep)); });
+        } catch (...) {
+            ex = std::current_exception();
+        }
+        ++_requests;
+        const auto took = std::chrono::steady_clock::now() - start;
+        _latency.add(took);
+        if (trace) [[unlikely]] {
+            trace->stage("reply");
+            local_tracer().finish(std::move(trace));
+        } else {
+            local_tracer().finish_untraced(_op, took);
+        }
+        if (ex || int(reply->_status) >= 400) {
+            ++_errors;
+        }
+        if (ex) {
+            std::rethrow_exception(ex);
+        }
+        co_return std::move(reply);
+    }
+
+protected:
+    virtual future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) = 0;
+
+private:
+    const char *_op;
+    uint64_t _requests{0};
+    uint64_t _errors{0};
+    LatencyHistogram _latency;
+    seastar::metrics::metric_groups _metrics;
+};
+
+// request parsed, its (first) key goes into the trace
+static void trace_parsed(std::string_view key) {
+    if (RequestTrace *trace = current_trace()) [[unlikely]] {
+        trace->set_key(key);
+        trace->stage("parse");
+    }
+}
+
+// values at least this large are written from their buffer into the reply
+static constexpr size_t STREAM_VALUE_SIZE = 16 * 1024;
+
+// write a get reply around the value buffer, not copied unless it needs escapes
+future<> write_value_reply(output_stream<char> out, std::string key, Value value) {
+    std::exception_ptr ex;
+    try {
+        co_await out.write(fmt::format("{{ \"key\" : \"{}\", \"value\" : \"", json_string{key}));
+        const std::string_view view(value.get(), value.size());
+        if (json_escape_offset(view) == view.size()) {
+            co_await out.write(std::move(value));
+        } else {
+            co_await out.write(fmt::format("{}", json_string{view}));
+        }
+        co_await out.write("\" }");
+        co_await out.flush();
+    } catch (...) {
+        ex = std::current_exception();
+    }
+    co_await out.close();
+    if (ex) {
+        std::rethrow_exception(ex);
+    }
 }
 
-class handle_get : public httpd::handler_base {
+class handle_get : public rest_handler {
 public:
-    virtual future<std::unique_ptr<http::reply> > handle(const sstring& path,
-            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) {
+    handle_get() : rest_handler("get") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        JsonField fields[] = {{"key"}};
         std::string key;
-        extract_json_value(req->content, "key", key);
-        //fmt::print("Server: handle get() content[{}], key [{}]\n", req->content, key);
-        std::string value = co_await g_db->get(key);
+        if (!scan_json_object(content_of(*req), fields) || !key_field(fields[0], key)) {
+            co_return bad_request(std::move(rep));
+        }
+        trace_parsed(key);
+        Value value = co_await g_db->get(key);
         //fmt::print("Server: handle get() got value [{}]\n", value);
         if (value.empty()) {
 		    rep->set_status(http::reply::status_type::not_found);  // 404
             rep->_skip_body = true;
 		    rep->done();
+        } else if (value.size() >= STREAM_VALUE_SIZE) {
+            // reply body is streamed (chunked transfer encoding)
+            rep->write_body("json", [key = std::move(key), value = std::move(value)] (output_stream<char> &&out) mutable {
+                return write_value_reply(std::move(out), std::move(key), std::move(value));
+            });
         } else {
-            std::string body = fmt::format("{{ \"key\" : \"{}\", \"value\" : \"{}\" }}", key, value);
-            rep->_content = body;
+            fmt::memory_buffer body;
+            fmt::format_to(std::back_inserter(body), "{{ \"key\" : \"{}\", \"value\" : \"{}\" }}",
+                           json_string{key}, json_string{std::string_view(value.get(), value.size())});
+            rep->_content = sstring(body.data(), body.size());
 		    rep->done("json");
         }
         co_return std::move(rep);
     }
 };
 
-class handle_set : public httpd::handler_base {
+class handle_set : public rest_handler {
 public:
-    virtual future<std::unique_ptr<http::reply> > handle(const sstring& path,
-            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) {
-        std::string key, value;
-        extract_json_value(req->content, "key", key);
-        extract_json_value(req->content, "value", value);
-        co_await g_db->set(key, value);
+    handle_set() : rest_handler("set") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        // the value is passed on in the request body buffer, trimmed to it,
+        // unless it has escape sequences
+        Value body = std::move(req->content).release();
+        JsonField fields[] = {{"key"}, {"value"}};
+        std::string key;
+        if (!scan_json_object(std::string_view(body.get(), body.size()), fields) || !key_field(fields[0], key) ||
+            !fields[1].value.is_string()) {
+            co_return bad_request(std::move(rep));
+        }
+        const JsonValue &field = fields[1].value;
+        Value value;
+        if (field.escaped) {
+            value_field(fields[1], value);
+        } else {
+            const size_t offset = field.text.data() - body.get();
+            const size_t size = field.text.size();
+            value = std::move(body);
+            value.trim_front(offset);
+            value.trim(size);
+        }
+        trace_parsed(key);
+        co_await g_db->set(std::move(key), std::move(value));
         rep->_skip_body = true;
 	    rep->done();
         co_return std::move(rep);
     }
 };
 
-class handle_del : public httpd::handler_base {
+class handle_del : public rest_handler {
 public:
-    virtual future<std::unique_ptr<http::reply> > handle(const sstring& path,
-            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) {
+    handle_del() : rest_handler("delete") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        JsonField fields[] = {{"key"}};
         std::string key;
-        extract_json_value(req->content, "key", key);
-        bool success = co_await g_db->del(key);
-        if (!success) {
-		    rep->set_status(http::reply::status_type::not_found);  // 404
+        if (!scan_json_object(content_of(*req), fields) || !key_field(fields[0], key)) {
+            co_return bad_request(std::move(rep));
         }
+        trace_parsed(key);
+        // no key is success too
+        co_await g_db->del(std::move(key));
         rep->_skip_body = true;
         rep->done();
         co_return std::move(rep);
     }
 };
 
-class handle_query : public httpd::handler_base {
+/*
+  Multi-key requests, the keys are sent to their owner shards in a single
+  message per shard:
+  mget:    { "keys" : [ "a", "b" ] }
+           returns [ { "key" : "a", "value" : "1" }, { "key" : "b", "value" : null } ]
+           in the request order, null for the keys not found
+  mset:    { "items" : [ { "key" : "a", "value" : "1" }, { "key" : "b", "value" : "2" } ] }
+  mdelete: { "keys" : [ "a", "b" ] }
+*/
+class handle_mget : public rest_handler {
 public:
-    virtual future<std::unique_ptr<http::reply> > handle(const sstring& path,
-            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) {
-        std::string prefix;
-        extract_json_value(req->content, "prefix", prefix);
-        std::set<std::string> matches = co_await g_db->query(prefix);
+    handle_mget() : rest_handler("mget") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        JsonField fields[] = {{"keys"}};
+        std::vector<std::string> keys;
+        if (!scan_json_object(content_of(*req), fields) || !key_array_field(fields[0], keys)) {
+            co_return bad_request(std::move(rep));
+        }
+        trace_parsed(keys.empty() ? std::string_view() : keys[0]);
+        std::vector<Value> values = co_await g_db->mget(keys);
         std::string body = "[ ";
-        for (auto &match : matches) {
-           if (body.size() > 2) body += ", ";
-           body += fmt::format("{{ \"key\" : \"{}\" }}", match);
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (i > 0) body += ", ";
+            if (values[i].empty()) {
+                body += fmt::format("{{ \"key\" : \"{}\", \"value\" : null }}", json_string{keys[i]});
+            } else {
+                body += fmt::format("{{ \"key\" : \"{}\", \"value\" : \"{}\" }}", json_string{keys[i]},
+                                    json_string{std::string_view(values[i].get(), values[i].size())});
+            }
         }
         body += " ]";
-        //fmt::print("QUERY HANDLER: body={}\n", body);
-        rep->_content = body;
+        rep->_content = std::move(body);
+        rep->done("json");
+        co_return std::move(rep);
+    }
+};
+
+class handle_mset : public rest_handler {
+public:
+    handle_mset() : rest_handler("mset") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        JsonField fields[] = {{"items"}};
+        std::vector<JsonValue> elements;
+        if (!scan_json_object(content_of(*req), fields) || !fields[0].value.is_array() ||
+            !scan_json_array(fields[0].value.text, elements)) {
+            co_return bad_request(std::move(rep));
+        }
+        // each value gets a buffer of its own, they go to different shards
+        std::vector<KeyValue> items(elements.size());
+        for (size_t i = 0; i < elements.size(); ++i) {
+            JsonField item[] = {{"key"}, {"value"}};
+            if (!elements[i].is_object() || !scan_json_object(elements[i].text, item) ||
+                !key_field(item[0], items[i].first) || !value_field(item[1], items[i].second)) {
+                co_return bad_request(std::move(rep));
+            }
+        }
+        trace_parsed(items.empty() ? std::string_view() : items[0].first);
+        co_await g_db->mset(std::move(items));
+        rep->_skip_body = true;
+        rep->done();
+        co_return std::move(rep);
+    }
+};
+
+class handle_mdel : public rest_handler {
+public:
+    handle_mdel() : rest_handler("mdelete") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        JsonField fields[] = {{"keys"}};
+        std::vector<std::string> keys;
+        if (!scan_json_object(content_of(*req), fields) || !key_array_field(fields[0], keys)) {
+            co_return bad_request(std::move(rep));
+        }
+        trace_parsed(keys.empty() ? std::string_view() : keys[0]);
+        co_await g_db->mdel(std::move(keys));
+        rep->_skip_body = true;
         rep->done();
         co_return std::move(rep);
     }
 };
 
-void set_routes(routes& r) {
+// write the query result keys in chunks as they are merged from the shards
+future<> write_query_reply(output_stream<char> out, std::unique_ptr<IKeyStream> keys, uint64_t limit) {
+    constexpr size_t CHUNK_KEYS = 256;
+    std::exception_ptr ex;
+    try {
+        co_await out.write("[ ");
+        uint64_t written = 0;
+        std::string body;
+        while (limit == 0 || written < limit) {
+            const size_t max = limit == 0 ? CHUNK_KEYS : std::min<uint64_t>(CHUNK_KEYS, limit - written);
+            std::vector<std::string> chunk = co_await keys->next(max);
+            if (chunk.empty()) {
+                break;
+            }
+            body.clear();
+            for (auto &key : chunk) {
+                if (written++ > 0) body += ", ";
+                body += fmt::format("{{ \"key\" : \"{}\" }}", json_string{key});
+            }
+            co_await out.write(body);
+        }
+        co_await out.write(" ]");
+        co_await out.flush();
+    } catch (...) {
+        ex = std::current_exception();
+    }
+    co_await out.close();
+    if (ex) {
+        std::rethrow_exception(ex);
+    }
+}
+
+/*
+  Query keys by prefix, optionally a page at a time:
+  { "prefix" : "ab", "limit" : 100, "cursor" : "abc" }
+  returns at most limit keys following the cursor key, the last key
+  of a full page is the cursor of the next one.
+*/
+class handle_query : public rest_handler {
+public:
+    handle_query() : rest_handler("query") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        // prefix, cursor and limit are optional
+        JsonField fields[] = {{"prefix"}, {"cursor"}, {"limit"}};
+        std::string prefix, cursor;
+        uint64_t limit = 0;
+        if (!scan_json_object(content_of(*req), fields) ||
+            (fields[0].value && !string_field(fields[0], prefix)) ||
+            (fields[1].value && !string_field(fields[1], cursor)) ||
+            (fields[2].value && !fields[2].value.to_uint(limit))) {
+            co_return bad_request(std::move(rep));
+        }
+        // reply body is streamed (chunked transfer encoding)
+        rep->write_body("json", [keys = g_db->query(prefix, cursor), limit] (output_stream<char> &&out) mutable {
+            return write_query_reply(std::move(out), std::move(keys), limit);
+        });
+        co_return std::move(rep);
+    }
+};
+
+/*
+  Key placement for clients steering requests to the owner shard:
+  { "shards" : 4, "shard_port_base" : 10100 }
+  a key is owned by shard std::hash<std::string>(key) % shards, which
+  also listens alone on shard_port_base + shard (0 - no shard ports).
+*/
+class handle_shards : public rest_handler {
+public:
+    explicit handle_shards(unsigned port_base) : rest_handler("shards"), _port_base(port_base) {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        rep->_content = fmt::format("{{ \"shards\" : {}, \"shard_port_base\" : {} }}", smp::count, _port_base);
+        rep->done("json");
+        co_return std::move(rep);
+    }
+
+private:
+    unsigned _port_base;
+};
+
+/*
+  Traces of the last sampled requests of every shard:
+  [ { "op" : "set", "key" : "a", "shard" : 0, "total_us" : 812.4,
+      "stages" : [ { "stage" : "parse", "shard" : 0, "us" : 1.2 }, ... ] }, ... ]
+  stage times are since the request start.
+*/
+class handle_traces : public rest_handler {
+public:
+    handle_traces() : rest_handler("traces") {}
+
+    future<std::unique_ptr<http::reply> > handle_request(const sstring& path,
+            std::unique_ptr<http::request> req, std::unique_ptr<http::reply> rep) override {
+        std::string body = "[ ";
+        bool first = true;
+        for (unsigned shard = 0; shard < smp::count; ++shard) {
+            std::vector<std::string> traces = co_await smp::submit_to(shard, [] {
+                std::vector<std::string> res;
+                for (const RequestTrace *trace : local_tracer().recent()) {
+                    res.push_back(trace->to_json());
+                }
+                return res;
+            });
+            for (const auto &trace : traces) {
+                body += first ? "" : ", ";
+                body += trace;
+                first = false;
+            }
+        }
+        body += " ]";
+        rep->_content = std::move(body);
+        rep->done("json");
+        co_return std::move(rep);
+    }
+};
+
+void set_routes(routes& r, unsigned shard_port_base) {
     r.add(operation_type::POST, url("/v1/get"), new handle_get);
     r.add(operation_type::POST, url("/v1/set"), new handle_set);
     r.add(operation_type::POST, url("/v1/delete"), new handle_del);
+    r.add(operation_type::POST, url("/v1/mget"), new handle_mget);
+    r.add(operation_type::POST, url("/v1/mset"), new handle_mset);
+    r.add(operation_type::POST, url("/v1/mdelete"), new handle_mdel);
     r.add(operation_type::POST, url("/v1/query"), new handle_query);
+    r.add(operation_type::GET, url("/v1/shards"), new handle_shards(shard_port_base));
+    r.add(operation_type::GET, url("/v1/traces"), new handle_traces);
 }
 
 int main(int ac, char** av) {
     app_template app;
 
+    app.add_options()
+        ("durability", bpo::value<std::string>()->default_value("strict"), "when writes are acknowledged: strict (flushed), "
+            "periodic (written, flushed every sync interval or sync bytes), none (written, flushed on exit only)")
+        ("sync-interval-ms", bpo::value<unsigned>()->default_value(100), "periodic durability: max. time (in milliseconds) between data file flushes")
+        ("sync-bytes", bpo::value<uint64_t>()->default_value(64 * 1024 * 1024), "periodic durability: max. bytes written between data file flushes")
+        ("batch-max-bytes", bpo::value<size_t>()->default_value(1024 * 1024), "max. bytes appended by a single disk commit batch")
+        ("batch-max-delay-us", bpo::value<unsigned>()->default_value(0), "max. time (in microseconds) a disk commit batch waits for more writes")
+        ("compaction-threshold", bpo::value<double>()->default_value(0.5), "dead data fraction of a data file triggering its compaction (1 disables compaction)")
+        ("compaction-min-bytes", bpo::value<uint64_t>()->default_value(16 * 1024 * 1024), "min. data file size for compaction")
+        ("hint-interval", bpo::value<unsigned>()->default_value(60), "seconds between index hint file refreshes (0 - only on exit)")
+        ("ordered-index", bpo::value<bool>()->default_value(true), "keep disk keys ordered in memory for prefix queries (otherwise queries scan the data files)")
+        ("cache-memory", bpo::value<double>()->default_value(0.1), "fraction of each shard memory used by the cache")
+        ("cache-policy", bpo::value<std::string>()->default_value("tinylfu"), "cache eviction policy: lru, tinylfu")
+        ("shard-local", bpo::value<bool>()->default_value(true), "run all storage layers of a request on the key owner shard (otherwise each layer hops there on its own)")
+        ("print-stats", bpo::value<bool>()->default_value(false), "print request latency and cross shard call statistics on exit")
+        ("shard-port-base", bpo::value<unsigned>()->default_value(0), "each shard also listens alone on this port + shard id, for clients sending a key to its owner shard (0 - disabled)")
+        ("resp-port", bpo::value<unsigned>()->default_value(0), "port of the Redis protocol (RESP) listener, e.g. 6379 (0 - disabled)")
+        ("trace-sample", bpo::value<double>()->default_value(0), "fraction of the REST requests traced through the storage layers (0 - tracing off)")
+        ("trace-buffer", bpo::value<size_t>()->default_value(256), "traces of the last sampled requests kept by each shard, see GET /v1/traces")
+        ("slow-request-us", bpo::value<unsigned>()->default_value(0), "log the REST requests slower than this (in microseconds), with their stages if traced (0 - disabled)");
+
     return app.run(ac, av, [&] () -> future<int> {
         seastar_apps_lib::stop_signal stop_signal;
+        auto& config = app.configuration();
+
+        DiskOptions disk_opts;
+        disk_opts.max_batch_bytes = config["batch-max-bytes"].as<size_t>();
+        disk_opts.max_batch_delay = std::chrono::microseconds(config["batch-max-delay-us"].as<unsigned>());
+        disk_opts.compaction_threshold = config["compaction-threshold"].as<double>();
+        disk_opts.compaction_min_bytes = config["compaction-min-bytes"].as<uint64_t>();
+        disk_opts.hint_interval = std::chrono::seconds(config["hint-interval"].as<unsigned>());
+        disk_opts.ordered_index = config["ordered-index"].as<bool>();
+        if (!parse_durability(config["durability"].as<std::string>(), disk_opts.durability)) {
+            fmt::print("unknown durability {}\n", config["durability"].as<std::string>());
+            co_return 1;
+        }
+        disk_opts.sync_interval = std::chrono::milliseconds(std::max(1u, config["sync-interval-ms"].as<unsigned>()));
+        disk_opts.sync_bytes = config["sync-bytes"].as<uint64_t>();
+
+        CachePolicy cache_policy;
+        if (!parse_cache_policy(config["cache-policy"].as<std::string>(), cache_policy)) {
+            fmt::print("unknown cache policy {}\n", config["cache-policy"].as<std::string>());
+            co_return 1;
+        }
 
         // initialize database server with two layers:
         // - in-memory cache
         // - on-disk storage
-        IStorage *cache = new CacheStorage(20);
-        IStorage *disk = new DiskStorage();
+        IStorage *cache = new CacheStorage(config["cache-memory"].as<double>(), cache_policy);
+        IStorage *disk = new DiskStorage(disk_opts);
         std::vector<IStorage *> store{ cache, disk };
         //std::vector<IStorage *> store{ disk };
 
-        g_db = std::make_unique<database>(store);
+        g_db = std::make_unique<database>(store, config["shard-local"].as<bool>());
         co_await g_db->start();
 
+        TraceOptions trace_opts;
+        trace_opts.sample_rate = config["trace-sample"].as<double>();
+        trace_opts.buffer_size = config["trace-buffer"].as<size_t>();
+        trace_opts.slow_threshold = std::chrono::microseconds(config["slow-request-us"].as<unsigned>());
+        co_await smp::invoke_on_all([trace_opts] { local_tracer().configure(trace_opts); });
+
         http_server_control server;
         co_await server.start();
-        co_await server.set_routes([](routes &r) { set_routes(r); });
+        const unsigned shard_port_base = config["shard-port-base"].as<unsigned>();
+        co_await server.set_routes([shard_port_base] (routes &r) { set_routes(r, shard_port_base); });
+        // GET /metrics in the Prometheus text format
+        prometheus::config metrics_config;
+        metrics_config.prefix = "kvdb";
+        co_await prometheus::start(server, metrics_config);
         co_await server.listen(seastar::make_ipv4_address({10000}));
+        if (shard_port_base != 0) {
+            // connections to a shard port are accepted and served by that shard only
+            co_await server.server().invoke_on_all([shard_port_base] (http_server &s) {
+                listen_options lo;
+                lo.reuse_address = true;
+                lo.lba = server_socket::load_balancing_algorithm::fixed;
+                lo.fixed_cpu = this_shard_id();
+                return s.listen(seastar::make_ipv4_address({uint16_t(shard_port_base + this_shard_id())}), lo);
+            });
+        }
+
+        // Redis protocol listener on every shard, into the same database
+        distributed<RespServer> resp;
+        const unsigned resp_port = config["resp-port"].as<unsigned>();
+        if (resp_port != 0) {
+            co_await resp.start(g_db.get());
+            co_await resp.invoke_on_all(&RespServer::listen, socket_address(seastar::make_ipv4_address({uint16_t(resp_port)})));
+        }
 
         co_await stop_signal.wait();
+        if (resp_port != 0) {
+            co_await resp.stop();
+        }
         co_await server.stop();
+        if (config["print-stats"].as<bool>()) {
+            g_db->print_stats();
+        }
         co_await g_db->stop();
 
         co_return 0;
@@ -1,57 +1,474 @@
 #include "db.hh"
 #include "seastar/core/coroutine.hh"
+#include <seastar/core/loop.hh>
+#include <seastar/core/smp.hh>
+#include <seastar/core/print.hh>
+#include <seastar/core/metrics.hh>
+#include <boost/range/irange.hpp>
+#include <numeric>
 
 namespace kvdb {
 
+future<std::vector<Value>> IStorage::mget_local(std::vector<std::string> keys)
+{
+  std::vector<Value> values;
+  values.reserve(keys.size());
+  for (auto &key : keys) {
+     values.push_back(co_await get_local(std::move(key)));
+  }
+  co_return values;
+}
+
+future<> IStorage::mset_local(std::vector<KeyValue> items)
+{
+  for (auto &[key, value] : items) {
+     co_await set_local(std::move(key), std::move(value));
+  }
+}
+
+future<> IStorage::mdel_local(std::vector<std::string> keys)
+{
+  for (auto &key : keys) {
+     co_await del_local(std::move(key));
+  }
+}
+
+database::database(std::vector<IStorage *> layers, bool shard_local)
+ : _layers(std::move(layers)),
+   _shard_local(shard_local),
+   _shards(smp::count)
+{
+}
+
 database::~database() {
   for (auto *layer : _layers) {
      delete layer;
   }
 }
 
-future<std::string> database::get(std::string key)
+template <typename Func>
+futurize_t<std::invoke_result_t<Func>> database::on_shard(unsigned shard, Func func)
+{
+  if (shard == this_shard_id()) {
+    return futurize_invoke(std::move(func));
+  }
+  Stats &stats = local_state().stats;
+  ++stats.hops;
+  stats.hop_depth += stats.hops_in_flight;
+  stats.max_hop_depth = std::max(stats.max_hop_depth, stats.hops_in_flight + 1);
+  ++stats.hops_in_flight;
+  // the trace goes along, current on the shard while func starts
+  RequestTrace *trace = current_trace();
+  return smp::submit_to(shard, [trace, func = std::move(func)] () mutable {
+    trace_stage(trace, "smp hop");
+    return traced(trace, func);
+  }).finally([this, trace] {
+    --local_state().stats.hops_in_flight;
+    trace_stage(trace, "smp return");
+  });
+}
+
+void database::account(std::chrono::steady_clock::time_point start)
+{
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+  ShardState &state = local_state();
+  state.latency.add(elapsed);
+  Stats &stats = state.stats;
+  ++stats.requests;
+  stats.latency_ns += ns;
+  stats.max_latency_ns = std::max(stats.max_latency_ns, ns);
+}
+
+template <typename T>
+future<T> database::timed(std::chrono::steady_clock::time_point start, future<T> f)
+{
+  if (f.available()) {
+    account(start);
+    return f;
+  }
+  return f.finally([this, start] { account(start); });
+}
+
+future<Value> database::get(std::string key)
+{
+  assert(!_layers.empty());
+
+  const auto start = std::chrono::steady_clock::now();
+  const unsigned shard = shard_of(key);
+  if (!_shard_local) {
+    return timed(start, get_per_layer(shard, std::move(key)));
+  }
+  // hash once, hop once, all layers run on the owner shard,
+  // inline if it is this one (a cache hit then completes right away)
+  if (shard == this_shard_id()) {
+    ++local_state().stats.owner_requests;
+    return timed(start, get_local(std::move(key)));
+  }
+  return timed(start, on_shard(shard, [this, key = std::move(key)] { return get_local(key); }));
+}
+
+future<bool> database::set(std::string key, Value value)
 {
   assert(!_layers.empty());
 
+  const auto start = std::chrono::steady_clock::now();
+  const unsigned shard = shard_of(key);
+  if (!_shard_local) {
+    return timed(start, set_per_layer(shard, std::move(key), std::move(value)));
+  }
+  if (shard == this_shard_id()) {
+    ++local_state().stats.owner_requests;
+    return timed(start, set_local(std::move(key), std::move(value)));
+  }
+  return timed(start, on_shard(shard, [this, key = std::move(key), value = std::move(value)] () mutable {
+    return set_local(std::move(key), std::move(value));
+  }));
+}
+
+future<bool> database::del(std::string key)
+{
+  assert(!_layers.empty());
+
+  const auto start = std::chrono::steady_clock::now();
+  const unsigned shard = shard_of(key);
+  if (!_shard_local) {
+    return timed(start, del_per_layer(shard, std::move(key)));
+  }
+  if (shard == this_shard_id()) {
+    ++local_state().stats.owner_requests;
+    return timed(start, del_local(std::move(key)));
+  }
+  return timed(start, on_shard(shard, [this, key = std::move(key)] { return del_local(key); }));
+}
+
+future<Value> database::get_per_layer(unsigned shard, std::string key)
+{
+  RequestTrace *trace = current_trace();
   for (auto *layer : _layers) {
      assert(layer != nullptr);
-     std::string value = co_await layer->get(key);
+     Value value = co_await traced(trace, [&] { return on_shard(shard, [layer, &key] { return layer->get_local(key); }); });
      if (!value.empty()) {
         co_return value;
      }
   }
-  co_return std::string();
+  co_return Value();
 }
 
-future<bool> database::set(std::string key, std::string value)
+future<bool> database::set_per_layer(unsigned shard, std::string key, Value value)
 {
-  assert(!_layers.empty());
+  RequestTrace *trace = current_trace();
+  for (size_t i = 0; i < _layers.size(); ++i) {
+     IStorage *layer = _layers[i];
+     assert(layer != nullptr);
+     // each hop gets a buffer of its own, the last one takes the original
+     Value v = i + 1 < _layers.size() ? value.clone() : std::move(value);
+     co_await traced(trace, [&] { return on_shard(shard, [layer, &key, &v] { return layer->set_local(key, std::move(v)); }); });
+  }
+  co_return true;
+}
 
+future<bool> database::del_per_layer(unsigned shard, std::string key)
+{
+  RequestTrace *trace = current_trace();
+  bool removed = false;
   for (auto *layer : _layers) {
      assert(layer != nullptr);
-     co_await layer->set(key, value);
+     removed = co_await traced(trace, [&] { return on_shard(shard, [layer, &key] { return layer->del_local(key); }); });
+  }
+  // the last layer holds all the keys, the ones in front only some
+  co_return removed;
+}
+
+future<Value> database::get_local(std::string key)
+{
+  const uint32_t writes = local_state().writes[fill_bucket(key)];
+  RequestTrace *trace = current_trace();
+  // first layer (cache) hit continues inline, no coroutine frame
+  return _layers.front()->get_local(key).then([this, key = std::move(key), writes, trace] (Value value) mutable {
+    if (!value.empty() || _layers.size() == 1) {
+      return make_ready_future<Value>(std::move(value));
+    }
+    return traced(trace, [&] { return get_lower(std::move(key), writes); });
+  });
+}
+
+future<Value> database::get_lower(std::string key, uint32_t writes)
+{
+  ShardState &state = local_state();
+  const size_t bucket = fill_bucket(key);
+  RequestTrace *trace = current_trace();
+  for (size_t i = 1; i < _layers.size(); ++i) {
+     Value value = co_await traced(trace, [&] { return _layers[i]->get_local(key); });
+     if (value.empty()) {
+        continue;
+     }
+     // fill the previous layers, unless the value may be stale already
+     for (size_t j = 0; j < i; ++j) {
+        if (state.writes[bucket] != writes) {
+           ++state.stats.skipped_fills;
+           break;
+        }
+        co_await traced(trace, [&] { return _layers[j]->set_local(key, value.share()); });
+        ++state.stats.fills;
+     }
+     co_return value;
+  }
+  co_return Value();
+}
+
+future<bool> database::set_local(std::string key, Value value)
+{
+  // lookups running meanwhile must not fill the previous value
+  ShardState &state = local_state();
+  const size_t bucket = fill_bucket(key);
+  ++state.writes[bucket];
+  RequestTrace *trace = current_trace();
+  for (auto *layer : _layers) {
+     co_await traced(trace, [&] { return layer->set_local(key, value.share()); });
   }
+  ++state.writes[bucket];
   co_return true;
 }
 
-future<bool> database::del(const std::string key)
+future<bool> database::del_local(std::string key)
+{
+  ShardState &state = local_state();
+  const size_t bucket = fill_bucket(key);
+  ++state.writes[bucket];
+  RequestTrace *trace = current_trace();
+  bool removed = false;
+  for (auto *layer : _layers) {
+     removed = co_await traced(trace, [&] { return layer->del_local(key); });
+  }
+  ++state.writes[bucket];
+  // the last layer holds all the keys, the ones in front only some
+  co_return removed;
+}
+
+template <typename T, typename Key>
+std::vector<std::vector<size_t>> database::group_by_shard(const std::vector<T> &items, Key key)
+{
+  std::vector<std::vector<size_t>> groups(smp::count);
+  for (size_t i = 0; i < items.size(); ++i) {
+     groups[shard_of(key(items[i]))].push_back(i);
+  }
+  return groups;
+}
+
+future<std::vector<Value>> database::mget(std::vector<std::string> keys)
 {
   assert(!_layers.empty());
 
+  // a single message per shard with all its keys, the values are put
+  // back in the request order as the shards reply
+  const auto start = std::chrono::steady_clock::now();
+  const auto groups = group_by_shard(keys, [] (const std::string &key) -> const std::string & { return key; });
+  std::vector<Value> values(keys.size());
+  auto done = parallel_for_each(boost::irange<unsigned>(0, smp::count), [&] (unsigned shard) {
+    const std::vector<size_t> &group = groups[shard];
+    if (group.empty()) {
+      return make_ready_future<>();
+    }
+    std::vector<std::string> part;
+    part.reserve(group.size());
+    for (size_t i : group) {
+      part.push_back(std::move(keys[i]));
+    }
+    return on_shard(shard, [this, part = std::move(part)] () mutable {
+      return mget_local(std::move(part));
+    }).then([&values, &group] (std::vector<Value> res) {
+      for (size_t j = 0; j < group.size(); ++j) {
+        values[group[j]] = std::move(res[j]);
+      }
+    });
+  });
+  co_await std::move(done);
+  account(start);
+  co_return values;
+}
+
+future<> database::mset(std::vector<KeyValue> items)
+{
+  assert(!_layers.empty());
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto groups = group_by_shard(items, [] (const KeyValue &item) -> const std::string & { return item.first; });
+  auto done = parallel_for_each(boost::irange<unsigned>(0, smp::count), [&] (unsigned shard) {
+    if (groups[shard].empty()) {
+      return make_ready_future<>();
+    }
+    std::vector<KeyValue> part;
+    part.reserve(groups[shard].size());
+    for (size_t i : groups[shard]) {
+      part.push_back(std::move(items[i]));
+    }
+    return on_shard(shard, [this, part = std::move(part)] () mutable { return mset_local(std::move(part)); });
+  });
+  co_await std::move(done);
+  account(start);
+}
+
+future<> database::mdel(std::vector<std::string> keys)
+{
+  assert(!_layers.empty());
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto groups = group_by_shard(keys, [] (const std::string &key) -> const std::string & { return key; });
+  auto done = parallel_for_each(boost::irange<unsigned>(0, smp::count), [&] (unsigned shard) {
+    if (groups[shard].empty()) {
+      return make_ready_future<>();
+    }
+    std::vector<std::string> part;
+    part.reserve(groups[shard].size());
+    for (size_t i : groups[shard]) {
+      part.push_back(std::move(keys[i]));
+    }
+    return on_shard(shard, [this, part = std::move(part)] () mutable { return mdel_local(std::move(part)); });
+  });
+  co_await std::move(done);
+  account(start);
+}
+
+future<std::vector<Value>> database::mget_local(std::vector<std::string> keys)
+{
+  ShardState &state = local_state();
+  RequestTrace *trace = current_trace();
+  std::vector<uint32_t> writes(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+     writes[i] = state.writes[fill_bucket(keys[i])];
+  }
+
+  // each layer gets the keys missed by the previous ones, as a single batch
+  std::vector<Value> values(keys.size());
+  std::vector<size_t> missing(keys.size());
+  std::iota(missing.begin(), missing.end(), 0);
+  for (size_t i = 0; i < _layers.size() && !missing.empty(); ++i) {
+     std::vector<std::string> part;
+     part.reserve(missing.size());
+     for (size_t k : missing) {
+        part.push_back(keys[k]);
+     }
+     std::vector<Value> found = co_await traced(trace, [&] { return _layers[i]->mget_local(std::move(part)); });
+     std::vector<size_t> still_missing, filled;
+     for (size_t j = 0; j < missing.size(); ++j) {
+        if (found[j].empty()) {
+           still_missing.push_back(missing[j]);
+        } else {
+           values[missing[j]] = std::move(found[j]);
+           filled.push_back(missing[j]);
+        }
+     }
+     missing = std::move(still_missing);
+
+     // fill the previous layers, except the values that may be stale already
+     for (size_t j = 0; j < i && !filled.empty(); ++j) {
+        std::erase_if(filled, [&] (size_t k) {
+          const bool stale = state.writes[fill_bucket(keys[k])] != writes[k];
+          state.stats.skipped_fills += stale;
+          return stale;
+        });
+        std::vector<KeyValue> items;
+        items.reserve(filled.size());
+        for (size_t k : filled) {
+           items.emplace_back(keys[k], values[k].share());
+        }
+        if (!items.empty()) {
+           co_await traced(trace, [&] { return _layers[j]->mset_local(std::move(items)); });
+           state.stats.fills += filled.size();
+        }
+     }
+  }
+  co_return values;
+}
+
+future<> database::mset_local(std::vector<KeyValue> items)
+{
+  ShardState &state = local_state();
+  for (const auto &item : items) {
+     ++state.writes[fill_bucket(item.first)];
+  }
+  RequestTrace *trace = current_trace();
   for (auto *layer : _layers) {
-     assert(layer != nullptr);
-     co_await layer->del(key);
+     std::vector<KeyValue> shared;
+     shared.reserve(items.size());
+     for (auto &[key, value] : items) {
+        shared.emplace_back(key, value.share());
+     }
+     co_await traced(trace, [&] { return layer->mset_local(std::move(shared)); });
+  }
+  for (const auto &item : items) {
+     ++state.writes[fill_bucket(item.first)];
+  }
+}
+
+future<> database::mdel_local(std::vector<std::string> keys)
+{
+  ShardState &state = local_state();
+  for (const auto &key : keys) {
+     ++state.writes[fill_bucket(key)];
+  }
+  RequestTrace *trace = current_trace();
+  for (auto *layer : _layers) {
+     co_await traced(trace, [&] { return layer->mdel_local(keys); });
+  }
+  for (const auto &key : keys) {
+     ++state.writes[fill_bucket(key)];
   }
-  co_return true;
 }
 
-future<std::set<std::string>> database::query(const std::string prefix)
+std::unique_ptr<IKeyStream> database::query(std::string prefix, std::string after)
 {
   assert(!_layers.empty());
 
   // only the last layer may store all data (previous ones are caches)
-  std::set<std::string> data = co_await _layers.back()->query(prefix);
-  co_return data;
+  return _layers.back()->query(std::move(prefix), std::move(after));
+}
+
+database::Stats database::stats() const
+{
+  Stats total;
+  for (const auto &shard : _shards) {
+     const Stats &s = shard.stats;
+     total.requests += s.requests;
+     total.owner_requests += s.owner_requests;
+     total.latency_ns += s.latency_ns;
+     total.max_latency_ns = std::max(total.max_latency_ns, s.max_latency_ns);
+     total.hops += s.hops;
+     total.hops_in_flight += s.hops_in_flight;
+     total.hop_depth += s.hop_depth;
+     total.max_hop_depth = std::max(total.max_hop_depth, s.max_hop_depth);
+     total.fills += s.fills;
+     total.skipped_fills += s.skipped_fills;
+  }
+  return total;
+}
+
+void database::print_stats() const
+{
+  const Stats s = stats();
+  const double requests = std::max<uint64_t>(s.requests, 1);
+  const double hops = std::max<uint64_t>(s.hops, 1);
+  fmt::print("database: {} requests ({:.1f}% on the owner shard), latency avg {:.1f} us max {:.1f} us, "
+             "{:.2f} cross shard calls per request, SMP queue depth avg {:.2f} max {}, cache fills {} (skipped {})\n",
+             s.requests, s.owner_requests * 100 / requests, s.latency_ns / requests / 1000, s.max_latency_ns / 1000.0, s.hops / requests,
+             s.hop_depth / hops + 1, s.max_hop_depth, s.fills, s.skipped_fills);
+}
+
+void database::register_metrics()
+{
+  namespace sm = seastar::metrics;
+  ShardState &state = local_state();
+  const Stats &s = state.stats;
+  state.metrics.add_group("database", {
+    sm::make_counter("requests", s.requests, sm::description("requests received by the shard")),
+    sm::make_counter("owner_requests", s.owner_requests, sm::description("requests received on the key owner shard, run inline")),
+    sm::make_histogram("latency", sm::description("request latency in seconds"), [&state] { return state.latency.to_metrics(); }),
+    sm::make_counter("cross_shard_calls", s.hops, sm::description("calls submitted to other shards")),
+    sm::make_gauge("cross_shard_calls_in_flight", s.hops_in_flight, sm::description("calls submitted to other shards, not completed yet (SMP queue depth)")),
+    sm::make_counter("cache_fills", s.fills, sm::description("values read from a lower layer set in the previous ones")),
+    sm::make_counter("skipped_cache_fills", s.skipped_fills, sm::description("fills skipped, the key was written during the lookup")),
+  });
 }
 
 future<> database::start()
@@ -63,12 +480,15 @@ future<> database::start()
      // fmt::print("database::start - start layer\n");
      co_await layer->start();
   }
+  co_await smp::invoke_on_all([this] { register_metrics(); });
 }
 
 future<> database::stop()
 {
   assert(!_layers.empty());
 
+  co_await smp::invoke_on_all([this] { local_state().metrics.clear(); });
+
   for (auto *layer : _layers) {
      assert(layer != nullptr);
      // fmt::print("database::stop - stop layer\n");
@@ -76,4 +496,54 @@ future<> database::stop()
   }
 }
 
+ShardedKeyStream::ShardedKeyStream(unsigned shards, fetch_func fetch, std::string after, size_t chunk)
+ : _fetch(std::move(fetch)),
+   _runs(shards),
+   _chunk(chunk)
+{
+  for (auto &run : _runs) {
+    run.after = after;
+  }
+}
+
+future<> ShardedKeyStream::refill()
+{
+  return parallel_for_each(boost::irange<size_t>(0, _runs.size()), [this] (size_t shard) {
+    Run &run = _runs[shard];
+    if (run.done || run.pos < run.keys.size()) {
+      return make_ready_future<>();
+    }
+    return _fetch(shard, run.after, _chunk).then([this, &run] (std::vector<std::string> keys) {
+      run.done = keys.size() < _chunk;
+      if (!keys.empty()) {
+        run.after = keys.back();
+      }
+      run.keys = std::move(keys);
+      run.pos = 0;
+    });
+  });
+}
+
+future<std::vector<std::string>> ShardedKeyStream::next(size_t max)
+{
+  std::vector<std::string> res;
+  while (res.size() < max) {
+    if (std::any_of(_runs.begin(), _runs.end(), [] (const Run &run) { return !run.done && run.pos == run.keys.size(); })) {
+      co_await refill();
+    }
+    // smallest head of the runs, shard count is small enough for a linear search
+    Run *min = nullptr;
+    for (auto &run : _runs) {
+      if (run.pos < run.keys.size() && (!min || run.keys[run.pos] < min->keys[min->pos])) {
+        min = &run;
+      }
+    }
+    if (!min) {
+      break;
+    }
+    res.push_back(std::move(min->keys[min->pos++]));
+  }
+  co_return res;
+}
+
 }; // namespace kvdb
@@ -1,28 +1,105 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <set>
 #include <string>
 #include <vector>
+#include <memory>
+#include <functional>
 
 #include <seastar/core/seastar.hh>
+#include <seastar/core/temporary_buffer.hh>
+#include <seastar/core/metrics_registration.hh>
+#include "latency_histogram.hh"
+#include "trace.hh"
 
 using namespace seastar;
 
 namespace kvdb {
 
+/*
+  Values are immutable byte buffers, moved (not copied) from the request
+  through the storage layers into the reply, empty means not found.
+  Layers of a shard may share() a buffer, but it must not be shared while
+  it crosses shards, its reference count is not atomic.
+*/
+using Value = temporary_buffer<char>;
+
+// item of a multi-key set
+using KeyValue = std::pair<std::string, Value>;
+
+// longest key, key lengths take 16 bits in the data files, the cache and the ordered index,
+// requests with longer keys are rejected
+constexpr size_t MAX_KEY_SIZE = UINT16_MAX;
+
+/*
+  Query results: keys in order, taken in chunks.
+*/
+class IKeyStream {
+public:
+  virtual ~IKeyStream() = default;
+  // at most max next keys, empty at the end
+  virtual future<std::vector<std::string>> next(size_t max) = 0;
+};
+
+/*
+  Query results of a sharded storage. Each shard provides a sorted run of
+  its keys, fetched in chunks, runs are merged lazily (k-way merge) as the
+  keys are taken, so memory stays bounded by the chunk size and shard count.
+*/
+class ShardedKeyStream : public IKeyStream {
+public:
+  // next keys of the shard run following after (at most max), in order
+  using fetch_func = std::function<future<std::vector<std::string>>(unsigned shard, std::string after, size_t max)>;
+
+  ShardedKeyStream(unsigned shards, fetch_func fetch, std::string after, size_t chunk = 256);
+
+  future<std::vector<std::string>> next(size_t max) override;
+
+private:
+  struct Run {
+    std::vector<std::string> keys;
+    size_t pos{0};          // next key to take
+    std::string after;      // last key fetched
+    bool done{false};       // no more keys on the shard
+  };
+
+  // fetch next chunks of all runs without buffered keys
+  future<> refill();
+
+  fetch_func _fetch;
+  std::vector<Run> _runs;
+  size_t _chunk;
+};
+
 /*
   Storage infterface, defines possible storage operations.
 */
 class IStorage {
 public:
   virtual ~IStorage() = default;
-  virtual future<std::string> get(std::string key) = 0;
-  virtual future<bool> set(std::string key, std::string value) = 0;
+  virtual future<Value> get(std::string key) = 0;
+  virtual future<bool> set(std::string key, Value value) = 0;
+  // false if there was no such key
   virtual future<bool> del(std::string key) = 0;
-  virtual future<std::set<std::string>> query(std::string prefix) = 0;
+  // same operations on the local shard data, must run on shard_of(key)
+  virtual future<Value> get_local(std::string key) = 0;
+  virtual future<bool> set_local(std::string key, Value value) = 0;
+  virtual future<bool> del_local(std::string key) = 0;
+  // batches of local shard operations, values are returned in the key order
+  // (by default the single key operations are called one by one)
+  virtual future<std::vector<Value>> mget_local(std::vector<std::string> keys);
+  virtual future<> mset_local(std::vector<KeyValue> items);
+  virtual future<> mdel_local(std::vector<std::string> keys);
+  // keys with the prefix following after (all of them if empty), in order
+  virtual std::unique_ptr<IKeyStream> query(std::string prefix, std::string after) = 0;
 
   virtual future<> start() = 0;
   virtual future<> stop() = 0;
+
+  // shard owning the key, the same for all storages
+  static unsigned shard_of(const std::string &key) { return std::hash<std::string>{}(key) % smp::count; }
 };
 
 
@@ -32,28 +109,99 @@ public:
   as being stored within the container.
   Reading:
    - if key found in 1st store, we skip other stores
-   - if key not found in 1st store, we continue with next stores
+   - if key not found in 1st store, we continue with next stores,
+     the value found is then set in the previous ones (cache fill)
   Writing:
    - write key/value to each store
   Querying:
    - query only the last store (who must have all keys)
+  Batches (mget, mset, mdel) are split by the key owner shard, each shard
+  gets a single message with its keys and passes them to the stores as
+  a batch.
   Database itself acts as a single virtual storage (using the same interface).
+  All stores place a key on the same shard, so a request hops once to the
+  key owner shard and runs all the layers there (shard local mode), instead
+  of each store hopping on its own.
 */
 class database : public IStorage {
 public:
-  database(std::vector<IStorage *> layers) : _layers(std::move(layers)) {};
+  // per shard request and cross shard call counters
+  struct alignas(64) Stats {
+    uint64_t requests{0};
+    uint64_t owner_requests{0};     // received on the key owner shard, run inline
+    uint64_t latency_ns{0};         // summed
+    uint64_t max_latency_ns{0};
+    uint64_t hops{0};               // cross shard calls
+    uint64_t hops_in_flight{0};     // submitted, not completed yet (SMP queue depth)
+    uint64_t hop_depth{0};          // hops in flight when a hop was submitted, summed
+    uint64_t max_hop_depth{0};
+    uint64_t fills{0};              // values set in the previous layers
+    uint64_t skipped_fills{0};      // key written during the lookup, not filled
+  };
+
+  database(std::vector<IStorage *> layers, bool shard_local = true);
   ~database();
 
-  future<std::string> get(std::string key) override;
-  future<bool> set(std::string key, std::string value) override;
+  future<Value> get(std::string key) override;
+  future<bool> set(std::string key, Value value) override;
   future<bool> del(std::string key) override;
-  future<std::set<std::string>> query(std::string prefix) override;
+  future<Value> get_local(std::string key) override;
+  future<bool> set_local(std::string key, Value value) override;
+  future<bool> del_local(std::string key) override;
+  future<std::vector<Value>> mget_local(std::vector<std::string> keys) override;
+  future<> mset_local(std::vector<KeyValue> items) override;
+  future<> mdel_local(std::vector<std::string> keys) override;
+  std::unique_ptr<IKeyStream> query(std::string prefix, std::string after) override;
+
+  // values of the keys in their order, empty if not found
+  future<std::vector<Value>> mget(std::vector<std::string> keys);
+  future<> mset(std::vector<KeyValue> items);
+  future<> mdel(std::vector<std::string> keys);
 
   future<> start() override;
   future<> stop() override;
 
+  // all shards counters added up
+  Stats stats() const;
+  void print_stats() const;
+
 private:
+  // write counters of key hash buckets, a cache fill is skipped
+  // if a key of its bucket was written while the value was read
+  static constexpr size_t FILL_BUCKETS = 1024;
+
+  struct alignas(64) ShardState {
+    Stats stats;
+    LatencyHistogram latency;
+    std::array<uint32_t, FILL_BUCKETS> writes{};
+    // registered on the shard itself, between start and stop
+    seastar::metrics::metric_groups metrics;
+  };
+
+  ShardState &local_state() { return _shards[this_shard_id()]; }
+  void register_metrics();
+  static size_t fill_bucket(const std::string &key) { return std::hash<std::string>{}(key) / smp::count % FILL_BUCKETS; }
+  // run func on the shard, counting the cross shard calls
+  template <typename Func>
+  futurize_t<std::invoke_result_t<Func>> on_shard(unsigned shard, Func func);
+  // request latency
+  void account(std::chrono::steady_clock::time_point start);
+  template <typename T>
+  future<T> timed(std::chrono::steady_clock::time_point start, future<T> f);
+  // each layer called on the owner shard on its own (shard local mode off)
+  future<Value> get_per_layer(unsigned shard, std::string key);
+  future<bool> set_per_layer(unsigned shard, std::string key, Value value);
+  future<bool> del_per_layer(unsigned shard, std::string key);
+  // lookup past the first layer, filling the previous ones
+  future<Value> get_lower(std::string key, uint32_t writes);
+  // indexes of the keys grouped by their owner shard
+  template <typename T, typename Key>
+  static std::vector<std::vector<size_t>> group_by_shard(const std::vector<T> &items, Key key);
+
   std::vector<IStorage *> _layers;
+  bool _shard_local;
+  // indexed by shard, each shard touches only its own state
+  std::vector<ShardState> _shards;
 };
 
 }; // namespace kvdb
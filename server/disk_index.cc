@@ -0,0 +1,150 @@
+#include "disk_index.hh"
+
+#include <functional>
+#include <cassert>
+
+namespace kvdb {
+
+uint32_t DiskIndex::fingerprint(std::string_view key)
+{
+  // high bits, the low ones pick the shard (std::hash % smp::count)
+  return std::hash<std::string_view>{}(key) >> 32;
+}
+
+uint64_t DiskIndex::secondary_hash(std::string_view key)
+{
+  // FNV-1a, independent of std::hash
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const char c : key) {
+    h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+size_t DiskIndex::memory_usage() const
+{
+  // side map nodes estimated at 5 words each
+  return _fps.capacity() * sizeof(uint32_t) + _locs.capacity() * sizeof(uint64_t) +
+         _hash2.capacity() * sizeof(uint64_t) + _large_sizes.size() * 5 * sizeof(uint64_t);
+}
+
+size_t DiskIndex::find(uint32_t fp, uint64_t rec_pos) const
+{
+  size_t found = npos;
+  for_each_candidate(fp, [&found, rec_pos] (size_t slot, Entry e) {
+    if (e.rec_pos == rec_pos) {
+      found = slot;
+    }
+  });
+  return found;
+}
+
+size_t DiskIndex::find_key(uint32_t fp, uint64_t hash2) const
+{
+  size_t found = npos;
+  for_each_candidate(fp, [this, &found, hash2] (size_t slot, Entry) {
+    if (_hash2[slot] == hash2) {
+      found = slot;
+    }
+  });
+  return found;
+}
+
+uint64_t DiskIndex::record_size(size_t slot) const
+{
+  const Entry e = unpack(_locs[slot]);
+  return e.rec_size == LARGE_RECORD ? _large_sizes.at(key_id(slot)) : e.rec_size;
+}
+
+void DiskIndex::set_large_size(KeyId id, uint64_t rec_size)
+{
+  if (rec_size >= LARGE_RECORD) {
+    _large_sizes[id] = rec_size;
+  } else {
+    _large_sizes.erase(id);
+  }
+}
+
+void DiskIndex::insert(uint32_t fp, uint64_t rec_pos, uint64_t rec_size, uint64_t hash2)
+{
+  assert(rec_pos <= MAX_OFFSET);
+  // keep the load (deleted slots included) under 7/8, grow when live entries take half
+  if ((_used + 1) * 8 > capacity() * 7) {
+    size_t new_capacity = capacity();
+    while ((_size + 1) * 2 > new_capacity) {
+      new_capacity *= 2;
+    }
+    rehash(new_capacity);
+  }
+
+  size_t slot = fp & _mask;
+  while (_locs[slot] < DELETED) {
+    slot = (slot + 1) & _mask;
+  }
+  if (_locs[slot] == EMPTY) {
+    ++_used;
+  }
+  _fps[slot] = fp;
+  _hash2[slot] = hash2;
+  _locs[slot] = pack(rec_pos, rec_size);
+  set_large_size(KeyId{fp, hash2}, rec_size);
+  ++_size;
+}
+
+void DiskIndex::update(size_t slot, uint64_t rec_pos, uint64_t rec_size)
+{
+  assert(rec_pos <= MAX_OFFSET && _locs[slot] < DELETED);
+  _locs[slot] = pack(rec_pos, rec_size);
+  set_large_size(key_id(slot), rec_size);
+}
+
+void DiskIndex::erase(size_t slot)
+{
+  assert(_locs[slot] < DELETED);
+  _locs[slot] = DELETED;
+  _large_sizes.erase(key_id(slot));
+  --_size;
+}
+
+void DiskIndex::clear()
+{
+  _fps.assign(MIN_CAPACITY, 0);
+  _hash2.assign(MIN_CAPACITY, 0);
+  _locs.assign(MIN_CAPACITY, EMPTY);
+  _fps.shrink_to_fit();
+  _hash2.shrink_to_fit();
+  _locs.shrink_to_fit();
+  _large_sizes.clear();
+  _mask = MIN_CAPACITY - 1;
+  _size = 0;
+  _used = 0;
+  ++_generation;
+}
+
+void DiskIndex::rehash(size_t capacity)
+{
+  std::vector<uint32_t> fps(capacity, 0);
+  std::vector<uint64_t> locs(capacity, EMPTY);
+  std::vector<uint64_t> hash2(capacity, 0);
+  const size_t mask = capacity - 1;
+  for (size_t i = 0; i < _locs.size(); ++i) {
+    if (_locs[i] >= DELETED) {
+      continue;
+    }
+    size_t slot = _fps[i] & mask;
+    while (locs[slot] != EMPTY) {
+      slot = (slot + 1) & mask;
+    }
+    fps[slot] = _fps[i];
+    hash2[slot] = _hash2[i];
+    locs[slot] = _locs[i];
+  }
+  _fps = std::move(fps);
+  _locs = std::move(locs);
+  _hash2 = std::move(hash2);
+  _mask = mask;
+  _used = _size;
+  ++_generation;
+}
+
+}; // namespace kvdb
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace kvdb {
+
+/*
+  Compact in-memory index of the disk shard records.
+  Open addressing hash table (linear probing) holding a 32 bit key
+  fingerprint, an independent 64 bit secondary key hash and the packed
+  record location (40 bit file offset and 24 bit record size) per slot,
+  i.e. 20 bytes, no per-key allocations. Keys themselves are not stored:
+  the fingerprint and the secondary hash together (96 bits) identify the
+  key, so updates and deletes find the slot of a key without reading its
+  record back (two keys of a shard collide with a chance of about n^2/2^97,
+  2^-37 for a billion keys). Reads still check the key in the record they
+  read anyway. The few records too large for the 24 bit size keep theirs
+  in a side map, under the same fingerprint and secondary hash.
+*/
+class DiskIndex {
+public:
+  static constexpr unsigned OFFSET_BITS = 40;
+  static constexpr unsigned SIZE_BITS = 24;
+  // records must end below this offset (largest offsets mark empty/deleted slots)
+  static constexpr uint64_t MAX_OFFSET = (uint64_t(1) << OFFSET_BITS) - 4;
+  // records this large or larger keep their size in the side map (and the record header)
+  static constexpr uint64_t LARGE_RECORD = (uint64_t(1) << SIZE_BITS) - 1;
+  static constexpr size_t npos = size_t(-1);
+
+  struct Entry {
+    uint64_t rec_pos;    // record offset in the data file
+    uint64_t rec_size;   // whole record size, LARGE_RECORD - see record_size()
+  };
+
+  static uint32_t fingerprint(std::string_view key);
+  // independent of the fingerprint (and of the shard)
+  static uint64_t secondary_hash(std::string_view key);
+
+  static uint64_t pack(uint64_t rec_pos, uint64_t rec_size) {
+    return (std::min(rec_size, LARGE_RECORD) << OFFSET_BITS) | rec_pos;
+  }
+  static Entry unpack(uint64_t loc) {
+    return Entry{loc & ((uint64_t(1) << OFFSET_BITS) - 1), loc >> OFFSET_BITS};
+  }
+
+  DiskIndex() { clear(); }
+
+  size_t size() const { return _size; }
+  size_t capacity() const { return _fps.size(); }
+  size_t memory_usage() const;
+  // changes whenever the slots move (rehash) or the records do (relocate)
+  uint64_t generation() const { return _generation; }
+
+  // call func(slot, entry) for each slot with the fingerprint
+  template <typename Func>
+  void for_each_candidate(uint32_t fp, Func &&func) const {
+    for (size_t slot = fp & _mask; _locs[slot] != EMPTY; slot = (slot + 1) & _mask) {
+      if (_fps[slot] == fp && _locs[slot] != DELETED) {
+        func(slot, unpack(_locs[slot]));
+      }
+    }
+  }
+  // slot pointing to the record at rec_pos, npos if none
+  size_t find(uint32_t fp, uint64_t rec_pos) const;
+  // slot of the key with the fingerprint and the secondary hash, npos if none
+  size_t find_key(uint32_t fp, uint64_t hash2) const;
+  Entry entry(size_t slot) const { return unpack(_locs[slot]); }
+  // whole record size, large records included
+  uint64_t record_size(size_t slot) const;
+  uint64_t hash2(size_t slot) const { return _hash2[slot]; }
+
+  void insert(uint32_t fp, uint64_t rec_pos, uint64_t rec_size, uint64_t hash2);
+  void update(size_t slot, uint64_t rec_pos, uint64_t rec_size);
+  void erase(size_t slot);
+  void clear();
+
+  // call func(fp, hash2, entry) for each used slot in the [from, to) range
+  template <typename Func>
+  void for_each(size_t from, size_t to, Func &&func) const {
+    for (size_t slot = from; slot < to && slot < _locs.size(); ++slot) {
+      if (_locs[slot] < DELETED) {
+        func(_fps[slot], _hash2[slot], unpack(_locs[slot]));
+      }
+    }
+  }
+
+  // move all records, new_pos(rec_pos) returns the new record offset
+  template <typename Func>
+  void relocate(Func &&new_pos) {
+    for (auto &loc : _locs) {
+      if (loc < DELETED) {
+        const Entry e = unpack(loc);
+        loc = pack(new_pos(e.rec_pos), e.rec_size);
+      }
+    }
+    ++_generation;
+  }
+
+private:
+  static constexpr uint64_t EMPTY = ~uint64_t(0);
+  static constexpr uint64_t DELETED = ~uint64_t(0) - 1;
+  static constexpr size_t MIN_CAPACITY = 16;
+
+  // key identity: fingerprint and secondary hash
+  struct KeyId {
+    uint32_t fp;
+    uint64_t hash2;
+    bool operator==(const KeyId &) const = default;
+  };
+  struct KeyIdHash {
+    size_t operator()(const KeyId &id) const { return id.hash2 ^ id.fp; }
+  };
+
+  void rehash(size_t capacity);
+  KeyId key_id(size_t slot) const { return KeyId{_fps[slot], _hash2[slot]}; }
+  void set_large_size(KeyId id, uint64_t rec_size);
+
+  std::vector<uint32_t> _fps;
+  std::vector<uint64_t> _hash2;
+  std::vector<uint64_t> _locs;     // packed entries, EMPTY or DELETED
+  // key -> size of its record of LARGE_RECORD bytes or more
+  std::unordered_map<KeyId, uint64_t, KeyIdHash> _large_sizes;
+  size_t _mask{0};
+  size_t _size{0};                 // live entries
+  size_t _used{0};                 // live and deleted slots
+  uint64_t _generation{0};
+};
+
+}; // namespace kvdb
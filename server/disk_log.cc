@@ -0,0 +1,327 @@
+#include "disk_log.hh"
+
+#include "seastar/core/coroutine.hh"
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define KVDB_CRC_X86 1
+#endif
+
+namespace kvdb {
+
+static constexpr uint32_t CRC32C_POLY = 0x82f63b78;   // reflected
+
+static constexpr std::array<uint32_t, 256> make_crc_table()
+{
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int bit = 0; bit < 8; ++bit) {
+      c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY : 0);
+    }
+    table[i] = c;
+  }
+  return table;
+}
+
+static constexpr std::array<uint32_t, 256> crc_table = make_crc_table();
+
+static uint32_t crc32c_scalar(uint32_t crc, const char *data, size_t len)
+{
+  for (size_t i = 0; i < len; ++i) {
+    crc = crc_table[(crc ^ static_cast<unsigned char>(data[i])) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef KVDB_CRC_X86
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const char *data, size_t len)
+{
+  uint64_t c = crc;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+  }
+  for (; i < len; ++i) {
+    c = _mm_crc32_u8(c, data[i]);
+  }
+  return c;
+}
+
+#endif
+
+using crc_func = uint32_t (*)(uint32_t, const char *, size_t);
+
+static crc_func pick_crc32c()
+{
+#ifdef KVDB_CRC_X86
+  // may run before the constructor setting up the CPU features
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return crc32c_sse42;
+  }
+#endif
+  return crc32c_scalar;
+}
+
+static const crc_func g_crc32c = pick_crc32c();
+
+uint32_t crc32c(uint32_t crc, const char *data, size_t len)
+{
+  return ~g_crc32c(~crc, data, len);
+}
+
+void encode_record(char *rec, unsigned char status, std::string_view key, std::string_view value)
+{
+  const uint16_t key_size = key.size();
+  const uint64_t val_size = value.size();
+  rec[0] = status;
+  memcpy(rec + 1, &key_size, sizeof(uint16_t));
+  memcpy(rec + 3, &val_size, sizeof(uint64_t));
+  memcpy(rec + HEADER_SIZE, key.data(), key.size());
+  memcpy(rec + HEADER_SIZE + key.size(), value.data(), value.size());
+  const uint32_t crc = crc32c(crc32c(0, rec, CRC_OFFSET), rec + HEADER_SIZE, key.size() + value.size());
+  memcpy(rec + CRC_OFFSET, &crc, sizeof(uint32_t));
+}
+
+bool is_legacy_record(unsigned char status)
+{
+  return status >= 1 && status <= 3;
+}
+
+future<> write_fully(file &f, uint64_t pos, const char *buf, size_t len)
+{
+  size_t done = 0;
+  while (done < len) {
+    const size_t written = co_await f.dma_write(pos + done, buf + done, len - done);
+    if (written == 0) {
+      throw std::runtime_error(fmt::format("short write at {}", pos + done));
+    }
+    done += written;
+  }
+}
+
+LogWriter::LogWriter(file f, size_t buf_size)
+ : _f(std::move(f)),
+   _alignment(_f.disk_write_dma_alignment()),
+   _buf_size(align_up<size_t>(buf_size, _alignment)),
+   _buf(seastar::allocate_aligned_buffer<char>(_buf_size, _alignment))
+{
+}
+
+future<> LogWriter::append(const char *data, size_t len)
+{
+  while (len > 0) {
+    const size_t n = std::min(len, _buf_size - _len);
+    memcpy(_buf.get() + _len, data, n);
+    _len += n;
+    data += n;
+    len -= n;
+    if (_len == _buf_size) {
+      co_await write_fully(_f, _pos, _buf.get(), _buf_size);
+      _pos += _buf_size;
+      _len = 0;
+    }
+  }
+}
+
+future<> LogWriter::finish()
+{
+  if (_len > 0) {
+    const size_t aligned_len = align_up<size_t>(_len, _alignment);
+    memset(_buf.get() + _len, 0, aligned_len - _len);
+    co_await write_fully(_f, _pos, _buf.get(), aligned_len);
+  }
+  co_await _f.truncate(offset());
+  co_await _f.flush();
+}
+
+future<> copy_range(file &src, uint64_t from, uint64_t to, LogWriter &writer)
+{
+  constexpr size_t CHUNK_SIZE = 1024 * 1024;
+  while (from < to) {
+    temporary_buffer<char> buf = co_await src.dma_read<char>(from, std::min<uint64_t>(to - from, CHUNK_SIZE));
+    if (buf.empty()) {
+      throw std::runtime_error(fmt::format("unexpected end of file at {}", from));
+    }
+    co_await writer.append(buf.get(), buf.size());
+    from += buf.size();
+  }
+}
+
+void LogReader::read_ahead()
+{
+  if (!_ahead && _next_pos < _end) {
+    _ahead = _f.dma_read<char>(_next_pos, std::min<uint64_t>(_chunk_size, _end - _next_pos));
+  }
+}
+
+future<bool> LogReader::fill(size_t n)
+{
+  while (_buf.size() < n) {
+    temporary_buffer<char> chunk;
+    if (!_pending.empty()) {
+      chunk = std::move(_pending);
+    } else {
+      if (_next_pos >= _end) {
+        co_return false;
+      }
+      read_ahead();
+      chunk = co_await std::move(*_ahead);
+      _ahead.reset();
+      if (chunk.empty()) {
+        _end = _next_pos;  // file is shorter than expected
+        co_return false;
+      }
+      _next_pos += chunk.size();
+      // double buffering, next chunk is read while this one is parsed
+      read_ahead();
+    }
+
+    if (_buf.empty()) {
+      _buf = std::move(chunk);
+      continue;
+    }
+    // record crosses the chunk boundary, join only the bytes needed
+    // and keep the rest of the chunk for later
+    const size_t take = std::min(chunk.size(), n - _buf.size());
+    temporary_buffer<char> joined(_buf.size() + take);
+    memcpy(joined.get_write(), _buf.get(), _buf.size());
+    memcpy(joined.get_write() + _buf.size(), chunk.get(), take);
+    chunk.trim_front(take);
+    _buf = std::move(joined);
+    _pending = std::move(chunk);
+  }
+  co_return true;
+}
+
+future<> LogReader::skip(uint64_t n)
+{
+  const uint64_t target = _pos + n;
+  _pos = target;
+  if (n <= _buf.size()) {
+    _buf.trim_front(n);
+    co_return;
+  }
+  n -= _buf.size();
+  _buf = temporary_buffer<char>();
+  if (n <= _pending.size()) {
+    _pending.trim_front(n);
+    _buf = std::move(_pending);
+    co_return;
+  }
+  _pending = temporary_buffer<char>();
+
+  // target is past the buffered data (large value),
+  // the chunk read ahead is only useful if it covers the target
+  if (_ahead) {
+    temporary_buffer<char> chunk = co_await std::move(*_ahead);
+    _ahead.reset();
+    const uint64_t chunk_pos = _next_pos;
+    _next_pos += chunk.size();
+    if (target < _next_pos) {
+      chunk.trim_front(target - chunk_pos);
+      _buf = std::move(chunk);
+      read_ahead();
+      co_return;
+    }
+  }
+  _next_pos = target;
+  read_ahead();
+}
+
+future<std::optional<uint32_t>> LogReader::value_crc(uint32_t crc, uint64_t pos, uint64_t size)
+{
+  // the buffered data stays as it is, the value is skipped or copied afterwards
+  while (size > 0) {
+    temporary_buffer<char> buf = co_await _f.dma_read<char>(pos, std::min<uint64_t>(size, _chunk_size));
+    if (buf.empty()) {
+      co_return std::nullopt;   // file is shorter than expected
+    }
+    crc = crc32c(crc, buf.get(), buf.size());
+    pos += buf.size();
+    size -= buf.size();
+  }
+  co_return crc;
+}
+
+future<std::optional<LogRecord>> LogReader::next()
+{
+  // skip the rest of the previous record
+  if (_rec_end > _pos) {
+    co_await skip(_rec_end - _pos);
+  }
+  if (_pos >= _end || !co_await fill(HEADER_SIZE)) {
+    co_return std::nullopt;
+  }
+
+  const unsigned char status = _buf[0];
+  uint16_t key_size;
+  uint64_t val_size;
+  uint32_t crc;
+  memcpy(&key_size, _buf.get() + 1, sizeof(uint16_t));
+  memcpy(&val_size, _buf.get() + 3, sizeof(uint64_t));
+  memcpy(&crc, _buf.get() + CRC_OFFSET, sizeof(uint32_t));
+  if (status != REC_VALID && status != REC_TOMBSTONE) {
+    co_return std::nullopt;
+  }
+  // record must fit into the file, otherwise its write was interrupted
+  const uint64_t avail = _end - _pos;
+  if (HEADER_SIZE + key_size > avail || val_size > avail - HEADER_SIZE - key_size) {
+    co_return std::nullopt;
+  }
+
+  // a partially persisted batch or a torn block may leave garbage of the right size,
+  // only the checksum tells, the whole record is buffered unless it's larger than a chunk
+  const uint64_t rec_size = HEADER_SIZE + key_size + val_size;
+  const bool buffered = rec_size <= _chunk_size;
+  if (!co_await fill(buffered ? rec_size : HEADER_SIZE + key_size)) {
+    co_return std::nullopt;
+  }
+  std::optional<uint32_t> actual = crc32c(crc32c(0, _buf.get(), CRC_OFFSET), _buf.get() + HEADER_SIZE, key_size);
+  if (buffered) {
+    actual = crc32c(*actual, _buf.get() + HEADER_SIZE + key_size, val_size);
+  } else {
+    actual = co_await value_crc(*actual, _pos + HEADER_SIZE + key_size, val_size);
+  }
+  if (actual != crc) {
+    co_return std::nullopt;
+  }
+
+  _rec_end = _pos + rec_size;
+  co_return LogRecord{_pos, status, std::string_view(_buf.get() + HEADER_SIZE, key_size), val_size};
+}
+
+future<> LogReader::copy_record(LogWriter &writer)
+{
+  while (_pos < _rec_end) {
+    if (_buf.empty() && !co_await fill(1)) {
+      throw std::runtime_error(fmt::format("unexpected end of file at {}", _pos));
+    }
+    const size_t take = std::min<uint64_t>(_rec_end - _pos, _buf.size());
+    co_await writer.append(_buf.get(), take);
+    _buf.trim_front(take);
+    _pos += take;
+  }
+}
+
+future<> LogReader::close()
+{
+  if (_ahead) {
+    try {
+      co_await std::move(*_ahead);
+    } catch (...) {
+      // the data isn't needed anymore
+    }
+    _ahead.reset();
+  }
+}
+
+}; // namespace kvdb
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <string_view>
+#include <optional>
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/file.hh>
+#include <seastar/core/aligned_buffer.hh>
+#include <seastar/core/temporary_buffer.hh>
+
+using namespace seastar;
+
+namespace kvdb {
+
+// On-disk data is stored in separate file for each CPU core shard.
+// Data consists of individual key/value records stored sequentially,
+// records are always appended to the existing file, existing records
+// are never modified.
+// Updating a key appends a new record, deleting a key appends a tombstone
+// record (key without value). When the index is built, the last record
+// of each key wins.
+//
+// Record layout:
+// - 1 byte record status: 4-valid, 5-tombstone
+//   (1, 2 and 3 are the records of older versions, without a checksum)
+// - 2 byte key length (unsigned)
+// - 8 bytes value length (unsigned)
+// - 4 bytes CRC-32C of the record, the checksum itself excluded
+// - key data bytes follow
+// - value data bytes follow
+
+constexpr size_t HEADER_SIZE = 15;  // first 4 members of the above record
+constexpr size_t CRC_OFFSET = 11;   // checksum position in the header
+constexpr unsigned char REC_VALID = 4;
+constexpr unsigned char REC_TOMBSTONE = 5;
+
+// CRC-32C (Castagnoli), crc32c(crc32c(0, a), b) is the checksum of a and b joined
+uint32_t crc32c(uint32_t crc, const char *data, size_t len);
+// write the record (HEADER_SIZE + key and value size bytes) to rec
+void encode_record(char *rec, unsigned char status, std::string_view key, std::string_view value);
+// status byte of the records written by older versions
+bool is_legacy_record(unsigned char status);
+
+future<> write_fully(file &f, uint64_t pos, const char *buf, size_t len);
+
+/*
+  Sequential writer filling a new file through an aligned buffer.
+*/
+class LogWriter {
+public:
+  LogWriter(file f, size_t buf_size);
+
+  uint64_t offset() const { return _pos + _len; }
+
+  future<> append(const char *data, size_t len);
+  // write out the buffered rest, trim the block padding and sync the file
+  future<> finish();
+
+private:
+  file _f;
+  const size_t _alignment;
+  const size_t _buf_size;
+  std::unique_ptr<char[], seastar::free_deleter> _buf;
+  uint64_t _pos{0};   // file offset of the buffer start
+  size_t _len{0};     // bytes used in the buffer
+};
+
+// copy [from, to) byte range of the source file
+future<> copy_range(file &src, uint64_t from, uint64_t to, LogWriter &writer);
+
+struct LogRecord {
+  uint64_t pos;           // record offset in the file
+  unsigned char status;
+  std::string_view key;   // valid until the next record is read
+  uint64_t val_size;
+
+  uint64_t val_pos() const { return pos + HEADER_SIZE + key.size(); }
+  uint64_t size() const { return HEADER_SIZE + key.size() + val_size; }
+};
+
+/*
+  Streaming data file reader, used by recovery and compaction.
+  File is read in large chunks, the next chunk is read ahead while
+  the current one is parsed. Records crossing the chunk boundary are
+  joined in memory. Each record is checked against its checksum, records
+  larger than a chunk have their value read on its own for that.
+  Reading stops at the first torn (partially written) or invalid record,
+  offset() then points right after the last complete record.
+*/
+class LogReader {
+public:
+  static constexpr size_t DEFAULT_CHUNK_SIZE = 4 * 1024 * 1024;
+
+  LogReader(file f, uint64_t start, uint64_t end, size_t chunk_size = DEFAULT_CHUNK_SIZE)
+   : _f(std::move(f)), _pos(start), _next_pos(start), _rec_end(start), _end(end), _chunk_size(chunk_size) {}
+
+  // next record, nullopt at the end of data or at a torn/invalid/corrupted record
+  future<std::optional<LogRecord>> next();
+  // copy the whole current record (as returned by next())
+  future<> copy_record(LogWriter &writer);
+  // offset of the first byte not consumed yet
+  uint64_t offset() const { return _pos; }
+
+  future<> close();
+
+private:
+  future<bool> fill(size_t n);
+  future<> skip(uint64_t n);
+  // checksum of crc (the record so far) and the value bytes [pos, pos + size) read from the file
+  future<std::optional<uint32_t>> value_crc(uint32_t crc, uint64_t pos, uint64_t size);
+  void read_ahead();
+
+  file _f;
+  // unparsed data, starting at file offset _pos, followed by _pending
+  temporary_buffer<char> _buf;
+  temporary_buffer<char> _pending;
+  uint64_t _pos;
+  // file offset of the next chunk (being read ahead)
+  uint64_t _next_pos;
+  std::optional<future<temporary_buffer<char>>> _ahead;
+  uint64_t _rec_end;
+  uint64_t _end;
+  size_t _chunk_size;
+};
+
+}; // namespace kvdb
@@ -0,0 +1,66 @@
+#include "frequency_sketch.hh"
+
+#include <algorithm>
+
+namespace kvdb {
+
+static constexpr size_t MIN_WIDTH = 64;
+
+void FrequencySketch::resize(size_t width)
+{
+  size_t w = MIN_WIDTH;
+  while (w < width) {
+    w *= 2;
+  }
+  _table.assign(ROWS * w, 0);
+  _table.shrink_to_fit();
+  _mask = w - 1;
+  _additions = 0;
+}
+
+size_t FrequencySketch::index(uint64_t hash, size_t row) const
+{
+  // cache keys share their low hash bits (shard selection), mix all of them
+  // with a different seed for each row
+  uint64_t h = hash + (row + 1) * 0x9e3779b97f4a7c15ull;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  h ^= h >> 31;
+  return row * width() + (h & _mask);
+}
+
+void FrequencySketch::increment(uint64_t hash)
+{
+  // conservative update: only the smallest counters grow
+  const uint8_t min = estimate(hash);
+  if (min < MAX_COUNT) {
+    for (size_t row = 0; row < ROWS; ++row) {
+      uint8_t &c = _table[index(hash, row)];
+      if (c == min) {
+        ++c;
+      }
+    }
+  }
+  if (++_additions >= SAMPLE_FACTOR * width()) {
+    age();
+  }
+}
+
+uint8_t FrequencySketch::estimate(uint64_t hash) const
+{
+  uint8_t min = MAX_COUNT;
+  for (size_t row = 0; row < ROWS; ++row) {
+    min = std::min(min, _table[index(hash, row)]);
+  }
+  return min;
+}
+
+void FrequencySketch::age()
+{
+  for (auto &c : _table) {
+    c >>= 1;
+  }
+  _additions /= 2;
+}
+
+}; // namespace kvdb
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace kvdb {
+
+/*
+  Approximate access frequency of keys (count-min sketch) for cache
+  admission. Each key maps to one small saturating counter in each of
+  ROWS rows, its estimate is the smallest of them. Counters are halved
+  once the number of increments reaches SAMPLE_FACTOR times the width,
+  so old popularity fades away (aging).
+*/
+class FrequencySketch {
+public:
+  static constexpr size_t ROWS = 4;
+  static constexpr uint8_t MAX_COUNT = 15;
+  static constexpr size_t SAMPLE_FACTOR = 10;
+
+  FrequencySketch() { resize(0); }
+
+  // counters for about width distinct keys, resets all counts
+  void resize(size_t width);
+  size_t width() const { return _mask + 1; }
+  size_t memory_usage() const { return _table.capacity(); }
+
+  void increment(uint64_t hash);
+  uint8_t estimate(uint64_t hash) const;
+
+private:
+  size_t index(uint64_t hash, size_t row) const;
+  // halve all counters
+  void age();
+
+  // ROWS rows of width counters
+  std::vector<uint8_t> _table;
+  size_t _mask{0};
+  size_t _additions{0};
+};
+
+}; // namespace kvdb
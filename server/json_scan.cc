@@ -0,0 +1,581 @@
+#include "json_scan.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KVDB_JSON_X86 1
+#endif
+
+namespace kvdb {
+
+/*
+  Character search: offset of the first character of interest in p[0, n),
+  n if there is none. Strings need quotes and backslashes, skipped nested
+  values need quotes and brackets ('[' and '{', ']' and '}' differ only
+  in bit 0x20), escaping needs quotes, backslashes and control characters.
+*/
+static inline bool is_string_special(char c)
+{
+  return c == '"' || c == '\\';
+}
+
+static inline bool is_structural(char c)
+{
+  const char lower = c | 0x20;
+  return c == '"' || lower == '{' || lower == '}';
+}
+
+static inline bool needs_escape(char c)
+{
+  return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+}
+
+static size_t find_escape_scalar(const char *p, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (needs_escape(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+static size_t find_string_special_scalar(const char *p, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (is_string_special(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+static size_t find_structural_scalar(const char *p, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) {
+    if (is_structural(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+#ifdef KVDB_JSON_X86
+
+static size_t find_string_special_sse2(const char *p, size_t n)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    const unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + find_string_special_scalar(p + i, n - i);
+}
+
+static size_t find_structural_sse2(const char *p, size_t n)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i case_bit = _mm_set1_epi8(0x20);
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    const __m128i lower = _mm_or_si128(v, case_bit);
+    const __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                      _mm_or_si128(_mm_cmpeq_epi8(lower, open), _mm_cmpeq_epi8(lower, close)));
+    const unsigned mask = _mm_movemask_epi8(hits);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + find_structural_scalar(p + i, n - i);
+}
+
+static size_t find_escape_sse2(const char *p, size_t n)
+{
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    // unsigned v <= 0x1f
+    const __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(v, control), v);
+    const __m128i hits = _mm_or_si128(low, _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash)));
+    const unsigned mask = _mm_movemask_epi8(hits);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + find_escape_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_string_special_avx2(const char *p, size_t n)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    const unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  // the tail here too, calling SSE code with the upper AVX state dirty is slow
+  for (; i < n; ++i) {
+    if (is_string_special(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t find_structural_avx2(const char *p, size_t n)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i case_bit = _mm256_set1_epi8(0x20);
+  const __m256i open = _mm256_set1_epi8('{');
+  const __m256i close = _mm256_set1_epi8('}');
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    const __m256i lower = _mm256_or_si256(v, case_bit);
+    const __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+                                         _mm256_or_si256(_mm256_cmpeq_epi8(lower, open), _mm256_cmpeq_epi8(lower, close)));
+    const unsigned mask = _mm256_movemask_epi8(hits);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < n; ++i) {
+    if (is_structural(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+__attribute__((target("avx2")))
+static size_t find_escape_avx2(const char *p, size_t n)
+{
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+    const __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v);
+    const __m256i hits = _mm256_or_si256(low, _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash)));
+    const unsigned mask = _mm256_movemask_epi8(hits);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  for (; i < n; ++i) {
+    if (needs_escape(p[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+#endif
+
+using find_func = size_t (*)(const char *p, size_t n);
+
+struct Finders {
+  JsonSimd level;
+  find_func string_special;
+  find_func structural;
+  find_func escape;
+};
+
+static Finders finders_for(JsonSimd level)
+{
+  switch (level) {
+#ifdef KVDB_JSON_X86
+  case JsonSimd::avx2:
+    return Finders{level, find_string_special_avx2, find_structural_avx2, find_escape_avx2};
+  case JsonSimd::sse2:
+    return Finders{level, find_string_special_sse2, find_structural_sse2, find_escape_sse2};
+#endif
+  default:
+    return Finders{JsonSimd::scalar, find_string_special_scalar, find_structural_scalar, find_escape_scalar};
+  }
+}
+
+static bool supported(JsonSimd level)
+{
+#ifdef KVDB_JSON_X86
+  if (level == JsonSimd::avx2) {
+    // may run before the constructor setting up the CPU features
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }
+  return true;
+#else
+  return level == JsonSimd::scalar;
+#endif
+}
+
+static Finders g_finders = finders_for(supported(JsonSimd::avx2) ? JsonSimd::avx2 :
+                                       supported(JsonSimd::sse2) ? JsonSimd::sse2 : JsonSimd::scalar);
+
+JsonSimd json_simd()
+{
+  return g_finders.level;
+}
+
+bool set_json_simd(JsonSimd level)
+{
+  if (!supported(level)) {
+    return false;
+  }
+  g_finders = finders_for(level);
+  return true;
+}
+
+const char *json_simd_name(JsonSimd level)
+{
+  switch (level) {
+  case JsonSimd::avx2: return "avx2";
+  case JsonSimd::sse2: return "sse2";
+  default: return "scalar";
+  }
+}
+
+size_t json_escape_offset(std::string_view s)
+{
+  return g_finders.escape(s.data(), s.size());
+}
+
+static int hex_digit(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  const char lower = c | 0x20;
+  if (lower >= 'a' && lower <= 'f') {
+    return lower - 'a' + 10;
+  }
+  return -1;
+}
+
+// code unit of the 4 hex digits at p, -1 if they are not
+static int32_t hex4(const char *p)
+{
+  int32_t v = 0;
+  for (int i = 0; i < 4; ++i) {
+    const int d = hex_digit(p[i]);
+    if (d < 0) {
+      return -1;
+    }
+    v = v * 16 + d;
+  }
+  return v;
+}
+
+/*
+  Recursive descent over the top level value only, cursor at p.
+*/
+class JsonScanner {
+public:
+  explicit JsonScanner(std::string_view text) : _p(text.data()), _end(text.data() + text.size()) {}
+
+  void skip_ws() {
+    while (_p < _end && (*_p == ' ' || *_p == '\n' || *_p == '\r' || *_p == '\t')) {
+      ++_p;
+    }
+  }
+
+  bool at_end() const { return _p == _end; }
+  bool peek(char c) const { return _p < _end && *_p == c; }
+
+  bool consume(char c) {
+    if (!peek(c)) {
+      return false;
+    }
+    ++_p;
+    return true;
+  }
+
+  // string at the cursor, its contents go to v
+  bool string(JsonValue &v) {
+    if (!consume('"')) {
+      return false;
+    }
+    const char *start = _p;
+    bool escaped = false;
+    while (true) {
+      _p += g_finders.string_special(_p, _end - _p);
+      if (_p == _end) {
+        return false;
+      }
+      if (*_p == '"') {
+        break;
+      }
+      // escape sequence
+      escaped = true;
+      if (_end - _p < 2) {
+        return false;
+      }
+      switch (_p[1]) {
+      case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+        _p += 2;
+        break;
+      case 'u':
+        if (_end - _p < 6 || hex4(_p + 2) < 0) {
+          return false;
+        }
+        _p += 6;
+        break;
+      default:
+        return false;
+      }
+    }
+    v.type = JsonValue::Type::string;
+    v.text = std::string_view(start, _p - start);
+    v.escaped = escaped;
+    ++_p;
+    return true;
+  }
+
+  // any value at the cursor, nested arrays and objects are skipped
+  bool value(JsonValue &v) {
+    if (_p == _end) {
+      return false;
+    }
+    const char *start = _p;
+    if (*_p == '"') {
+      return string(v);
+    }
+    if (*_p == '[' || *_p == '{') {
+      if (!skip_nested()) {
+        return false;
+      }
+      v.type = *start == '[' ? JsonValue::Type::array : JsonValue::Type::object;
+      v.text = std::string_view(start, _p - start);
+      v.escaped = false;
+      return true;
+    }
+    while (_p < _end && *_p != ',' && *_p != '}' && *_p != ']' &&
+           *_p != ' ' && *_p != '\n' && *_p != '\r' && *_p != '\t') {
+      ++_p;
+    }
+    const std::string_view text(start, _p - start);
+    if (text == "true" || text == "false" || text == "null") {
+      v.type = JsonValue::Type::literal;
+    } else if (!text.empty() && (text[0] == '-' || (text[0] >= '0' && text[0] <= '9')) &&
+               text.find_first_not_of("0123456789+-.eE") == std::string_view::npos) {
+      v.type = JsonValue::Type::number;
+    } else {
+      return false;
+    }
+    v.text = text;
+    v.escaped = false;
+    return true;
+  }
+
+private:
+  // array or object at the cursor, up to its closing bracket
+  bool skip_nested() {
+    std::string stack;
+    while (true) {
+      _p += g_finders.structural(_p, _end - _p);
+      if (_p == _end) {
+        return false;
+      }
+      switch (*_p) {
+      case '"': {
+        JsonValue ignored;
+        if (!string(ignored)) {
+          return false;
+        }
+        continue;
+      }
+      case '[':
+      case '{':
+        stack.push_back(*_p == '[' ? ']' : '}');
+        break;
+      default:
+        if (stack.empty() || stack.back() != *_p) {
+          return false;
+        }
+        stack.pop_back();
+        break;
+      }
+      ++_p;
+      if (stack.empty()) {
+        return true;
+      }
+    }
+  }
+
+  const char *_p;
+  const char *_end;
+};
+
+bool scan_json_object(std::string_view text, std::span<JsonField> fields)
+{
+  JsonScanner s(text);
+  s.skip_ws();
+  if (!s.consume('{')) {
+    return false;
+  }
+  s.skip_ws();
+  if (!s.consume('}')) {
+    std::string decoded;
+    while (true) {
+      JsonValue name, value;
+      if (!s.string(name)) {
+        return false;
+      }
+      s.skip_ws();
+      if (!s.consume(':')) {
+        return false;
+      }
+      s.skip_ws();
+      if (!s.value(value)) {
+        return false;
+      }
+      std::string_view key = name.text;
+      if (name.escaped) {
+        decoded = name.str();
+        key = decoded;
+      }
+      for (auto &field : fields) {
+        if (field.name == key) {
+          field.value = value;
+        }
+      }
+      s.skip_ws();
+      if (s.consume('}')) {
+        break;
+      }
+      if (!s.consume(',')) {
+        return false;
+      }
+      s.skip_ws();
+    }
+  }
+  s.skip_ws();
+  return s.at_end();
+}
+
+bool scan_json_array(std::string_view text, std::vector<JsonValue> &out)
+{
+  JsonScanner s(text);
+  s.skip_ws();
+  if (!s.consume('[')) {
+    return false;
+  }
+  s.skip_ws();
+  if (!s.consume(']')) {
+    while (true) {
+      JsonValue value;
+      if (!s.value(value)) {
+        return false;
+      }
+      out.push_back(value);
+      s.skip_ws();
+      if (s.consume(']')) {
+        break;
+      }
+      if (!s.consume(',')) {
+        return false;
+      }
+      s.skip_ws();
+    }
+  }
+  s.skip_ws();
+  return s.at_end();
+}
+
+// UTF-8 encoding of the code point
+static void append_utf8(std::string &out, uint32_t cp)
+{
+  if (cp < 0x80) {
+    out.push_back(cp);
+  } else if (cp < 0x800) {
+    out.push_back(0xc0 | (cp >> 6));
+    out.push_back(0x80 | (cp & 0x3f));
+  } else if (cp < 0x10000) {
+    out.push_back(0xe0 | (cp >> 12));
+    out.push_back(0x80 | ((cp >> 6) & 0x3f));
+    out.push_back(0x80 | (cp & 0x3f));
+  } else {
+    out.push_back(0xf0 | (cp >> 18));
+    out.push_back(0x80 | ((cp >> 12) & 0x3f));
+    out.push_back(0x80 | ((cp >> 6) & 0x3f));
+    out.push_back(0x80 | (cp & 0x3f));
+  }
+}
+
+std::string JsonValue::str() const
+{
+  if (!escaped) {
+    return std::string(text);
+  }
+  // escapes were checked by the scanner
+  std::string out;
+  out.reserve(text.size());
+  size_t i = 0;
+  while (i < text.size()) {
+    const size_t next = text.find('\\', i);
+    out.append(text.substr(i, next - i));
+    if (next == std::string_view::npos) {
+      break;
+    }
+    const char c = text[next + 1];
+    i = next + 2;
+    switch (c) {
+    case 'b': out.push_back('\b'); break;
+    case 'f': out.push_back('\f'); break;
+    case 'n': out.push_back('\n'); break;
+    case 'r': out.push_back('\r'); break;
+    case 't': out.push_back('\t'); break;
+    case 'u': {
+      uint32_t cp = hex4(text.data() + i);
+      i += 4;
+      // surrogate pair
+      if (cp >= 0xd800 && cp < 0xdc00 && i + 6 <= text.size() && text[i] == '\\' && text[i + 1] == 'u') {
+        const int32_t low = hex4(text.data() + i + 2);
+        if (low >= 0xdc00 && low < 0xe000) {
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+          i += 6;
+        }
+      }
+      append_utf8(out, cp);
+      break;
+    }
+    default: out.push_back(c); break;   // quote, backslash, slash
+    }
+  }
+  return out;
+}
+
+bool JsonValue::to_uint(uint64_t &out) const
+{
+  if (type != Type::number || text.empty()) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (char c : text) {
+    if (c < '0' || c > '9' || v > (UINT64_MAX - 9) / 10) {
+      return false;
+    }
+    v = v * 10 + (c - '0');
+  }
+  out = v;
+  return true;
+}
+
+}; // namespace kvdb
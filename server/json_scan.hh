@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kvdb {
+
+/*
+  Single pass JSON scanner for request bodies. Values are views into the
+  scanned text (no copies), string values keep their escape sequences
+  until str() decodes them. Quotes, backslashes and brackets are found
+  16 (SSE2) or 32 (AVX2, if the CPU has it) bytes at a time, with a
+  scalar fallback on other platforms. Nested arrays and objects are
+  skipped by matching their brackets (their strings are scanned), their
+  members are checked only once they are scanned themselves.
+*/
+struct JsonValue {
+  enum class Type : uint8_t { none, string, number, literal, array, object };
+
+  Type type{Type::none};
+  // string contents without the quotes, or the whole value text
+  std::string_view text;
+  // string with escape sequences
+  bool escaped{false};
+
+  explicit operator bool() const { return type != Type::none; }
+  bool is_string() const { return type == Type::string; }
+  bool is_array() const { return type == Type::array; }
+  bool is_object() const { return type == Type::object; }
+
+  // decoded string value
+  std::string str() const;
+  // non-negative integer value
+  bool to_uint(uint64_t &out) const;
+};
+
+// object member looked up by its name
+struct JsonField {
+  std::string_view name;
+  JsonValue value{};    // none if the member is not there
+};
+
+// fill in the fields with the members of the object in text (the last one wins
+// if a name repeats), false if text is not an object
+bool scan_json_object(std::string_view text, std::span<JsonField> fields);
+// elements of the array in text, false if text is not an array
+bool scan_json_array(std::string_view text, std::vector<JsonValue> &out);
+
+// SIMD level of the character searches (scanning and escaping)
+enum class JsonSimd { scalar, sse2, avx2 };
+// best level supported by the CPU is used by default
+JsonSimd json_simd();
+// false if the CPU does not support the level
+bool set_json_simd(JsonSimd level);
+const char *json_simd_name(JsonSimd level);
+
+// offset of the first character of s to be escaped in a JSON string, s.size() if none
+size_t json_escape_offset(std::string_view s);
+
+// call out(chunk) with the pieces of s escaped as a JSON string (no quotes around)
+template <typename Out>
+void write_json_escaped(std::string_view s, Out out)
+{
+  static constexpr char HEX[] = "0123456789abcdef";
+  while (true) {
+    const size_t i = json_escape_offset(s);
+    if (i > 0) {
+      out(s.substr(0, i));
+    }
+    if (i == s.size()) {
+      return;
+    }
+    const unsigned char c = s[i];
+    const char esc[] = {'\\', 'u', '0', '0', HEX[c >> 4], HEX[c & 0xf]};
+    switch (c) {
+    case '"': out(std::string_view("\\\"")); break;
+    case '\\': out(std::string_view("\\\\")); break;
+    case '\n': out(std::string_view("\\n")); break;
+    case '\r': out(std::string_view("\\r")); break;
+    case '\t': out(std::string_view("\\t")); break;
+    default: out(std::string_view(esc, sizeof(esc))); break;
+    }
+    s.remove_prefix(i + 1);
+  }
+}
+
+}; // namespace kvdb
@@ -0,0 +1,271 @@
+#include "key_index.hh"
+
+#include <cassert>
+#include <cstring>
+
+namespace kvdb {
+
+static constexpr size_t ENTRY_HEADER = 2 * sizeof(uint16_t);
+
+// decode the entry at p, returns its suffix
+static std::string_view decode(const char *p, uint16_t &shared)
+{
+  uint16_t len;
+  memcpy(&shared, p, sizeof(uint16_t));
+  memcpy(&len, p + sizeof(uint16_t), sizeof(uint16_t));
+  return std::string_view(p + ENTRY_HEADER, len);
+}
+
+// replace len bytes at offset with repl
+static void splice(std::vector<char> &data, size_t offset, size_t len, const std::vector<char> &repl)
+{
+  if (repl.size() > len) {
+    data.insert(data.begin() + offset + len, repl.size() - len, 0);
+  } else if (repl.size() < len) {
+    data.erase(data.begin() + offset + repl.size(), data.begin() + offset + len);
+  }
+  if (!repl.empty()) {
+    memcpy(data.data() + offset, repl.data(), repl.size());
+  }
+}
+
+void KeyIndex::encode(std::vector<char> &out, std::string_view prev, std::string_view key)
+{
+  assert(key.size() <= UINT16_MAX);
+  const size_t max_shared = std::min(prev.size(), key.size());
+  uint16_t shared = 0;
+  while (shared < max_shared && prev[shared] == key[shared]) {
+    ++shared;
+  }
+  const uint16_t len = key.size() - shared;
+  const size_t offset = out.size();
+  out.resize(offset + ENTRY_HEADER + len);
+  memcpy(out.data() + offset, &shared, sizeof(uint16_t));
+  memcpy(out.data() + offset + sizeof(uint16_t), &len, sizeof(uint16_t));
+  memcpy(out.data() + offset + ENTRY_HEADER, key.data() + shared, len);
+}
+
+KeyIndex::Entry KeyIndex::find_in_leaf(const Leaf &leaf, std::string_view key, std::string &prev, bool &found)
+{
+  std::string cur;
+  prev.clear();
+  size_t offset = 0;
+  while (offset < leaf.data.size()) {
+    uint16_t shared;
+    const std::string_view suffix = decode(leaf.data.data() + offset, shared);
+    cur.assign(prev, 0, shared);
+    cur.append(suffix);
+    const int cmp = std::string_view(cur).compare(key);
+    if (cmp >= 0) {
+      found = cmp == 0;
+      return Entry{offset, ENTRY_HEADER + suffix.size()};
+    }
+    prev.swap(cur);
+    offset += ENTRY_HEADER + suffix.size();
+  }
+  found = false;
+  return Entry{offset, 0};
+}
+
+bool KeyIndex::insert(std::string_view key)
+{
+  auto it = std::prev(_leaves.upper_bound(key));
+  Leaf &leaf = it->second;
+  std::string prev;
+  bool found;
+  const Entry e = find_in_leaf(leaf, key, prev, found);
+  if (found) {
+    return false;
+  }
+
+  std::vector<char> repl;
+  encode(repl, prev, key);
+  if (e.offset < leaf.data.size()) {
+    // the following key was encoded against prev, now it follows the new key
+    uint16_t shared;
+    const std::string_view suffix = decode(leaf.data.data() + e.offset, shared);
+    std::string next(prev, 0, shared);
+    next.append(suffix);
+    encode(repl, key, next);
+  }
+  splice(leaf.data, e.offset, e.size, repl);
+  ++leaf.count;
+  ++_size;
+
+  if (leaf.data.size() > LEAF_BYTES && leaf.count > 1) {
+    split(it);
+  }
+  return true;
+}
+
+bool KeyIndex::erase(std::string_view key)
+{
+  auto it = std::prev(_leaves.upper_bound(key));
+  Leaf &leaf = it->second;
+  std::string prev;
+  bool found;
+  const Entry e = find_in_leaf(leaf, key, prev, found);
+  if (!found) {
+    return false;
+  }
+
+  std::vector<char> repl;
+  size_t len = e.size;
+  if (e.offset + e.size < leaf.data.size()) {
+    // the following key was encoded against the erased one
+    uint16_t shared;
+    const std::string_view suffix = decode(leaf.data.data() + e.offset + e.size, shared);
+    std::string next(key.substr(0, shared));
+    next.append(suffix);
+    encode(repl, prev, next);
+    len += ENTRY_HEADER + suffix.size();
+  }
+  splice(leaf.data, e.offset, len, repl);
+  --leaf.count;
+  --_size;
+
+  if (leaf.count == 0 && it != _leaves.begin()) {
+    _leaves.erase(it);
+  } else if (leaf.data.size() < LEAF_BYTES / 4) {
+    merge_next(it);
+  }
+  return true;
+}
+
+bool KeyIndex::contains(std::string_view key) const
+{
+  const auto it = std::prev(_leaves.upper_bound(key));
+  std::string prev;
+  bool found;
+  find_in_leaf(it->second, key, prev, found);
+  return found;
+}
+
+void KeyIndex::split(std::map<std::string, Leaf, std::less<>>::iterator it)
+{
+  Leaf &leaf = it->second;
+  const size_t half = leaf.count / 2;
+  std::string cur;
+  size_t offset = 0;
+  for (size_t i = 0; i <= half; ++i) {
+    uint16_t shared;
+    const std::string_view suffix = decode(leaf.data.data() + offset, shared);
+    cur.resize(shared);
+    cur.append(suffix);
+    if (i < half) {
+      offset += ENTRY_HEADER + suffix.size();
+    }
+  }
+
+  // the first key of the new leaf is stored whole, it is the separator too
+  uint16_t shared;
+  const size_t first_size = ENTRY_HEADER + decode(leaf.data.data() + offset, shared).size();
+  Leaf right;
+  encode(right.data, std::string_view(), cur);
+  right.data.insert(right.data.end(), leaf.data.begin() + offset + first_size, leaf.data.end());
+  right.count = leaf.count - half;
+  leaf.data.resize(offset);
+  leaf.data.shrink_to_fit();
+  leaf.count = half;
+  _leaves.emplace_hint(std::next(it), std::move(cur), std::move(right));
+}
+
+void KeyIndex::merge_next(std::map<std::string, Leaf, std::less<>>::iterator it)
+{
+  const auto next = std::next(it);
+  if (next == _leaves.end() || it->second.data.size() + next->second.data.size() > LEAF_BYTES / 2) {
+    return;
+  }
+  Leaf &leaf = it->second;
+  Leaf &right = next->second;
+  if (right.count > 0) {
+    // last key of the leaf, the first key of the right one gets encoded against it
+    std::string last;
+    size_t offset = 0;
+    while (offset < leaf.data.size()) {
+      uint16_t shared;
+      const std::string_view suffix = decode(leaf.data.data() + offset, shared);
+      last.resize(shared);
+      last.append(suffix);
+      offset += ENTRY_HEADER + suffix.size();
+    }
+    uint16_t shared;
+    const std::string_view first = decode(right.data.data(), shared);
+    assert(shared == 0);
+    encode(leaf.data, last, first);
+    leaf.data.insert(leaf.data.end(), right.data.begin() + ENTRY_HEADER + first.size(), right.data.end());
+    leaf.count += right.count;
+  }
+  _leaves.erase(next);
+}
+
+void KeyIndex::load_sorted(std::string_view key)
+{
+  assert(_size == 0 || key > _load_last);
+  auto it = std::prev(_leaves.end());
+  if (it->second.data.size() >= LEAF_BYTES) {
+    it = _leaves.emplace_hint(_leaves.end(), std::string(key), Leaf());
+    _load_last.clear();
+  }
+  encode(it->second.data, _load_last, key);
+  ++it->second.count;
+  ++_size;
+  _load_last.assign(key);
+}
+
+void KeyIndex::clear()
+{
+  _leaves.clear();
+  _leaves.emplace(std::string(), Leaf());
+  _size = 0;
+  _load_last.clear();
+}
+
+size_t KeyIndex::memory_usage() const
+{
+  // map node: tree links and color, key and leaf
+  constexpr size_t NODE_SIZE = 4 * sizeof(void *) + sizeof(std::string) + sizeof(Leaf);
+  size_t bytes = 0;
+  for (const auto &[separator, leaf] : _leaves) {
+    bytes += NODE_SIZE + leaf.data.capacity();
+    if (separator.capacity() > 15) {
+      bytes += separator.capacity() + 1;
+    }
+  }
+  return bytes;
+}
+
+void KeyIndex::scan(std::string_view prefix, std::string_view after, const std::function<bool(std::string_view)> &func) const
+{
+  // start at the prefix, or right after the given key if that is further
+  const bool skip_start = !after.empty() && after >= prefix;
+  const std::string_view start = skip_start ? after : prefix;
+
+  std::string cur;
+  for (auto it = std::prev(_leaves.upper_bound(start)); it != _leaves.end(); ++it) {
+    const Leaf &leaf = it->second;
+    size_t offset = 0;
+    cur.clear();
+    while (offset < leaf.data.size()) {
+      uint16_t shared;
+      const std::string_view suffix = decode(leaf.data.data() + offset, shared);
+      cur.resize(shared);
+      cur.append(suffix);
+      offset += ENTRY_HEADER + suffix.size();
+
+      const int cmp = std::string_view(cur).compare(start);
+      if (cmp < 0 || (cmp == 0 && skip_start)) {
+        continue;
+      }
+      // keys past the prefix range
+      if (!cur.starts_with(prefix)) {
+        return;
+      }
+      if (!func(cur)) {
+        return;
+      }
+    }
+  }
+}
+
+}; // namespace kvdb
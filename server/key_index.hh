@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace kvdb {
+
+/*
+  Ordered in-memory key set for prefix queries.
+  Two level B+tree: keys are kept sorted in leaves of a few KB, stored
+  front coded (each key only keeps the suffix it does not share with the
+  previous one), leaves are found by their separator key in an ordered map.
+  Query visits only the leaves covering the matching key range.
+  Key size is limited to 64KB (same as in the data file).
+*/
+class KeyIndex {
+public:
+  // leaves are split once their data grows past this
+  static constexpr size_t LEAF_BYTES = 4096;
+
+  KeyIndex() { clear(); }
+
+  // false if the key was there already
+  bool insert(std::string_view key);
+  // false if the key was not there
+  bool erase(std::string_view key);
+  bool contains(std::string_view key) const;
+  // bulk load of sorted keys, only right after clear()
+  void load_sorted(std::string_view key);
+  void clear();
+
+  size_t size() const { return _size; }
+  size_t memory_usage() const;
+
+  // call func(key) in order for the keys starting with prefix and greater than after,
+  // until func returns false
+  void scan(std::string_view prefix, std::string_view after, const std::function<bool(std::string_view)> &func) const;
+
+  // append front coded entry of key following prev (leaves and the hint file)
+  static void encode(std::vector<char> &out, std::string_view prev, std::string_view key);
+
+private:
+  // leaf entry: 2 bytes shared prefix length, 2 bytes suffix length, suffix bytes
+  struct Leaf {
+    std::vector<char> data;
+    size_t count{0};
+  };
+
+  struct Entry {
+    size_t offset;      // entry offset in the leaf data
+    size_t size;        // encoded entry size
+  };
+
+  // position of key in the leaf: first entry not less than key (or end),
+  // prev keeps the key preceding it, found tells if the key is there
+  static Entry find_in_leaf(const Leaf &leaf, std::string_view key, std::string &prev, bool &found);
+  void split(std::map<std::string, Leaf, std::less<>>::iterator it);
+  // join the next leaf into this one if both are small
+  void merge_next(std::map<std::string, Leaf, std::less<>>::iterator it);
+
+  // leaf with all keys >= its separator (and less than the next one),
+  // the first leaf has the empty separator
+  std::map<std::string, Leaf, std::less<>> _leaves;
+  size_t _size{0};
+  std::string _load_last;
+};
+
+}; // namespace kvdb
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+#include <seastar/core/metrics_types.hh>
+
+namespace kvdb {
+
+/*
+  Per shard latency histogram for the metrics: power of 2 buckets from
+  1 us up to 2^23 us (8.4 s), slower samples only go to the count and sum.
+  Exported as a Prometheus histogram (cumulative buckets, seconds).
+*/
+class LatencyHistogram {
+public:
+  static constexpr size_t BUCKETS = 24;
+
+  void add(std::chrono::steady_clock::duration d) {
+    const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+    // bucket i counts latencies up to 2^i us
+    const uint64_t us = (ns + 999) / 1000;
+    const size_t bucket = us <= 1 ? 0 : std::bit_width(us - 1);
+    if (bucket < BUCKETS) {
+      ++_counts[bucket];
+    }
+    ++_count;
+    _sum_ns += ns;
+  }
+
+  seastar::metrics::histogram to_metrics() const {
+    seastar::metrics::histogram h;
+    h.sample_count = _count;
+    h.sample_sum = _sum_ns / 1e9;
+    h.buckets.resize(BUCKETS);
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      cumulative += _counts[i];
+      h.buckets[i].count = cumulative;
+      h.buckets[i].upper_bound = double(uint64_t(1) << i) / 1e6;
+    }
+    return h;
+  }
+
+private:
+  std::array<uint64_t, BUCKETS> _counts{};
+  uint64_t _count{0};
+  uint64_t _sum_ns{0};
+};
+
+}; // namespace kvdb
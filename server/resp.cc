@@ -0,0 +1,438 @@
+#include "resp.hh"
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/print.hh>
+#include <seastar/core/metrics.hh>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+
+namespace kvdb {
+
+// longest inline command and number line accepted
+static constexpr size_t MAX_INLINE_SIZE = 64 * 1024;
+static constexpr size_t MAX_NUMBER_SIZE = 32;
+static constexpr int64_t MAX_ARGS = 1024 * 1024;
+static constexpr int64_t MAX_BULK_SIZE = 512 * 1024 * 1024;
+// values at least this large are written from their buffer into the reply
+static constexpr size_t ZERO_COPY_SIZE = 16 * 1024;
+// open SCAN cursors kept per connection, the oldest ones are dropped
+static constexpr size_t MAX_SCAN_CURSORS = 1024;
+static constexpr uint64_t DEFAULT_SCAN_COUNT = 10;
+
+// number line following the type character at pos, pos moves past its end of line
+static RespParse parse_number(std::string_view data, size_t &pos, int64_t &out)
+{
+  const size_t eol = data.find("\r\n", pos + 1);
+  if (eol == std::string_view::npos) {
+    return data.size() - pos > MAX_NUMBER_SIZE ? RespParse::error : RespParse::incomplete;
+  }
+  const char *first = data.data() + pos + 1;
+  const char *last = data.data() + eol;
+  const auto [end, ec] = std::from_chars(first, last, out);
+  if (ec != std::errc() || end != last || first == last) {
+    return RespParse::error;
+  }
+  pos = eol + 2;
+  return RespParse::done;
+}
+
+static RespParse parse_inline(std::string_view data, std::vector<std::string_view> &args, size_t &consumed)
+{
+  const size_t eol = data.find('\n');
+  if (eol == std::string_view::npos) {
+    return data.size() > MAX_INLINE_SIZE ? RespParse::error : RespParse::incomplete;
+  }
+  std::string_view line = data.substr(0, eol);
+  if (!line.empty() && line.back() == '\r') {
+    line.remove_suffix(1);
+  }
+  while (!line.empty()) {
+    const size_t start = line.find_first_not_of(" \t");
+    if (start == std::string_view::npos) {
+      break;
+    }
+    line.remove_prefix(start);
+    const size_t end = std::min(line.find_first_of(" \t"), line.size());
+    args.push_back(line.substr(0, end));
+    line.remove_prefix(end);
+  }
+  consumed = eol + 1;
+  return RespParse::done;
+}
+
+RespParse parse_resp_request(std::string_view data, std::vector<std::string_view> &args, size_t &consumed)
+{
+  args.clear();
+  if (data.empty()) {
+    return RespParse::incomplete;
+  }
+  if (data[0] != '*') {
+    return parse_inline(data, args, consumed);
+  }
+  size_t pos = 0;
+  int64_t count;
+  RespParse r = parse_number(data, pos, count);
+  if (r != RespParse::done) {
+    return r;
+  }
+  if (count > MAX_ARGS) {
+    return RespParse::error;
+  }
+  args.reserve(std::clamp<int64_t>(count, 0, 1024));
+  for (int64_t i = 0; i < count; ++i) {
+    if (pos >= data.size()) {
+      return RespParse::incomplete;
+    }
+    if (data[pos] != '$') {
+      return RespParse::error;
+    }
+    int64_t size;
+    r = parse_number(data, pos, size);
+    if (r != RespParse::done) {
+      return r;
+    }
+    if (size < 0 || size > MAX_BULK_SIZE) {
+      return RespParse::error;
+    }
+    if (data.size() - pos < size_t(size) + 2) {
+      return RespParse::incomplete;
+    }
+    if (data[pos + size] != '\r' || data[pos + size + 1] != '\n') {
+      return RespParse::error;
+    }
+    args.push_back(data.substr(pos, size));
+    pos += size + 2;
+  }
+  consumed = pos;
+  return RespParse::done;
+}
+
+static bool is_command(std::string_view arg, std::string_view name)
+{
+  return std::equal(arg.begin(), arg.end(), name.begin(), name.end(),
+                    [] (char a, char b) { return std::toupper(static_cast<unsigned char>(a)) == b; });
+}
+
+static bool parse_uint(std::string_view s, uint64_t &out)
+{
+  const auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+  return ec == std::errc() && end == s.data() + s.size() && !s.empty();
+}
+
+static future<> write_header(output_stream<char> &out, char type, uint64_t n)
+{
+  char head[32];
+  const size_t size = fmt::format_to(head, "{}{}\r\n", type, n) - head;
+  return out.write(head, size);
+}
+
+static future<> write_bulk(output_stream<char> &out, std::string_view s)
+{
+  co_await write_header(out, '$', s.size());
+  co_await out.write(s.data(), s.size());
+  co_await out.write("\r\n", 2);
+}
+
+// bulk string reply, null if the value was not found
+static future<> write_value(output_stream<char> &out, Value value)
+{
+  if (value.empty()) {
+    co_await out.write("$-1\r\n", 5);
+    co_return;
+  }
+  co_await write_header(out, '$', value.size());
+  if (value.size() >= ZERO_COPY_SIZE) {
+    co_await out.write(std::move(value));
+  } else {
+    co_await out.write(value.get(), value.size());
+  }
+  co_await out.write("\r\n", 2);
+}
+
+static future<> write_error(output_stream<char> &out, std::string_view message)
+{
+  return out.write(fmt::format("-ERR {}\r\n", message));
+}
+
+static future<> write_arity_error(output_stream<char> &out, std::string_view command)
+{
+  return write_error(out, fmt::format("wrong number of arguments for '{}' command", command));
+}
+
+// keys of the args from first on, step apart, all at most MAX_KEY_SIZE bytes
+static bool keys_fit(const std::vector<std::string_view> &args, size_t first, size_t step)
+{
+  for (size_t i = first; i < args.size(); i += step) {
+    if (args[i].size() > MAX_KEY_SIZE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+future<> RespServer::listen(socket_address addr)
+{
+  listen_options lo;
+  lo.reuse_address = true;
+  _listener = seastar::listen(addr, lo);
+  namespace sm = seastar::metrics;
+  _metrics.add_group("resp", {
+    sm::make_counter("requests", _requests, sm::description("Redis protocol requests")),
+    sm::make_gauge("connections", [this] { return _connections.size(); }, sm::description("open Redis protocol connections")),
+  });
+  // runs until stop() aborts the accept
+  (void)accept_loop();
+  return make_ready_future();
+}
+
+future<> RespServer::accept_loop()
+{
+  auto holder = _gate.hold();
+  while (!_stopping) {
+    accept_result ar;
+    try {
+      ar = co_await _listener->accept();
+    } catch (const std::exception &e) {
+      if (!_stopping) {
+        fmt::print("RespServer {:0>3}: accept failed - {}\n", this_shard_id(), e.what());
+      }
+      break;
+    }
+    if (_stopping) {
+      break;
+    }
+    ar.connection.set_nodelay(true);
+    (void)serve(std::move(ar.connection));
+  }
+}
+
+future<> RespServer::serve(connected_socket socket)
+{
+  auto holder = _gate.hold();
+  auto it = _connections.emplace(_connections.end(), std::move(socket));
+  try {
+    co_await process(*it);
+  } catch (...) {
+    // connections reset by the client end here as well
+  }
+  try {
+    co_await it->out.close();
+  } catch (...) {
+  }
+  _connections.erase(it);
+}
+
+future<> RespServer::process(Connection &conn)
+{
+  std::vector<std::string_view> args;
+  bool quit = false;
+  while (!quit) {
+    temporary_buffer<char> buf = co_await conn.in.read();
+    if (buf.empty()) {
+      break;
+    }
+    // requests are parsed in the read buffer, unless a request started in the previous one
+    const bool pending = !conn.pending.empty();
+    std::string_view data(buf.get(), buf.size());
+    if (pending) {
+      conn.pending.append(data);
+      data = conn.pending;
+    }
+    size_t pos = 0;
+    while (!quit && pos < data.size()) {
+      size_t consumed = 0;
+      const RespParse r = parse_resp_request(data.substr(pos), args, consumed);
+      if (r == RespParse::incomplete) {
+        break;
+      }
+      if (r == RespParse::error) {
+        co_await write_error(conn.out, "Protocol error");
+        quit = true;
+        break;
+      }
+      pos += consumed;
+      if (!args.empty()) {
+        quit = co_await execute(conn, args);
+      }
+    }
+    // replies of all the requests received so far go out together
+    co_await conn.out.flush();
+    if (pending) {
+      conn.pending.erase(0, pos);
+    } else {
+      conn.pending.assign(data.substr(pos));
+    }
+  }
+}
+
+future<bool> RespServer::execute(Connection &conn, const std::vector<std::string_view> &args)
+{
+  auto &out = conn.out;
+  const std::string_view command = args[0];
+  ++_requests;
+  if (is_command(command, "GET")) {
+    if (args.size() != 2) {
+      co_await write_arity_error(out, "get");
+    } else if (!keys_fit(args, 1, 1)) {
+      co_await write_error(out, "key too long");
+    } else {
+      Value value = co_await _db->get(std::string(args[1]));
+      co_await write_value(out, std::move(value));
+    }
+  } else if (is_command(command, "SET")) {
+    if (args.size() != 3) {
+      co_await write_arity_error(out, "set");
+    } else if (!keys_fit(args, 1, 2)) {
+      co_await write_error(out, "key too long");
+    } else {
+      // the value gets a buffer of its own, it goes to the key owner shard
+      co_await _db->set(std::string(args[1]), Value(args[2].data(), args[2].size()));
+      co_await out.write("+OK\r\n", 5);
+    }
+  } else if (is_command(command, "DEL")) {
+    if (args.size() < 2) {
+      co_await write_arity_error(out, "del");
+    } else if (!keys_fit(args, 1, 1)) {
+      co_await write_error(out, "key too long");
+    } else {
+      uint64_t deleted = 0;
+      for (size_t i = 1; i < args.size(); ++i) {
+        deleted += co_await _db->del(std::string(args[i]));
+      }
+      co_await write_header(out, ':', deleted);
+    }
+  } else if (is_command(command, "MGET")) {
+    if (args.size() < 2) {
+      co_await write_arity_error(out, "mget");
+    } else if (!keys_fit(args, 1, 1)) {
+      co_await write_error(out, "key too long");
+    } else {
+      std::vector<Value> values = co_await _db->mget(std::vector<std::string>(args.begin() + 1, args.end()));
+      co_await write_header(out, '*', values.size());
+      for (auto &value : values) {
+        co_await write_value(out, std::move(value));
+      }
+    }
+  } else if (is_command(command, "MSET")) {
+    if (args.size() < 3 || args.size() % 2 == 0) {
+      co_await write_arity_error(out, "mset");
+    } else if (!keys_fit(args, 1, 2)) {
+      co_await write_error(out, "key too long");
+    } else {
+      std::vector<KeyValue> items;
+      items.reserve(args.size() / 2);
+      for (size_t i = 1; i < args.size(); i += 2) {
+        items.emplace_back(std::string(args[i]), Value(args[i + 1].data(), args[i + 1].size()));
+      }
+      co_await _db->mset(std::move(items));
+      co_await out.write("+OK\r\n", 5);
+    }
+  } else if (is_command(command, "SCAN")) {
+    co_await scan(conn, args);
+  } else if (is_command(command, "PING")) {
+    if (args.size() == 1) {
+      co_await out.write("+PONG\r\n", 7);
+    } else {
+      co_await write_bulk(out, args[1]);
+    }
+  } else if (is_command(command, "QUIT")) {
+    co_await out.write("+OK\r\n", 5);
+    co_return true;
+  } else {
+    const bool printable = command.size() <= 64 &&
+      std::all_of(command.begin(), command.end(), [] (char c) { return std::isgraph(static_cast<unsigned char>(c)); });
+    co_await write_error(out, printable ? fmt::format("unknown command '{}'", command) : "unknown command");
+  }
+  co_return false;
+}
+
+/*
+  SCAN cursor [MATCH prefix*] [COUNT count]
+  the keys with the prefix are returned in order, count of them at a time,
+  a cursor refers to the last key returned and is valid on its connection
+*/
+future<> RespServer::scan(Connection &conn, const std::vector<std::string_view> &args)
+{
+  auto &out = conn.out;
+  uint64_t cursor;
+  if (args.size() < 2 || args.size() % 2 != 0) {
+    co_await write_arity_error(out, "scan");
+    co_return;
+  }
+  if (!parse_uint(args[1], cursor)) {
+    co_await write_error(out, "invalid cursor");
+    co_return;
+  }
+  std::string prefix;
+  uint64_t count = DEFAULT_SCAN_COUNT;
+  for (size_t i = 2; i < args.size(); i += 2) {
+    if (is_command(args[i], "MATCH")) {
+      const std::string_view pattern = args[i + 1];
+      if (pattern.empty() || pattern.back() != '*' ||
+          pattern.substr(0, pattern.size() - 1).find_first_of("*?[\\") != std::string_view::npos) {
+        co_await write_error(out, "only prefix* patterns are supported");
+        co_return;
+      }
+      prefix = pattern.substr(0, pattern.size() - 1);
+    } else if (is_command(args[i], "COUNT")) {
+      if (!parse_uint(args[i + 1], count) || count == 0) {
+        co_await write_error(out, "value is not an integer or out of range");
+        co_return;
+      }
+    } else {
+      co_await write_error(out, "syntax error");
+      co_return;
+    }
+  }
+
+  std::string after;
+  if (cursor != 0) {
+    auto it = conn.scan_cursors.find(cursor);
+    if (it == conn.scan_cursors.end()) {
+      co_await write_error(out, "invalid cursor");
+      co_return;
+    }
+    after = std::move(it->second);
+    conn.scan_cursors.erase(it);
+  }
+
+  auto stream = _db->query(std::move(prefix), std::move(after));
+  std::vector<std::string> keys;
+  while (keys.size() < count) {
+    std::vector<std::string> chunk = co_await stream->next(count - keys.size());
+    if (chunk.empty()) {
+      break;
+    }
+    std::move(chunk.begin(), chunk.end(), std::back_inserter(keys));
+  }
+
+  // a full page may be followed by more keys
+  uint64_t next = 0;
+  if (keys.size() == count) {
+    next = conn.next_cursor++;
+    conn.scan_cursors.emplace(next, keys.back());
+    if (conn.scan_cursors.size() > MAX_SCAN_CURSORS) {
+      conn.scan_cursors.erase(conn.scan_cursors.begin());
+    }
+  }
+  co_await write_header(out, '*', 2);
+  co_await write_bulk(out, std::to_string(next));
+  co_await write_header(out, '*', keys.size());
+  for (const auto &key : keys) {
+    co_await write_bulk(out, key);
+  }
+}
+
+future<> RespServer::stop()
+{
+  _stopping = true;
+  if (_listener) {
+    _listener->abort_accept();
+  }
+  for (auto &conn : _connections) {
+    conn.socket.shutdown_input();
+  }
+  co_await _gate.close();
+}
+
+}; // namespace kvdb
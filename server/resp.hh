@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "db.hh"
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/gate.hh>
+#include <seastar/core/iostream.hh>
+#include <seastar/net/api.hh>
+#include <seastar/core/metrics_registration.hh>
+
+using namespace seastar;
+
+namespace kvdb {
+
+enum class RespParse { done, incomplete, error };
+
+// parse the request at the front of data: an array of bulk strings, or an
+// inline command (words separated by spaces, up to the end of line), the
+// arguments are views into data, consumed is the request length
+RespParse parse_resp_request(std::string_view data, std::vector<std::string_view> &args, size_t &consumed);
+
+/*
+  Redis protocol (RESP) listener, running alongside the HTTP server on
+  every shard: GET, SET, DEL, MGET, MSET, SCAN (MATCH prefix* patterns
+  only), PING and QUIT, routed straight into the database. Requests of
+  a connection are pipelined: all complete requests received are run in
+  order and their replies are flushed together.
+*/
+class RespServer {
+public:
+  explicit RespServer(database *db) : _db(db) {}
+
+  future<> listen(socket_address addr);
+  future<> stop();
+
+private:
+  struct Connection {
+    connected_socket socket;
+    input_stream<char> in;
+    output_stream<char> out;
+    // start of a request received partially
+    std::string pending;
+    // SCAN cursors of the connection: last key returned by their id
+    std::map<uint64_t, std::string> scan_cursors;
+    uint64_t next_cursor{1};
+
+    explicit Connection(connected_socket s)
+      : socket(std::move(s)), in(socket.input()), out(socket.output()) {}
+  };
+
+  future<> accept_loop();
+  future<> serve(connected_socket socket);
+  future<> process(Connection &conn);
+  // run a request, the reply is written to the connection, true to close it
+  future<bool> execute(Connection &conn, const std::vector<std::string_view> &args);
+  future<> scan(Connection &conn, const std::vector<std::string_view> &args);
+
+  database *_db;
+  std::optional<server_socket> _listener;
+  std::list<Connection> _connections;
+  gate _gate;
+  bool _stopping{false};
+  uint64_t _requests{0};
+  seastar::metrics::metric_groups _metrics;
+};
+
+}; // namespace kvdb
@@ -0,0 +1,145 @@
+#include "slab_allocator.hh"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+namespace kvdb {
+
+SlabAllocator::SlabAllocator()
+{
+  size_t size = MIN_SLOT;
+  while (true) {
+    SizeClass &c = _classes.emplace_back();
+    c.slot_size = std::min(size, MAX_SLOT);
+    c.slots = (PAGE_SIZE - HEADER_SIZE) / c.slot_size;
+    if (c.slot_size == MAX_SLOT) {
+      break;
+    }
+    // 16 byte aligned slots
+    size = (size_t(size * GROWTH_FACTOR) + 15) / 16 * 16;
+  }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+  // all allocations must be freed by now, only the spare pages are left
+  release_spare();
+  assert(_stats.pages == 0);
+}
+
+unsigned SlabAllocator::class_of(size_t size) const
+{
+  const auto it = std::lower_bound(_classes.begin(), _classes.end(), size,
+      [] (const SizeClass &c, size_t size) { return c.slot_size < size; });
+  return it - _classes.begin();
+}
+
+SlabAllocator::Page *SlabAllocator::page_of(void *p)
+{
+  return reinterpret_cast<Page *>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(PAGE_SIZE - 1));
+}
+
+size_t SlabAllocator::slot_size(size_t size) const
+{
+  return size > MAX_SLOT ? size : _classes[class_of(size)].slot_size;
+}
+
+void *SlabAllocator::allocate(size_t size)
+{
+  ++_stats.allocations;
+  _stats.requested += size;
+  if (size > MAX_SLOT) {
+    _stats.used += size;
+    _stats.reserved += size;
+    return ::operator new(size);
+  }
+
+  const unsigned cls = class_of(size);
+  SizeClass &c = _classes[cls];
+  if (c.partial.empty()) {
+    void *mem = std::aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    if (!mem) {
+      throw std::bad_alloc();
+    }
+    Page *page = new (mem) Page();
+    page->cls = cls;
+    c.partial.push_back(*page);
+    ++c.pages;
+    ++_stats.pages;
+    _stats.reserved += PAGE_SIZE;
+  }
+
+  Page &page = c.partial.front();
+  void *slot;
+  if (page.free) {
+    slot = page.free;
+    page.free = *static_cast<void **>(slot);
+  } else {
+    slot = reinterpret_cast<char *>(&page) + HEADER_SIZE + page.carved * c.slot_size;
+    ++page.carved;
+  }
+  if (++page.used == c.slots) {
+    c.partial.erase(c.partial.iterator_to(page));
+  }
+  _stats.used += c.slot_size;
+  return slot;
+}
+
+void SlabAllocator::free(void *p, size_t size)
+{
+  --_stats.allocations;
+  _stats.requested -= size;
+  if (size > MAX_SLOT) {
+    _stats.used -= size;
+    _stats.reserved -= size;
+    ::operator delete(p);
+    return;
+  }
+
+  Page &page = *page_of(p);
+  SizeClass &c = _classes[page.cls];
+  assert(page.cls == class_of(size));
+  _stats.used -= c.slot_size;
+  if (page.used-- == c.slots) {
+    c.partial.push_back(page);
+  }
+  *static_cast<void **>(p) = page.free;
+  page.free = p;
+  // keep the last page of the class as a spare
+  if (page.used == 0 && c.partial.size() > 1) {
+    release(c, page);
+  }
+}
+
+bool SlabAllocator::resize(void *, size_t size, size_t new_size)
+{
+  if (slot_size(size) != slot_size(new_size)) {
+    return false;
+  }
+  _stats.requested += new_size;
+  _stats.requested -= size;
+  return true;
+}
+
+void SlabAllocator::release(SizeClass &c, Page &page)
+{
+  c.partial.erase(c.partial.iterator_to(page));
+  --c.pages;
+  --_stats.pages;
+  _stats.reserved -= PAGE_SIZE;
+  page.~Page();
+  std::free(&page);
+}
+
+void SlabAllocator::release_spare()
+{
+  for (auto &c : _classes) {
+    if (c.partial.size() == 1 && c.partial.front().used == 0) {
+      release(c, c.partial.front());
+    }
+  }
+}
+
+}; // namespace kvdb
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <boost/intrusive/list.hpp>
+
+namespace kvdb {
+
+/*
+  Size class (slab) allocator for the cache entries of a shard.
+  Memory is taken in pages of PAGE_SIZE, each page is cut into slots of
+  a single size class, classes grow by GROWTH_FACTOR from MIN_SLOT, so a
+  slot wastes at most about a fifth of its size. Free slots are kept in a
+  per page free list, a page is given back once all its slots are free
+  (one empty page per class is kept as a spare). Allocations larger than
+  MAX_SLOT go straight to the heap.
+  The caller passes the allocation size to free() as well, the size class
+  is not stored anywhere.
+*/
+class SlabAllocator {
+public:
+  static constexpr size_t PAGE_SIZE = 64 * 1024;
+  static constexpr size_t MIN_SLOT = 64;
+  static constexpr size_t MAX_SLOT = PAGE_SIZE / 4;
+  static constexpr double GROWTH_FACTOR = 1.25;
+
+  struct Stats {
+    size_t allocations{0};  // live allocations
+    size_t requested{0};    // bytes asked for by the live allocations
+    size_t used{0};         // bytes of the slots (or heap blocks) holding them
+    size_t reserved{0};     // bytes of all pages and heap blocks
+    size_t pages{0};
+  };
+
+  SlabAllocator();
+  ~SlabAllocator();
+  SlabAllocator(const SlabAllocator &) = delete;
+  SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+  void *allocate(size_t size);
+  void free(void *p, size_t size);
+  // let the allocation grow or shrink to new_size if that fits its slot,
+  // false if it must be allocated again
+  bool resize(void *p, size_t size, size_t new_size);
+  // bytes taken by an allocation of the size
+  size_t slot_size(size_t size) const;
+  // give back the spare empty pages
+  void release_spare();
+
+  const Stats &stats() const { return _stats; }
+
+private:
+  // header at the start of each page
+  struct Page {
+    boost::intrusive::list_member_hook<> hook;
+    void *free{nullptr};    // list of freed slots
+    size_t carved{0};       // slots taken from the page so far
+    size_t used{0};         // slots in use
+    unsigned cls;
+  };
+  using page_list = boost::intrusive::list<Page,
+      boost::intrusive::member_hook<Page, boost::intrusive::list_member_hook<>, &Page::hook>>;
+
+  struct SizeClass {
+    size_t slot_size;
+    size_t slots;           // slots per page
+    // pages with a free slot
+    page_list partial;
+    size_t pages{0};
+  };
+
+  static constexpr size_t HEADER_SIZE = (sizeof(Page) + 63) / 64 * 64;
+
+  unsigned class_of(size_t size) const;
+  static Page *page_of(void *p);
+  void release(SizeClass &c, Page &page);
+
+  std::vector<SizeClass> _classes;
+  Stats _stats;
+};
+
+}; // namespace kvdb
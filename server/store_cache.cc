@@ -1,80 +1,288 @@
 #include "store_cache.hh"
 #include <cassert>
+#include <cstring>
+#include <stdexcept>
 
 #include "seastar/core/coroutine.hh"
-#include <seastar/core/thread.hh>
+#include <seastar/core/metrics.hh>
 
 namespace kvdb {
 
-future<std::string> CacheShard::get(std::string key)
+static constexpr size_t MIN_BUCKETS = 16;
+// tinylfu window and protected segment shares (percent)
+static constexpr size_t WINDOW_PERCENT = 1;
+static constexpr size_t PROTECTED_PERCENT = 80;
+
+bool parse_cache_policy(std::string_view name, CachePolicy &policy)
 {
-  const auto it = _data.find(key);
-  if (it != _data.end()) {
-    co_return it->second;
+  if (name == "lru") {
+    policy = CachePolicy::lru;
+  } else if (name == "tinylfu") {
+    policy = CachePolicy::tinylfu;
+  } else {
+    return false;
   }
-  co_return std::string();
+  return true;
 }
 
-future<bool> CacheShard::set(std::string key, std::string value)
+const char *cache_policy_name(CachePolicy policy)
 {
-  const auto it = _data.find(key);
-  if (it != _data.end()) {
-    it->second = value;
-  } else {
-    // run LRU eviction policy for this shard
-    if (_lru.size() >= _max_records) {
-      std::string lru_key = _lru.front();
-      fmt::print("CacheShard: LRU evict key {}", lru_key);
-      _lru.pop_front();
-      co_await del(lru_key);
-    }
+  return policy == CachePolicy::lru ? "lru" : "tinylfu";
+}
 
-    _data[key] = value;
+CacheShard::CacheShard(size_t max_bytes, CachePolicy policy)
+ : _max_bytes(max_bytes),
+   _policy(policy),
+   _window_max(max_bytes * WINDOW_PERCENT / 100),
+   _protected_max((max_bytes - _window_max) * PROTECTED_PERCENT / 100),
+   _buckets(new entry_set::bucket_type[MIN_BUCKETS]),
+   _entries(entry_set::bucket_traits(_buckets.get(), MIN_BUCKETS)),
+   _reclaimer([this] (memory::reclaimer::request req) { return reclaim(req); })
+{
+}
 
-    // refresh LRU list (add/move key at the back)
-    for (auto it = _lru.begin(); it != _lru.end(); ++it) {
-      if (*it == key) {
-        _lru.erase(it);
-        break;
-      }
-    }
-    _lru.push_back(key);
+CacheShard::~CacheShard()
+{
+  _entries.clear();
+  for (auto &lru : _lru) {
+    lru.clear_and_dispose([this] (Entry *e) { destroy_entry(e); });
   }
-  co_return true;
 }
 
-future<bool> CacheShard::del(const std::string key)
+void CacheShard::register_metrics()
 {
-  const auto it = _data.find(key);
-  if (it != _data.end()) {
-    _data.erase(it);
+  namespace sm = seastar::metrics;
+  _metrics.add_group("cache", {
+    sm::make_counter("hits", _stats.hits, sm::description("lookups finding the key")),
+    sm::make_counter("misses", _stats.misses, sm::description("lookups not finding the key")),
+    sm::make_counter("evictions", _stats.evictions, sm::description("entries evicted by the policy or on memory pressure")),
+    sm::make_counter("rejections", _stats.rejections, sm::description("new entries not admitted by tinylfu")),
+    sm::make_gauge("entries", [this] { return _entries.size(); }, sm::description("cached keys")),
+    sm::make_gauge("memory_bytes", [this] { return memory_usage(); }, sm::description("bytes charged against the limit")),
+    sm::make_gauge("memory_limit_bytes", [this] { return _max_bytes; }, sm::description("cache memory limit of the shard")),
+  });
+}
 
-    // refresh LRU list (remove key)
-    for (auto it = _lru.begin(); it != _lru.end(); ++it) {
-      if (*it == key) {
-        _lru.erase(it);
-        break;
-      }
+size_t CacheShard::memory_usage() const
+{
+  return _segment_bytes[WINDOW] + _segment_bytes[PROBATION] + _segment_bytes[PROTECTED] +
+         bucket_bytes() + _sketch.memory_usage();
+}
+
+CacheShard::Entry *CacheShard::find(std::string_view key, size_t hash)
+{
+  // hash is already known, the sketch uses it as well
+  const auto it = _entries.find(key, [hash] (std::string_view) { return hash; }, KeyEqual());
+  return it != _entries.end() ? &*it : nullptr;
+}
+
+size_t CacheShard::entry_bytes(const Entry &e) const
+{
+  return _slab.slot_size(e.alloc_size());
+}
+
+CacheShard::Entry *CacheShard::make_entry(std::string_view key, std::string_view value)
+{
+  void *mem = _slab.allocate(sizeof(Entry) + key.size() + value.size());
+  Entry *e = new (mem) Entry();
+  e->key_size = key.size();
+  e->value_size = value.size();
+  char *data = reinterpret_cast<char *>(e + 1);
+  memcpy(data, key.data(), key.size());
+  memcpy(data + key.size(), value.data(), value.size());
+  return e;
+}
+
+void CacheShard::destroy_entry(Entry *e)
+{
+  const size_t size = e->alloc_size();
+  e->~Entry();
+  _slab.free(e, size);
+}
+
+void CacheShard::insert(Entry &e)
+{
+  if (_entries.size() >= _entries.bucket_count()) {
+    // keep the load factor at most 1
+    const size_t count = _entries.bucket_count() * 2;
+    std::unique_ptr<entry_set::bucket_type[]> buckets(new entry_set::bucket_type[count]);
+    _entries.rehash(entry_set::bucket_traits(buckets.get(), count));
+    _buckets = std::move(buckets);
+  }
+  if (_policy == CachePolicy::tinylfu && _entries.size() >= _sketch.width()) {
+    // sketch keeps about a counter per entry in each row, counts start over
+    _sketch.resize(_sketch.width() * 2);
+  }
+  e.segment = WINDOW;
+  _segment_bytes[WINDOW] += entry_bytes(e);
+  _entries.insert(e);
+  _lru[WINDOW].push_back(e);
+}
+
+void CacheShard::remove(Entry &e)
+{
+  _segment_bytes[e.segment] -= entry_bytes(e);
+  _entries.erase(_entries.iterator_to(e));
+  _lru[e.segment].erase(_lru[e.segment].iterator_to(e));
+  destroy_entry(&e);
+}
+
+void CacheShard::replace(Entry &old, Entry &e)
+{
+  lru_list &lru = _lru[old.segment];
+  e.segment = old.segment;
+  _segment_bytes[old.segment] += entry_bytes(e);
+  _segment_bytes[old.segment] -= entry_bytes(old);
+  lru.insert(lru.iterator_to(old), e);
+  lru.erase(lru.iterator_to(old));
+  _entries.erase(_entries.iterator_to(old));
+  _entries.insert(e);
+  destroy_entry(&old);
+}
+
+void CacheShard::move_to(Entry &e, Segment segment)
+{
+  const size_t bytes = entry_bytes(e);
+  _segment_bytes[e.segment] -= bytes;
+  _segment_bytes[segment] += bytes;
+  _lru[segment].splice(_lru[segment].end(), _lru[e.segment], _lru[e.segment].iterator_to(e));
+  e.segment = segment;
+}
+
+void CacheShard::touch(Entry &e)
+{
+  if (e.segment != PROBATION) {
+    move_to(e, Segment(e.segment));
+    return;
+  }
+  // second hit, protect the entry and make room for it by demoting the oldest protected ones
+  move_to(e, PROTECTED);
+  while (_segment_bytes[PROTECTED] > _protected_max && &_lru[PROTECTED].front() != &e) {
+    move_to(_lru[PROTECTED].front(), PROBATION);
+  }
+}
+
+CacheShard::Entry &CacheShard::victim()
+{
+  for (auto segment : {PROBATION, WINDOW, PROTECTED}) {
+    if (!_lru[segment].empty()) {
+      return _lru[segment].front();
     }
   }
-  co_return true;
+  abort();
 }
 
-future<std::set<std::string>> CacheShard::query(const std::string prefix)
+void CacheShard::evict()
 {
-  // TODO: avoid linear search using lower_bound, will require changing _data from unordered_map to map
-  std::set<std::string> res;
-  for (auto &[key, val] : _data) {
-    if (key.starts_with(prefix)) {
-       res.insert(key);
+  if (_policy == CachePolicy::tinylfu) {
+    while (_segment_bytes[WINDOW] > _window_max) {
+      // oldest window entry competes with the oldest main ones for its place
+      Entry &candidate = _lru[WINDOW].front();
+      move_to(candidate, PROBATION);
+      const uint8_t freq = _sketch.estimate(KeyHash()(candidate.key()));
+      while (memory_usage() > _max_bytes) {
+        Entry *v = &_lru[PROBATION].front();
+        if (v == &candidate && !_lru[PROTECTED].empty()) {
+          v = &_lru[PROTECTED].front();
+        }
+        if (v == &candidate || freq <= _sketch.estimate(KeyHash()(v->key()))) {
+          remove(candidate);
+          ++_stats.rejections;
+          break;
+        }
+        remove(*v);
+        ++_stats.evictions;
+      }
     }
   }
-  co_return res;
+  // lru policy, or value updates making the cache grow past the limit
+  while (!_entries.empty() && memory_usage() > _max_bytes) {
+    remove(victim());
+    ++_stats.evictions;
+  }
+}
+
+memory::reclaiming_result CacheShard::reclaim(memory::reclaimer::request req)
+{
+  const size_t before = memory_usage();
+  while (!_entries.empty() && before - memory_usage() < req.bytes_to_reclaim) {
+    remove(victim());
+    ++_stats.evictions;
+  }
+  _slab.release_spare();
+  return memory_usage() < before ? memory::reclaiming_result::reclaimed_something
+                                 : memory::reclaiming_result::reclaimed_nothing;
+}
+
+future<Value> CacheShard::get(std::string key)
+{
+  // never waits, plain functions save the coroutine frames
+  const size_t hash = KeyHash()(key);
+  if (_policy == CachePolicy::tinylfu) {
+    // misses count too, a key missed often is worth admitting
+    _sketch.increment(hash);
+  }
+  Entry *e = find(key, hash);
+  if (e) {
+    ++_stats.hits;
+    touch(*e);
+    // the entry may be evicted or updated meanwhile, the reply gets a copy
+    const std::string_view value = e->value();
+    return make_ready_future<Value>(Value(value.data(), value.size()));
+  }
+  ++_stats.misses;
+  return make_ready_future<Value>();
+}
+
+future<bool> CacheShard::set(std::string key, Value buf)
+{
+  const std::string_view value(buf.get(), buf.size());
+  // entries keep a 16 bit key length, longer keys are rejected by the request handlers
+  assert(key.size() <= MAX_KEY_SIZE);
+  const size_t hash = KeyHash()(key);
+  if (_policy == CachePolicy::tinylfu) {
+    _sketch.increment(hash);
+  }
+  Entry *e = find(key, hash);
+  if (e && _slab.resize(e, e->alloc_size(), sizeof(Entry) + key.size() + value.size())) {
+    // new value fits the same slot
+    _segment_bytes[e->segment] -= entry_bytes(*e);
+    e->value_size = value.size();
+    memcpy(reinterpret_cast<char *>(e + 1) + e->key_size, value.data(), value.size());
+    _segment_bytes[e->segment] += entry_bytes(*e);
+    touch(*e);
+  } else if (e) {
+    Entry *updated = make_entry(key, value);
+    replace(*e, *updated);
+    e = updated;
+    touch(*e);
+  } else {
+    e = make_entry(key, value);
+    insert(*e);
+  }
+  if (entry_bytes(*e) + bucket_bytes() + _sketch.memory_usage() > _max_bytes) {
+    // a value not fitting the whole cache is not cached at all
+    remove(*e);
+  } else {
+    // run eviction policy for this shard
+    evict();
+  }
+  return make_ready_future<bool>(true);
+}
+
+future<bool> CacheShard::del(const std::string key)
+{
+  Entry *e = find(key, KeyHash()(key));
+  if (e) {
+    remove(*e);
+  }
+  return make_ready_future<bool>(e != nullptr);
 }
 
 
-CacheStorage::CacheStorage(size_t max_records)
- : _max_records(max_records),
+CacheStorage::CacheStorage(double memory_fraction, CachePolicy policy)
+ : _memory_fraction(memory_fraction),
+   _policy(policy),
    _shards(new seastar::distributed<CacheShard>)
 {
 }
@@ -85,8 +293,11 @@ CacheStorage::~CacheStorage() {
 
 future<> CacheStorage::start()
 {
-   co_await _shards->start(_max_records);
-   co_return;
+   // each shard takes the fraction of its own memory
+   co_await _shards->start(sharded_parameter([fraction = _memory_fraction] {
+     return size_t(memory::stats().total_memory() * fraction);
+   }), _policy);
+   co_await _shards->invoke_on_all(&CacheShard::register_metrics);
 }
 
 future<> CacheStorage::stop() {
@@ -96,43 +307,52 @@ future<> CacheStorage::stop() {
    co_return;
 }
 
-future<std::string> CacheStorage::get(std::string key)
+future<Value> CacheStorage::get(std::string key)
 {
-  const auto cpu = calc_shard_id(key);
+  const auto cpu = shard_of(key);
   //fmt::print("CacheStorage::get key:{}\n", key);
-  const std::string value = co_await _shards->invoke_on(cpu, &CacheShard::get, key);
+  Value value = co_await _shards->invoke_on(cpu, &CacheShard::get, key);
   co_return value;
 }
 
-future<bool> CacheStorage::set(std::string key, std::string value)
+future<bool> CacheStorage::set(std::string key, Value value)
 {
-  const auto cpu = calc_shard_id(key);
-  const bool success = co_await _shards->invoke_on(cpu, &CacheShard::set, key, value);
+  const auto cpu = shard_of(key);
+  const bool success = co_await _shards->invoke_on(cpu, &CacheShard::set, std::move(key), std::move(value));
   co_return success;
 }
 
 future<bool> CacheStorage::del(std::string key)
 {
-  const auto cpu = calc_shard_id(key);
+  const auto cpu = shard_of(key);
   const bool success = co_await _shards->invoke_on(cpu, &CacheShard::del, key);
   co_return success;
 }
 
-static std::set<std::string> set_reducer(std::set<std::string> a, std::set<std::string> b) {
-  a.insert(b.begin(), b.end());
-  return a;
+future<Value> CacheStorage::get_local(std::string key)
+{
+  auto f = _shards->local().get(std::move(key));
+  trace_stage(current_trace(), "cache get");
+  return f;
+}
+
+future<bool> CacheStorage::set_local(std::string key, Value value)
+{
+  auto f = _shards->local().set(std::move(key), std::move(value));
+  trace_stage(current_trace(), "cache set");
+  return f;
+}
+
+future<bool> CacheStorage::del_local(std::string key)
+{
+  auto f = _shards->local().del(std::move(key));
+  trace_stage(current_trace(), "cache del");
+  return f;
 }
 
-future<std::set<std::string>> CacheStorage::query(std::string prefix)
+std::unique_ptr<IKeyStream> CacheStorage::query(std::string, std::string)
 {
-  auto res = co_await _shards->map_reduce0(
-         // Mapper: called on each shard instance
-         [prefix](CacheShard& shard) { return shard.query(prefix); }, 
-         // initial value
-         std::set<std::string>(),
-         // Reduce function
-         set_reducer);
-  co_return res;
+  throw std::logic_error("the cache doesn't index its keys, query the storage behind it");
 }
 
 }; // namespace kvdb
@@ -2,58 +2,184 @@
 
 #include <string>
 #include <set>
-#include <list>
+#include <memory>
 #include "db.hh"
+#include "frequency_sketch.hh"
+#include "slab_allocator.hh"
 
 #include <seastar/core/seastar.hh>
 #include <seastar/core/distributed.hh>
+#include <seastar/core/memory.hh>
+#include <seastar/core/metrics_registration.hh>
+#include <boost/intrusive/list.hpp>
+#include <boost/intrusive/unordered_set.hpp>
 
 using namespace seastar;
 
 namespace kvdb {
 
+namespace bi = boost::intrusive;
+
+/*
+  Cache eviction policy of the shards.
+*/
+enum class CachePolicy {
+  // least recently used entry is evicted
+  lru,
+  // W-TinyLFU: new entries enter a small LRU window, entries leaving it are
+  // admitted into the main segmented LRU only if they are used more often
+  // (count-min sketch estimate) than the entries they would evict
+  tinylfu,
+};
+
+// false for an unknown policy name
+bool parse_cache_policy(std::string_view name, CachePolicy &policy);
+const char *cache_policy_name(CachePolicy policy);
+
+struct CacheStats {
+  uint64_t hits{0};
+  uint64_t misses{0};
+  uint64_t evictions{0};      // by the policy or on memory pressure
+  uint64_t rejections{0};     // new entries not admitted (tinylfu)
+};
+
 class CacheShard {
 public:
-  CacheShard(size_t max_records) : _max_records(max_records) {}
+  // cache memory limit in bytes, keys, values and bookkeeping included
+  CacheShard(size_t max_bytes, CachePolicy policy = CachePolicy::lru);
+  ~CacheShard();
 
-  future<std::string> get(std::string key);
-  future<bool> set(std::string key, std::string value);
+  future<Value> get(std::string key);
+  future<bool> set(std::string key, Value value);
   future<bool> del(std::string key);
-  future<std::set<std::string>> query(std::string prefix);
 
   future<> stop() {
       return make_ready_future();
   }
 
+  size_t size() const { return _entries.size(); }
+  // bytes charged against the limit
+  size_t memory_usage() const;
+  size_t max_bytes() const { return _max_bytes; }
+  // entry memory as seen by the slab allocator
+  const SlabAllocator::Stats &slab_stats() const { return _slab.stats(); }
+  const CacheStats &stats() const { return _stats; }
+  // metrics of the shard, until it is destroyed
+  void register_metrics();
+
 protected:
-  std::unordered_map<std::string, std::string> _data;
-  // max records per shard is easier to implement
-  // no shared queue contention
-  size_t _max_records;
-  std::list<std::string> _lru;
+  // LRU list holding the entry, lru policy keeps all entries in the window
+  enum Segment : uint8_t { WINDOW, PROBATION, PROTECTED, SEGMENTS };
+
+  /*
+    Single node per cached key, linked both into the hash table
+    and into the LRU list of its segment. Key and value bytes follow
+    the node in the same slab slot.
+  */
+  struct Entry {
+    bi::list_member_hook<> lru_hook;
+    bi::unordered_set_member_hook<> hash_hook;
+    size_t value_size;
+    uint16_t key_size;
+    uint8_t segment{WINDOW};
+
+    std::string_view key() const { return std::string_view(reinterpret_cast<const char *>(this + 1), key_size); }
+    std::string_view value() const { return std::string_view(reinterpret_cast<const char *>(this + 1) + key_size, value_size); }
+    size_t alloc_size() const { return sizeof(Entry) + key_size + value_size; }
+  };
+
+  // keys of a shard share std::hash % smp::count, mix the high bits
+  // into the low ones used to pick the bucket
+  struct KeyHash {
+    size_t operator()(std::string_view key) const {
+      const size_t h = std::hash<std::string_view>{}(key);
+      return h ^ (h >> 32);
+    }
+    size_t operator()(const Entry &e) const { return (*this)(e.key()); }
+  };
+  struct KeyEqual {
+    bool operator()(const Entry &a, const Entry &b) const { return a.key() == b.key(); }
+    bool operator()(std::string_view key, const Entry &e) const { return key == e.key(); }
+  };
+
+  using lru_list = bi::list<Entry,
+      bi::member_hook<Entry, bi::list_member_hook<>, &Entry::lru_hook>,
+      bi::constant_time_size<true>>;
+  using entry_set = bi::unordered_set<Entry,
+      bi::member_hook<Entry, bi::unordered_set_member_hook<>, &Entry::hash_hook>,
+      bi::hash<KeyHash>, bi::equal<KeyEqual>,
+      bi::constant_time_size<true>, bi::power_2_buckets<true>>;
+
+  Entry *find(std::string_view key, size_t hash);
+  // entry in a slab slot, not linked anywhere yet
+  Entry *make_entry(std::string_view key, std::string_view value);
+  void destroy_entry(Entry *e);
+  // new entry goes to the window
+  void insert(Entry &e);
+  void remove(Entry &e);
+  // put e in place of old (same key), old is destroyed
+  void replace(Entry &old, Entry &e);
+  // make the entry the most recently used one of the segment
+  void move_to(Entry &e, Segment segment);
+  // cache hit, promote the entry
+  void touch(Entry &e);
+  // next entry to evict regardless of the admission
+  Entry &victim();
+  // move entries leaving the window to the main part and evict until the cache fits its limit
+  void evict();
+  // memory pressure, give back at least the requested bytes
+  memory::reclaiming_result reclaim(memory::reclaimer::request req);
+
+  // bytes of an entry: its slab slot
+  size_t entry_bytes(const Entry &e) const;
+  size_t bucket_bytes() const { return _entries.bucket_count() * sizeof(entry_set::bucket_type); }
+
+  // memory limit per shard, no shared accounting contention
+  size_t _max_bytes;
+  // entries memory, destroyed after all entries are gone
+  SlabAllocator _slab;
+  CachePolicy _policy;
+  // tinylfu segment limits, protected is a part of the main (probation + protected) one
+  size_t _window_max;
+  size_t _protected_max;
+  std::unique_ptr<entry_set::bucket_type[]> _buckets;
+  entry_set _entries;
+  // least recently used entry first
+  lru_list _lru[SEGMENTS];
+  size_t _segment_bytes[SEGMENTS]{};
+  // access frequency of the keys, tinylfu only
+  FrequencySketch _sketch;
+  CacheStats _stats;
+  seastar::metrics::metric_groups _metrics;
+  // registered last, the cache is complete before reclaim can run
+  memory::reclaimer _reclaimer;
 };
 
 /*
-  Implement in-memory cache with limited number of records,
-  using LRU eviction policy.
+  Implement in-memory cache limited to a fraction of each shard memory,
+  using the selected eviction policy. Shards also shrink on memory pressure.
 */
 class CacheStorage : public IStorage {
 public:
-  CacheStorage(size_t max_records);
+  CacheStorage(double memory_fraction, CachePolicy policy);
   virtual ~CacheStorage();
 
   future<> start() override;
   future<> stop() override;
 
-  future<std::string> get(std::string key) override;
-  future<bool> set(std::string key, std::string value) override;
+  future<Value> get(std::string key) override;
+  future<bool> set(std::string key, Value value) override;
   future<bool> del(std::string key) override;
-  future<std::set<std::string>> query(std::string prefix) override;
+  future<Value> get_local(std::string key) override;
+  future<bool> set_local(std::string key, Value value) override;
+  future<bool> del_local(std::string key) override;
+  // the cache holds only some of the keys and doesn't keep them ordered,
+  // a database queries its last layer (throws)
+  std::unique_ptr<IKeyStream> query(std::string prefix, std::string after) override;
 
 private:
-  unsigned int calc_shard_id(std::string &key) const { return std::hash<std::string>{}(key) % smp::count; }
-
-  size_t _max_records;
+  double _memory_fraction;
+  CachePolicy _policy;
   // data sharded to a number of cores
   seastar::distributed<CacheShard> *_shards;
 };
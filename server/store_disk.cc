@@ -5,79 +5,248 @@
 #include <seastar/core/file-types.hh>
 #include <seastar/core/aligned_buffer.hh>
 #include <seastar/core/fstream.hh>
+#include <seastar/core/with_scheduling_group.hh>
+#include <seastar/coroutine/maybe_yield.hh>
+#include <seastar/core/loop.hh>
 #include <string_view>
+#include <algorithm>
+#include <numeric>
 
 namespace kvdb {
 
-// On-disk data is stored in separate file for each CPU core shard.
-// Data consists of individual key/value records stored sequentially,
-// records are always appended to the existing file.
-// Records being deleted are kept in place, just marking their status
-// flag as deleted.
-//
-// Record layout:
-// - 1 byte record status: 2-valid, 1-deleted
-// - 2 byte key length (unsigned)
-// - 8 bytes value length (unsigned)
-// - key data bytes follow
-// - value data bytes follow
-
-constexpr size_t HEADER_SIZE = 11;  // first 3 members of the above record
-constexpr unsigned char REC_VALID = 2;
-constexpr unsigned char REC_DELETED = 1;
-
 std::string get_file_name() {
   return fmt::format("kvdb_data.{:0>3}.bin", this_shard_id());
 }
 
-future<> DiskShard::build_db_index() {
-  // read file sequentially and build the in-memory index of value offsets
-  _index.clear();
-  uint64_t pos = 0;
-  uint64_t fsize = co_await _f.size();
-  fmt::print("DiskShard {:0>3}: build index - fsize:{}\n", this_shard_id(), fsize);
-
-  while (pos < fsize) {
-     // read record header only
-     auto stream = make_file_input_stream(_f, pos, HEADER_SIZE);
-     temporary_buffer<char> data = co_await stream.read();
-     const char *record = data.get();
-     const unsigned char rec_status = *(record);
-     const uint16_t key_size = *(uint16_t *)(record + 1);
-     const uint64_t val_size = *(uint64_t *)(record + 3);
-
-     if (rec_status != REC_VALID) {
-        if (rec_status == REC_DELETED) {
-        fmt::print("DiskShard {:0>3}: build index - got deleted entry at {}\n", this_shard_id(), pos);
-        pos += HEADER_SIZE + key_size + val_size;
-        continue;
-       }
-       fmt::print("DiskShard {:0>3}: build index - got invalid entry at {}\n", this_shard_id(), pos);
+// Hint file layout:
+// - header: 8 bytes magic, 4 bytes version, 4 bytes flags, 8 bytes covered log offset
+// - entries: 4 bytes key fingerprint, 8 bytes secondary key hash, 8 bytes packed record location (see DiskIndex)
+// - keys (HINT_KEYS flag): sorted keys, front coded (see KeyIndex)
+// - footer: 8 bytes entry count, 8 bytes key count
+
+constexpr char HINT_MAGIC[8] = {'K', 'V', 'D', 'B', 'H', 'I', 'N', 'T'};
+constexpr uint32_t HINT_VERSION = 5;
+constexpr uint32_t HINT_KEYS = 1;
+constexpr size_t HINT_HEADER_SIZE = 24;
+constexpr size_t HINT_ENTRY_SIZE = sizeof(uint32_t) + 2 * sizeof(uint64_t);
+constexpr size_t HINT_FOOTER_SIZE = 2 * sizeof(uint64_t);
+
+// batch reads: records at most MAX_READ_GAP apart are read together,
+// up to MAX_READ_SPAN bytes at once
+constexpr uint64_t MAX_READ_GAP = 4096;
+constexpr uint64_t MAX_READ_SPAN = 128 * 1024;
+
+std::string get_hint_name() {
+  return fmt::format("kvdb_data.{:0>3}.hint", this_shard_id());
+}
+
+// value size if the record (or its first avail bytes) is a valid record of the key
+static std::optional<uint64_t> record_matches(const char *rec, size_t avail, std::string_view key)
+{
+  uint16_t key_size;
+  uint64_t val_size;
+  if (avail < HEADER_SIZE + key.size() || rec[0] != REC_VALID) {
+    return std::nullopt;
+  }
+  memcpy(&key_size, rec + 1, sizeof(uint16_t));
+  memcpy(&val_size, rec + 3, sizeof(uint64_t));
+  if (key_size != key.size() || memcmp(rec + HEADER_SIZE, key.data(), key_size) != 0) {
+    return std::nullopt;
+  }
+  return val_size;
+}
+
+std::optional<DiskShard::IndexMatch> DiskShard::find_key(std::string_view key, uint32_t fp) const
+{
+  const size_t slot = _index.find_key(fp, DiskIndex::secondary_hash(key));
+  if (slot == DiskIndex::npos) {
+    return std::nullopt;
+  }
+  return IndexMatch{slot, _index.entry(slot).rec_pos, _index.record_size(slot)};
+}
+
+future<> DiskShard::build_db_index(uint64_t pos) {
+  // read file sequentially from pos and apply its records to the in-memory index
+  const uint64_t fsize = co_await _f.size();
+  _end_offset = fsize;
+  LogReader reader(_f, pos, fsize);
+  uint64_t records = 0;
+  while (true) {
+     std::optional<LogRecord> rec = co_await reader.next();
+     if (!rec) {
        break;
      }
+     ++records;
 
-     // valid record, read the key name
-     auto stream1 = make_file_input_stream(_f, pos + HEADER_SIZE, (uint64_t)key_size);
-     temporary_buffer<char> name = co_await stream1.read();
-     std::string_view key(name.get(), name.size());
-     fmt::print("DiskShard {:0>3}: build index - got entry:{}, size {} at {}\n", this_shard_id(), key, val_size, pos + HEADER_SIZE + key_size);
+     // find the previous record of the key
+     const uint32_t fp = DiskIndex::fingerprint(rec->key);
+     const uint64_t hash2 = DiskIndex::secondary_hash(rec->key);
+     const size_t slot = _index.find_key(fp, hash2);
 
-     _index[std::string(key)] = std::make_pair<>(pos + HEADER_SIZE + key_size, val_size);
-     pos += HEADER_SIZE + key_size + val_size;
+     // last record of the key wins
+     if (slot != DiskIndex::npos) {
+       _live_bytes -= _index.record_size(slot);
+     }
+     if (rec->status == REC_TOMBSTONE) {
+       if (slot != DiskIndex::npos) {
+         _index.erase(slot);
+         if (_opts.ordered_index) {
+           _keys.erase(rec->key);
+         }
+       }
+     } else {
+       if (slot != DiskIndex::npos) {
+         _index.update(slot, rec->pos, rec->size());
+       } else {
+         _index.insert(fp, rec->pos, rec->size(), hash2);
+       }
+       // a hint may have the entry of a key but not the key itself (overwritten between
+       // the entries and the keys pass), inserting a key already there changes nothing
+       if (_opts.ordered_index) {
+         _keys.insert(rec->key);
+       }
+       _live_bytes += rec->size();
+     }
+     co_await coroutine::maybe_yield();
+  }
+  co_await reader.close();
+  _end_offset = reader.offset();
+  _recovery_stats.replayed_records = records;
+  fmt::print("DiskShard {:0>3}: build index - fsize:{}, replayed {} records from {}\n", this_shard_id(), fsize, records, pos);
+
+  if (_end_offset == 0 && fsize > 0) {
+    temporary_buffer<char> first = co_await _f.dma_read<char>(0, 1);
+    if (!first.empty() && is_legacy_record(first[0])) {
+      // records without checksums, truncating would throw all of them away
+      throw std::runtime_error(fmt::format("{} was written by an older version (no record checksums)", get_file_name()));
+    }
+  }
+  if (fsize > _end_offset) {
+    // torn or corrupted record of an interrupted write, or just the DMA block padding
+    fmt::print("DiskShard {:0>3}: build index - truncate {} bytes past the last complete record\n", this_shard_id(), fsize - _end_offset);
+    co_await _f.truncate(_end_offset);
   }
-  _end_offset = pos;
 }
 
-future<> DiskShard::start() {
+bool parse_durability(std::string_view name, Durability &durability)
+{
+  if (name == "strict") {
+    durability = Durability::strict;
+  } else if (name == "periodic") {
+    durability = Durability::periodic;
+  } else if (name == "none") {
+    durability = Durability::none;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *durability_name(Durability durability)
+{
+  switch (durability) {
+  case Durability::strict:
+    return "strict";
+  case Durability::periodic:
+    return "periodic";
+  case Durability::none:
+    break;
+  }
+  return "none";
+}
+
+future<> DiskShard::start(scheduling_group compaction_sg) {
     //fmt::print("DiskShard {:0>3}: start\n", this_shard_id());
     std::string name = get_file_name();
+    // leftover of an interrupted compaction, the data file itself is intact
+    if (co_await file_exists(name + ".compact")) {
+      co_await remove_file(name + ".compact");
+    }
     //fmt::print("DiskShard {:0>3}: open file - {}\n", this_shard_id(), name);
-    _f = co_await open_file_dma(name, open_flags::rw|open_flags::create|open_flags::dsync);
-    co_await build_db_index();
+    // no dsync here, the flushes depend on the durability mode (strict: one per commit batch)
+    _f = co_await open_file_dma(name, open_flags::rw|open_flags::create);
+    const auto started = std::chrono::steady_clock::now();
+    const bool hinted = co_await load_hint();
+    _recovery_stats.hint_loaded = hinted;
+    co_await build_db_index(hinted ? _end_offset : 0);
+    fmt::print("DiskShard {:0>3}: index ready - {} keys in {} ms{}\n", this_shard_id(), _index.size(),
+               std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count(),
+               hinted ? " (hint file)" : "");
+    co_await load_tail_block();
+    _tail_offset = _end_offset;
+    _commit_done = commit_loop();
+    if (_opts.durability == Durability::periodic) {
+      _sync_done = sync_loop();
+    }
+    _compaction_done = with_scheduling_group(compaction_sg, [this] { return maintenance_loop(); });
+    register_metrics();
     co_return;
 }
 
+void DiskShard::register_metrics()
+{
+  namespace sm = seastar::metrics;
+  _metrics.add_group("disk", {
+    sm::make_counter("reads", _io_stats.reads, sm::description("DMA reads of records")),
+    sm::make_counter("read_bytes", _io_stats.read_bytes, sm::description("bytes requested by the DMA reads of records")),
+    sm::make_counter("writes", _io_stats.writes, sm::description("DMA writes of commit batches")),
+    sm::make_counter("write_bytes", _io_stats.write_bytes, sm::description("bytes written by the commit batches, DMA block padding included")),
+    sm::make_counter("flushes", _io_stats.flushes, sm::description("data file flushes")),
+    sm::make_histogram("flush_latency", sm::description("data file flush latency in seconds"), [this] { return _io_stats.flush_latency.to_metrics(); }),
+    sm::make_gauge("unsynced_bytes", [this] { return _unsynced_bytes; }, sm::description("bytes written and acknowledged but not flushed yet (periodic and none durability)")),
+    sm::make_counter("commit_batches", _commit_stats.batches, sm::description("commit batches written")),
+    sm::make_counter("commit_ops", _commit_stats.ops, sm::description("set and delete records committed")),
+    sm::make_gauge("index_keys", [this] { return _index.size(); }, sm::description("keys in the index")),
+    sm::make_gauge("index_memory_bytes", [this] { return _index.memory_usage() + _keys.memory_usage(); },
+                   sm::description("memory of the index and the ordered keys")),
+    sm::make_gauge("file_bytes", [this] { return _tail_offset; }, sm::description("data file size, batches not written yet included")),
+    sm::make_gauge("dead_ratio", [this] { return _tail_offset ? double(dead_bytes()) / _tail_offset : 0.0; },
+                   sm::description("fraction of the data file taken by deleted and overwritten records")),
+    sm::make_counter("compactions", _compaction_stats.runs, sm::description("compactions completed")),
+    sm::make_counter("compaction_reclaimed_bytes", _compaction_stats.reclaimed_bytes, sm::description("bytes reclaimed by the compactions")),
+  });
+}
+
+future<temporary_buffer<char>> DiskShard::read(file &f, uint64_t pos, size_t size)
+{
+  ++_io_stats.reads;
+  _io_stats.read_bytes += size;
+  return f.dma_read<char>(pos, size);
+}
+
 future<> DiskShard::stop() {
+    // let the commit loop write out all pending batches
+    _stopping = true;
+    _commit_cv.broadcast();
+    _compaction_cv.broadcast();
+    _sync_cv.broadcast();
+    co_await std::move(_compaction_done);
+    co_await std::move(_commit_done);
+    co_await std::move(_sync_done);
+    if (!_io_error) {
+      try {
+        // whatever the durability, a clean stop leaves all the writes on the disk
+        co_await sync_data();
+      } catch (std::exception &e) {
+        fmt::print("DiskShard {:0>3}: final data flush failed - {}\n", this_shard_id(), e.what());
+        _io_error = std::current_exception();
+      }
+    }
+    co_await _readers->close();
+    if (!_io_error) {
+      try {
+        co_await write_hint();
+      } catch (std::exception &e) {
+        fmt::print("DiskShard {:0>3}: hint file write failed - {}\n", this_shard_id(), e.what());
+      }
+    }
+    fmt::print("DiskShard {:0>3}: compaction - {} runs, reclaimed {} bytes in {} ms\n",
+               this_shard_id(), _compaction_stats.runs, _compaction_stats.reclaimed_bytes,
+               _compaction_stats.time.count());
+    fmt::print("DiskShard {:0>3}: group commit - {} batches, {} ops, avg {:.1f} ops ({:.0f} bytes) per batch\n",
+               this_shard_id(), _commit_stats.batches, _commit_stats.ops,
+               _commit_stats.avg_batch_ops(), _commit_stats.avg_batch_bytes());
+
     fmt::print("DiskShard {:0>3}: close file\n", this_shard_id());
     // as we use DMA to write entire blocks, we need to truncate 
     // excess data on end
@@ -90,114 +259,951 @@ future<> DiskShard::stop() {
     co_return;
 }
 
-future<std::string> DiskShard::get(std::string key)
+future<> DiskShard::load_tail_block() {
+    const uint64_t alignment = _f.disk_write_dma_alignment();
+    _tail_buf = seastar::allocate_aligned_buffer<char>(alignment, alignment);
+    memset(_tail_buf.get(), 0, alignment);
+
+    const uint64_t tail_start = align_down<uint64_t>(_end_offset, alignment);
+    if (tail_start < _end_offset) {
+      co_await _f.dma_read(tail_start, _tail_buf.get(), alignment);
+      // drop whatever follows the last valid record
+      memset(_tail_buf.get() + (_end_offset - tail_start), 0, alignment - (_end_offset - tail_start));
+    }
+}
+
+future<Value> DiskShard::get(std::string key)
 {
-  const auto it = _index.find(key);
-  if (it != _index.end()) {
-    // key found in index, now read actual data in file
-    auto stream = make_file_input_stream(_f, it->second.first, it->second.second);
-    temporary_buffer<char> value = co_await stream.read();
-    co_return std::string(value.get(), value.size());
+  RequestTrace *trace = current_trace();
+  const uint32_t fp = DiskIndex::fingerprint(key);
+  const uint64_t hash2 = DiskIndex::secondary_hash(key);
+  while (true) {
+    std::vector<DiskIndex::Entry> candidates;
+    _index.for_each_candidate(fp, [this, &candidates, hash2] (size_t slot, DiskIndex::Entry e) {
+      if (_index.hash2(slot) == hash2) {
+        candidates.push_back(e);
+      }
+    });
+
+    bool retry = false;
+    for (const auto &entry : candidates) {
+      // large records are read in two steps, header with the key first
+      const bool large = entry.rec_size == DiskIndex::LARGE_RECORD;
+      const uint64_t read_size = large ? HEADER_SIZE + key.size() : entry.rec_size;
+      if (entry.rec_pos + read_size > _end_offset) {
+        // record is still waiting for its batch to be written, look it up
+        // again afterwards (it might have been changed or relocated)
+        co_await wait_durable(entry.rec_pos);
+        retry = true;
+        break;
+      }
+
+      // read the record, the hashes match, the key is checked anyway
+      // (the file is kept open even if compaction replaces it meanwhile)
+      file f = _f;
+      auto readers = _readers;
+      auto holder = readers->hold();
+      temporary_buffer<char> rec = co_await read(f, entry.rec_pos, read_size);
+      trace_stage(trace, "disk read");
+      const std::optional<uint64_t> val_size = record_matches(rec.get(), rec.size(), key);
+      if (!val_size) {
+        continue;
+      }
+      if (large) {
+        temporary_buffer<char> value = co_await read(f, entry.rec_pos + HEADER_SIZE + key.size(), *val_size);
+        trace_stage(trace, "disk read");
+        co_return value;
+      }
+      // the value is the tail of the read buffer
+      const size_t avail = rec.size() - HEADER_SIZE - key.size();
+      rec.trim_front(HEADER_SIZE + key.size());
+      rec.trim(std::min<uint64_t>(*val_size, avail));
+      co_return rec;
+    }
+    if (!retry) {
+      co_return Value();
+    }
   }
-  co_return std::string();
 }
 
-future<bool> DiskShard::set(std::string key, std::string value)
+future<bool> DiskShard::set(std::string key, Value value)
 {
   //fmt::print("DiskShard {:0>3}: set [{},{}]\n", this_shard_id(), key, value);
-  const auto it = _index.find(key);
-  if (it != _index.end()) {
-    //fmt::print("DiskShard {:0>3}: set [{},{}] call del\n", this_shard_id(), key, value);
-    co_await del(key);  // mark old record as deleted
+  RequestTrace *trace = current_trace();
+  const uint32_t fp = DiskIndex::fingerprint(key);
+  Batch &batch = append_set(key, fp, std::string_view(value.get(), value.size()), find_key(key, fp));
+  batch.add_trace(trace);
+  future<> committed = batch.committed.get_shared_future();
+  trace_stage(trace, "appended");
+
+  co_await std::move(committed);
+  trace_stage(trace, "committed");
+  //fmt::print("DiskShard {:0>3}: set done [{},{}]\n", this_shard_id(), key, value);
+  co_return true;
+}
+
+future<bool> DiskShard::del(const std::string key)
+{
+  //fmt::print("DiskShard {:0>3}: del [{}]\n", this_shard_id(), key);
+  RequestTrace *trace = current_trace();
+  std::optional<future<>> committed;
+  if (Batch *batch = append_del(key, find_key(key, DiskIndex::fingerprint(key)))) {
+    batch->add_trace(trace);
+    committed = batch->committed.get_shared_future();
+  }
+  trace_stage(trace, "appended");
+
+  if (!committed) {
+    co_return false;
+  }
+  co_await std::move(*committed);
+  trace_stage(trace, "committed");
+  co_return true;
+}
+
+DiskShard::Batch &DiskShard::append_set(std::string_view key, uint32_t fp, std::string_view value, const std::optional<IndexMatch> &old)
+{
+  // append new record, it supersedes the old one (if any), index is updated
+  // right away so that following operations on this key see it
+  // (readers wait for the batch commit)
+  const uint64_t rec_size = HEADER_SIZE + key.size() + value.size();
+  Batch &batch = open_batch(rec_size);
+  const uint64_t pos = append_record(batch, REC_VALID, key, value);
+  if (old) {
+    _live_bytes -= old->rec_size;
+    _index.update(old->slot, pos, rec_size);
+  } else {
+    _index.insert(fp, pos, rec_size, DiskIndex::secondary_hash(key));
+    if (_opts.ordered_index) {
+      _keys.insert(key);
+    }
+  }
+  _live_bytes += rec_size;
+  return batch;
+}
+
+DiskShard::Batch *DiskShard::append_del(std::string_view key, const std::optional<IndexMatch> &old)
+{
+  if (!old) {
+    return nullptr;
+  }
+  // append tombstone record
+  Batch &batch = open_batch(HEADER_SIZE + key.size());
+  append_record(batch, REC_TOMBSTONE, key, std::string_view());
+
+  // update index
+  _live_bytes -= old->rec_size;
+  _index.erase(old->slot);
+  if (_opts.ordered_index) {
+    _keys.erase(key);
+  }
+  return &batch;
+}
+
+future<> DiskShard::mset(std::vector<KeyValue> items)
+{
+  // all records go to the open batch (the next ones once it is full),
+  // wait for each batch used once
+  RequestTrace *trace = current_trace();
+  std::vector<future<>> committed;
+  uint64_t last_batch = UINT64_MAX;
+  for (const auto &[key, value] : items) {
+    const uint32_t fp = DiskIndex::fingerprint(key);
+    Batch &batch = append_set(key, fp, std::string_view(value.get(), value.size()), find_key(key, fp));
+    if (batch.offset != last_batch) {
+      last_batch = batch.offset;
+      batch.add_trace(trace);
+      committed.push_back(batch.committed.get_shared_future());
+    }
+  }
+  trace_stage(trace, "appended");
+  for (auto &f : committed) {
+    co_await std::move(f);
+  }
+  trace_stage(trace, "committed");
+}
+
+future<> DiskShard::mdel(std::vector<std::string> keys)
+{
+  RequestTrace *trace = current_trace();
+  std::vector<future<>> committed;
+  uint64_t last_batch = UINT64_MAX;
+  for (const auto &key : keys) {
+    Batch *batch = append_del(key, find_key(key, DiskIndex::fingerprint(key)));
+    if (batch && batch->offset != last_batch) {
+      last_batch = batch->offset;
+      batch->add_trace(trace);
+      committed.push_back(batch->committed.get_shared_future());
+    }
+  }
+  trace_stage(trace, "appended");
+  for (auto &f : committed) {
+    co_await std::move(f);
+  }
+  trace_stage(trace, "committed");
+}
+
+future<std::vector<Value>> DiskShard::mget(std::vector<std::string> keys)
+{
+  // candidate record of a key to read
+  struct RecordRead {
+    size_t key;
+    uint64_t pos;
+    uint64_t size;      // bytes to read, only the header and the key of large records
+    bool large;
+  };
+  // adjacent records read at once
+  struct Span {
+    uint64_t pos;
+    uint64_t size;
+    temporary_buffer<char> data;
+  };
+  // value of a large record, read on its own
+  struct LargeValue {
+    size_t key;
+    uint64_t pos;
+    uint64_t size;
+  };
+
+  std::vector<Value> values(keys.size());
+  std::vector<size_t> pending(keys.size());
+  std::iota(pending.begin(), pending.end(), 0);
+  while (!pending.empty()) {
+    std::vector<RecordRead> reads;
+    std::vector<size_t> waiting;
+    uint64_t wait_pos = 0;
+    for (size_t k : pending) {
+      const std::string &key = keys[k];
+      std::vector<RecordRead> candidates;
+      bool committed = true;
+      const uint64_t hash2 = DiskIndex::secondary_hash(key);
+      _index.for_each_candidate(DiskIndex::fingerprint(key), [&] (size_t slot, DiskIndex::Entry e) {
+        if (_index.hash2(slot) != hash2) {
+          return;
+        }
+        const bool large = e.rec_size == DiskIndex::LARGE_RECORD;
+        const uint64_t read_size = large ? HEADER_SIZE + key.size() : e.rec_size;
+        if (e.rec_pos + read_size > _end_offset) {
+          // still waiting for its batch to be written, looked up again afterwards
+          committed = false;
+          wait_pos = std::max(wait_pos, e.rec_pos);
+        }
+        candidates.push_back(RecordRead{k, e.rec_pos, read_size, large});
+      });
+      if (committed) {
+        reads.insert(reads.end(), candidates.begin(), candidates.end());
+      } else {
+        waiting.push_back(k);
+      }
+    }
+
+    // records close to each other are read by a single DMA read
+    std::sort(reads.begin(), reads.end(), [] (const RecordRead &a, const RecordRead &b) { return a.pos < b.pos; });
+    std::vector<Span> spans;
+    std::vector<size_t> span_of(reads.size());
+    for (size_t i = 0; i < reads.size(); ++i) {
+      const RecordRead &r = reads[i];
+      if (!spans.empty()) {
+        Span &last = spans.back();
+        const uint64_t end = std::max(last.pos + last.size, r.pos + r.size);
+        if (r.pos <= last.pos + last.size + MAX_READ_GAP && end - last.pos <= MAX_READ_SPAN) {
+          last.size = end - last.pos;
+          span_of[i] = spans.size() - 1;
+          continue;
+        }
+      }
+      spans.push_back(Span{r.pos, r.size, {}});
+      span_of[i] = spans.size() - 1;
+    }
+
+    // the file is kept open even if compaction replaces it meanwhile
+    // (not while waiting for a commit below, compaction may be holding it back)
+    file f = _f;
+    auto readers = _readers;
+    std::optional<gate::holder> holder = readers->hold();
+    auto spans_read = parallel_for_each(spans, [this, &f] (Span &span) {
+      return read(f, span.pos, span.size).then([&span] (temporary_buffer<char> data) {
+        span.data = std::move(data);
+      });
+    });
+    co_await std::move(spans_read);
+
+    // the hashes match, the key is checked anyway
+    std::vector<LargeValue> large_values;
+    std::vector<bool> found(keys.size());
+    for (size_t i = 0; i < reads.size(); ++i) {
+      const RecordRead &r = reads[i];
+      const Span &span = spans[span_of[i]];
+      if (found[r.key] || r.pos - span.pos >= span.data.size()) {
+        continue;
+      }
+      const char *rec = span.data.get() + (r.pos - span.pos);
+      const size_t avail = std::min<uint64_t>(r.size, span.data.size() - (r.pos - span.pos));
+      const std::string &key = keys[r.key];
+      const std::optional<uint64_t> val_size = record_matches(rec, avail, key);
+      if (!val_size) {
+        continue;
+      }
+      found[r.key] = true;
+      if (r.large) {
+        large_values.push_back(LargeValue{r.key, r.pos + HEADER_SIZE + key.size(), *val_size});
+      } else {
+        // copied out, a span shared by the values could not cross shards
+        const size_t val_avail = avail - HEADER_SIZE - key.size();
+        values[r.key] = Value(rec + HEADER_SIZE + key.size(), std::min<uint64_t>(*val_size, val_avail));
+      }
+    }
+    auto large_read = parallel_for_each(large_values, [this, &f, &values] (const LargeValue &large) {
+      return read(f, large.pos, large.size).then([&values, &large] (temporary_buffer<char> data) {
+        values[large.key] = std::move(data);
+      });
+    });
+    co_await std::move(large_read);
+    holder.reset();
+
+    if (!waiting.empty()) {
+      // batches are committed in order, the last one covers the others
+      co_await wait_durable(wait_pos);
+    }
+    pending = std::move(waiting);
+  }
+  co_return values;
+}
+
+DiskShard::Batch &DiskShard::open_batch(size_t rec_size)
+{
+  if (_io_error) {
+    std::rethrow_exception(_io_error);
+  }
+  if (_tail_offset + rec_size > DiskIndex::MAX_OFFSET) {
+    throw std::runtime_error("data file size limit reached");
+  }
+  if (_batches.empty() || _batches.back().sealed ||
+      (_batches.back().ops > 0 && _batches.back().data.size() + rec_size > _opts.max_batch_bytes)) {
+    Batch &batch = _batches.emplace_back();
+    batch.offset = _tail_offset;
+  }
+  Batch &batch = _batches.back();
+  ++batch.ops;
+  _commit_cv.signal();
+  return batch;
+}
+
+uint64_t DiskShard::append_record(Batch &batch, unsigned char status, std::string_view key, std::string_view value)
+{
+  const uint64_t pos = _tail_offset;
+  const uint64_t rec_size = HEADER_SIZE + key.size() + value.size();
+  assert(pos == batch.offset + batch.data.size());
+  // the record header keeps a 16 bit key length
+  assert(key.size() <= MAX_KEY_SIZE);
+
+  const size_t offset = batch.data.size();
+  batch.data.resize(offset + rec_size);
+  encode_record(batch.data.data() + offset, status, key, value);
+
+  _tail_offset += rec_size;
+  return pos;
+}
+
+future<> DiskShard::wait_durable(uint64_t pos)
+{
+  for (auto &batch : _batches) {
+    if (pos >= batch.offset && pos < batch.offset + batch.data.size()) {
+      co_await batch.committed.get_shared_future();
+      co_return;
+    }
+  }
+  // batch is gone, but the record never made it to the disk
+  if (_io_error) {
+    std::rethrow_exception(_io_error);
   }
+}
+
+future<> DiskShard::commit_loop()
+{
+  while (true) {
+    co_await _commit_cv.wait([this] { return _stopping || !_batches.empty(); });
+    if (_batches.empty()) {
+      break;  // stopping and nothing left to write
+    }
 
-  // append new record
-  //fmt::print("DiskShard {:0>3}: set [{},{}] get file size\n", this_shard_id(), key, value);
-  uint64_t pos = _end_offset;
-  const uint16_t key_size = key.size();
-  const uint64_t val_size = value.size();
+    Batch &batch = _batches.front();
+    if (_opts.max_batch_delay.count() > 0 && !_stopping) {
+      // give concurrent writers a chance to join this batch
+      try {
+        co_await _commit_cv.wait(_opts.max_batch_delay, [this, &batch] {
+          return _stopping || _batches.size() > 1 || batch.data.size() >= _opts.max_batch_bytes;
+        });
+      } catch (condition_variable_timed_out &) {
+      }
+    }
+    batch.sealed = true;
+
+    if (!_io_error) {
+      try {
+        auto units = co_await get_units(_write_sem, 1);
+        co_await write_batch(batch);
+      } catch (...) {
+        _io_error = std::current_exception();
+        fmt::print("DiskShard {:0>3}: batch write at {} failed, refusing further writes\n", this_shard_id(), batch.offset);
+      }
+    }
 
-  //fmt::print("DiskShard {:0>3}: set [{},{}] prepare header\n", this_shard_id(), key, value);
-  const auto alignment = _f.disk_write_dma_alignment();
-  uint64_t aligned_pos = align_down<uint64_t>(pos, alignment);
-  const auto rec_size = HEADER_SIZE + key_size + val_size;
-  uint64_t aligned_size = align_up<uint64_t>(rec_size, alignment);
-  //fmt::print("DiskShard {:0>3}: set [{},{}] write alignment {}, record size {}\n", this_shard_id(), key, value, alignment, rec_size);
+    if (_io_error) {
+      batch.committed.set_exception(_io_error);
+    } else {
+      _commit_stats.batches++;
+      _commit_stats.ops += batch.ops;
+      _commit_stats.bytes += batch.data.size();
+      batch.committed.set_value();
+    }
+    _batches.pop_front();
+    _compaction_cv.signal();
+  }
+}
 
+future<> DiskShard::write_batch(Batch &batch)
+{
+  if (batch.data.empty()) {
+    co_return;
+  }
+  const uint64_t alignment = _f.disk_write_dma_alignment();
+  const uint64_t start = align_down<uint64_t>(batch.offset, alignment);
+  const uint64_t end = batch.offset + batch.data.size();
+  const uint64_t aligned_size = align_up<uint64_t>(end, alignment) - start;
   std::unique_ptr<char[], seastar::free_deleter> buf =
      seastar::allocate_aligned_buffer<char>(aligned_size, alignment);
 
-  // read, modify, write cycle
-  co_await _f.dma_read(aligned_pos, buf.get(), alignment);
+  // partially filled last block is taken from memory, no read needed
+  memcpy(buf.get(), _tail_buf.get(), batch.offset - start);
+  memcpy(buf.get() + (batch.offset - start), batch.data.data(), batch.data.size());
+  memset(buf.get() + (end - start), 0, start + aligned_size - end);
+  co_await write_fully(_f, start, buf.get(), aligned_size);
+  batch.trace_stage("dma write");
+  ++_io_stats.writes;
+  _io_stats.write_bytes += aligned_size;
 
-  uint64_t offset = pos - aligned_pos;
-  memset(buf.get() + offset, REC_VALID, 1);  // 1st byte - valid record
-  memcpy(buf.get() + offset + 1, &key_size, sizeof(uint16_t));
-  memcpy(buf.get() + offset + 3, &val_size, sizeof(uint64_t));
-  memcpy(buf.get() + offset + 3 + sizeof(uint64_t), key.c_str(), key_size);
-  memcpy(buf.get() + offset + 3 + sizeof(uint64_t) + key_size, value.c_str(), val_size);
+  // keep the new last block in memory for the next append
+  const uint64_t tail_start = align_down<uint64_t>(end, alignment);
+  if (tail_start < end) {
+    memcpy(_tail_buf.get(), buf.get() + (tail_start - start), alignment);
+  } else {
+    memset(_tail_buf.get(), 0, alignment);
+  }
 
-  //fmt::print("DiskShard {:0>3}: set [{},{}] write data (pos={}, len={})\n", this_shard_id(), key, value, pos, rec_size);
-  // TODO: error handling, finish partial writes using the loop
-  co_await _f.dma_write(aligned_pos, buf.get(), aligned_size);
-  //fmt::print("DiskShard {:0>3}: set [{},{}] flush\n", this_shard_id(), key, value);
-  co_await _f.flush();
+  if (_opts.durability == Durability::strict) {
+    // single durability barrier for the whole batch
+    const auto flush_start = std::chrono::steady_clock::now();
+    co_await _f.flush();
+    ++_io_stats.flushes;
+    _io_stats.flush_latency.add(std::chrono::steady_clock::now() - flush_start);
+    batch.trace_stage("flush");
+  } else {
+    // acknowledged once written, flushed later
+    _unsynced_bytes += aligned_size;
+    if (_opts.durability == Durability::periodic && _unsynced_bytes >= _opts.sync_bytes) {
+      _sync_cv.signal();
+    }
+  }
+  _end_offset = end;
+}
 
-  // update index
-  _index[key] = std::make_pair<>(pos + HEADER_SIZE + key_size, val_size);
-  _end_offset = pos + rec_size;
+future<> DiskShard::sync_data()
+{
+  const uint64_t unsynced = _unsynced_bytes;
+  if (unsynced == 0) {
+    co_return;
+  }
+  // the file is kept open even if compaction replaces it meanwhile
+  // (the new one is flushed by the compaction itself)
+  file f = _f;
+  auto readers = _readers;
+  auto holder = readers->hold();
+  const auto flush_start = std::chrono::steady_clock::now();
+  co_await f.flush();
+  ++_io_stats.flushes;
+  _io_stats.flush_latency.add(std::chrono::steady_clock::now() - flush_start);
+  // writes completed during the flush are left for the next one
+  _unsynced_bytes -= std::min(_unsynced_bytes, unsynced);
+}
 
-  //fmt::print("DiskShard {:0>3}: set done [{},{}]\n", this_shard_id(), key, value);
-  co_return true;
+future<> DiskShard::sync_loop()
+{
+  while (true) {
+    try {
+      co_await _sync_cv.wait(_opts.sync_interval, [this] {
+        return _stopping || _unsynced_bytes >= _opts.sync_bytes;
+      });
+    } catch (condition_variable_timed_out &) {
+    }
+    if (_stopping || _io_error) {
+      break;
+    }
+    try {
+      co_await sync_data();
+    } catch (...) {
+      _io_error = std::current_exception();
+      fmt::print("DiskShard {:0>3}: data file flush failed, refusing further writes\n", this_shard_id());
+    }
+  }
 }
 
-future<bool> DiskShard::del(const std::string key)
+bool DiskShard::needs_compaction() const
 {
-  //fmt::print("DiskShard {:0>3}: del [{}]\n", this_shard_id(), key);
+  return !_io_error &&
+         _tail_offset >= _opts.compaction_min_bytes &&
+         _tail_offset >= _compaction_retry_offset &&
+         dead_bytes() > _opts.compaction_threshold * _tail_offset;
+}
 
-  const auto it = _index.find(key);
-  if (it != _index.end()) {
-    uint64_t val_pos = it->second.first;
-    uint64_t pos = val_pos - HEADER_SIZE - key.size();
-    const auto alignment = _f.disk_write_dma_alignment();
-    uint64_t aligned_pos = align_down(pos, alignment);
+future<> DiskShard::maintenance_loop()
+{
+  auto hint_time = std::chrono::steady_clock::now();
+  while (true) {
+    try {
+      if (_opts.hint_interval.count() > 0) {
+        co_await _compaction_cv.wait(_opts.hint_interval, [this] { return _stopping || needs_compaction(); });
+      } else {
+        co_await _compaction_cv.wait([this] { return _stopping || needs_compaction(); });
+      }
+    } catch (condition_variable_timed_out &) {
+    }
+    if (_stopping) {
+      break;
+    }
 
-    // write tombstone mark
-    std::unique_ptr<char[], seastar::free_deleter> buf =
-        seastar::allocate_aligned_buffer<char>(alignment, alignment);
+    if (needs_compaction()) {
+      try {
+        co_await compact();
+        // the old hint file is gone, write the new one right away
+        hint_time = {};
+      } catch (std::exception &e) {
+        fmt::print("DiskShard {:0>3}: compaction failed - {}\n", this_shard_id(), e.what());
+        _compaction_retry_offset = _tail_offset + _opts.compaction_min_bytes;
+      }
+    }
 
-    // read, modify, write cycle
-    co_await _f.dma_read(aligned_pos, buf.get(), alignment);
+    if (_opts.hint_interval.count() > 0 && _hint_offset != _end_offset &&
+        std::chrono::steady_clock::now() - hint_time >= _opts.hint_interval) {
+      try {
+        co_await write_hint();
+      } catch (std::exception &e) {
+        fmt::print("DiskShard {:0>3}: hint file write failed - {}\n", this_shard_id(), e.what());
+      }
+      hint_time = std::chrono::steady_clock::now();
+    }
+  }
+}
 
-    uint64_t offset = pos - aligned_pos;
-    memset(buf.get() + offset, REC_DELETED, 1);  // 1st byte - invalid record
+future<> DiskShard::compact()
+{
+  const auto started = std::chrono::steady_clock::now();
+  const uint64_t end = _end_offset;
 
-    //fmt::print("DiskShard {:0>3}: del [{}] write data (pos={})\n", this_shard_id(), key, pos);
-    co_await _f.dma_write(aligned_pos, buf.get(), alignment);
-    co_await _f.flush();
+  const std::string name = get_file_name();
+  const std::string tmp_name = name + ".compact";
+  file out = co_await open_file_dma(tmp_name, open_flags::rw|open_flags::create|open_flags::truncate);
+  LogWriter writer(out, 1024 * 1024);
+  // copied live records, sorted by their old position
+  std::vector<Relocation> live;
+  bool switched = false;
+  std::exception_ptr ex;
+  try {
+    // copy records the index still points to, records overwritten while
+    // being copied are just dead data in the new file
+    file src = _f;
+    LogReader reader(src, 0, end);
+    while (!_stopping) {
+      std::optional<LogRecord> rec = co_await reader.next();
+      if (!rec) {
+        break;
+      }
+      if (rec->status == REC_VALID) {
+        if (_index.find(DiskIndex::fingerprint(rec->key), rec->pos) != DiskIndex::npos) {
+          live.push_back({rec->pos, rec->size(), writer.offset()});
+          co_await reader.copy_record(writer);
+        }
+      }
+      co_await coroutine::maybe_yield();
+    }
+    co_await reader.close();
+    if (!_stopping && reader.offset() != end) {
+      throw std::runtime_error(fmt::format("invalid record at {}", reader.offset()));
+    }
+    // records appended after end follow them, shifted by delta
+    const uint64_t delta = end - writer.offset();
+
+    // catch up with the appends done meanwhile, then once more with writes paused
+    uint64_t copied = end;
+    if (!_stopping) {
+      const uint64_t copy_end = _end_offset;
+      co_await copy_range(src, copied, copy_end, writer);
+      copied = copy_end;
+    }
+    if (!_stopping) {
+      auto units = co_await get_units(_write_sem, 1);
+      co_await copy_range(src, copied, _end_offset, writer);
+      co_await writer.finish();
 
-    // update index
-    _index.erase(it);
+      // hint offsets refer to the old file, it must not outlive it
+      if (co_await file_exists(get_hint_name())) {
+        co_await remove_file(get_hint_name());
+        co_await sync_directory(".");
+      }
+      _hint_offset = 0;
+      co_await rename_file(tmp_name, name);
+      const uint64_t old_size = _end_offset;
+      relocate(live, end, delta);
+      file old_f = std::exchange(_f, out);
+      auto old_readers = std::exchange(_readers, make_lw_shared<gate>());
+      switched = true;
+      co_await load_tail_block();
+      // the new file was flushed with all the data written so far
+      _unsynced_bytes = 0;
+      units.return_all();
+
+      const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+      fmt::print("DiskShard {:0>3}: compaction - file {} -> {} bytes in {} ms\n", this_shard_id(), old_size, _end_offset, elapsed.count());
+      _compaction_stats.runs++;
+      _compaction_stats.reclaimed_bytes += old_size - _end_offset;
+      _compaction_stats.time += elapsed;
+
+      co_await sync_directory(".");
+      // close the old (already unlinked) file when its readers are done
+      co_await old_readers->close();
+      co_await old_f.close();
+    }
+  } catch (...) {
+    ex = std::current_exception();
+  }
+
+  if (!switched) {
+    co_await out.close();
+    co_await remove_file(tmp_name);
+  }
+  if (ex) {
+    std::rethrow_exception(ex);
   }
+}
+
+future<bool> DiskShard::load_hint()
+{
+  const std::string name = get_hint_name();
+  if (!co_await file_exists(name)) {
+    co_return false;
+  }
+
+  const uint64_t fsize = co_await _f.size();
+  file f = co_await open_file_dma(name, open_flags::ro);
+  const uint64_t hint_size = co_await f.size();
+  file_input_stream_options opts;
+  opts.buffer_size = 1024 * 1024;
+  opts.read_ahead = 1;
+  auto in = make_file_input_stream(f, 0, opts);
+
+  uint64_t covered = 0;
+  std::exception_ptr ex;
+  try {
+    if (hint_size < HINT_HEADER_SIZE + HINT_FOOTER_SIZE) {
+      throw std::runtime_error("truncated");
+    }
+    temporary_buffer<char> footer = co_await f.dma_read<char>(hint_size - HINT_FOOTER_SIZE, HINT_FOOTER_SIZE);
+    uint64_t count = 0;
+    uint64_t key_count = 0;
+    if (footer.size() == HINT_FOOTER_SIZE) {
+      memcpy(&count, footer.get(), sizeof(uint64_t));
+      memcpy(&key_count, footer.get() + sizeof(uint64_t), sizeof(uint64_t));
+    }
+
+    temporary_buffer<char> header = co_await in.read_exactly(HINT_HEADER_SIZE);
+    uint32_t version = 0;
+    uint32_t flags = 0;
+    if (header.size() == HINT_HEADER_SIZE) {
+      memcpy(&version, header.get() + 8, sizeof(uint32_t));
+      memcpy(&flags, header.get() + 12, sizeof(uint32_t));
+      memcpy(&covered, header.get() + 16, sizeof(uint64_t));
+    }
+    if (header.size() < HINT_HEADER_SIZE || memcmp(header.get(), HINT_MAGIC, sizeof(HINT_MAGIC)) != 0 ||
+        version != HINT_VERSION) {
+      throw std::runtime_error("bad header");
+    }
+    if (covered > fsize) {
+      throw std::runtime_error(fmt::format("covers {} bytes, data file has {}", covered, fsize));
+    }
+    if (_opts.ordered_index && !(flags & HINT_KEYS)) {
+      throw std::runtime_error("no keys for the ordered index");
+    }
+    if (count > (hint_size - HINT_HEADER_SIZE - HINT_FOOTER_SIZE) / HINT_ENTRY_SIZE) {
+      throw std::runtime_error("truncated");
+    }
+
+    constexpr uint64_t CHUNK_ENTRIES = 64 * 1024;
+    for (uint64_t done = 0; done < count; ) {
+      const uint64_t n = std::min(count - done, CHUNK_ENTRIES);
+      temporary_buffer<char> buf = co_await in.read_exactly(n * HINT_ENTRY_SIZE);
+      if (buf.size() < n * HINT_ENTRY_SIZE) {
+        throw std::runtime_error("truncated");
+      }
+      for (uint64_t i = 0; i < n; ++i) {
+        uint32_t fp;
+        uint64_t hash2;
+        uint64_t loc;
+        const char *entry = buf.get() + i * HINT_ENTRY_SIZE;
+        memcpy(&fp, entry, sizeof(uint32_t));
+        memcpy(&hash2, entry + sizeof(uint32_t), sizeof(uint64_t));
+        memcpy(&loc, entry + sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint64_t));
+        DiskIndex::Entry e = DiskIndex::unpack(loc);
+        if (e.rec_size == DiskIndex::LARGE_RECORD) {
+          // only the record header knows its size
+          temporary_buffer<char> rec = co_await _f.dma_read<char>(e.rec_pos, HEADER_SIZE);
+          uint16_t key_size = 0;
+          uint64_t val_size = 0;
+          if (rec.size() == HEADER_SIZE) {
+            memcpy(&key_size, rec.get() + 1, sizeof(uint16_t));
+            memcpy(&val_size, rec.get() + 3, sizeof(uint64_t));
+          }
+          e.rec_size = HEADER_SIZE + key_size + val_size;
+        }
+        if (e.rec_pos + e.rec_size > covered || e.rec_size < HEADER_SIZE) {
+          throw std::runtime_error("entry past the covered log");
+        }
+        _index.insert(fp, e.rec_pos, e.rec_size, hash2);
+        _live_bytes += e.rec_size;
+      }
+      done += n;
+      co_await coroutine::maybe_yield();
+    }
+
+    // sorted keys, front coded entries may cross the chunk boundary
+    uint64_t left = hint_size - HINT_HEADER_SIZE - count * HINT_ENTRY_SIZE - HINT_FOOTER_SIZE;
+    uint64_t keys = 0;
+    std::string key;
+    std::vector<char> pending;
+    while (left > 0) {
+      temporary_buffer<char> buf = co_await in.read_exactly(std::min<uint64_t>(left, 1024 * 1024));
+      if (buf.empty()) {
+        throw std::runtime_error("truncated");
+      }
+      left -= buf.size();
+      pending.insert(pending.end(), buf.get(), buf.get() + buf.size());
+      size_t pos = 0;
+      while (pending.size() - pos >= 2 * sizeof(uint16_t)) {
+        uint16_t shared, len;
+        memcpy(&shared, pending.data() + pos, sizeof(uint16_t));
+        memcpy(&len, pending.data() + pos + sizeof(uint16_t), sizeof(uint16_t));
+        if (pending.size() - pos < 2 * sizeof(uint16_t) + len) {
+          break;
+        }
+        if (shared > key.size()) {
+          throw std::runtime_error("bad key entry");
+        }
+        key.resize(shared);
+        key.append(pending.data() + pos + 2 * sizeof(uint16_t), len);
+        pos += 2 * sizeof(uint16_t) + len;
+        if (_opts.ordered_index) {
+          _keys.load_sorted(key);
+        }
+        ++keys;
+      }
+      pending.erase(pending.begin(), pending.begin() + pos);
+      co_await coroutine::maybe_yield();
+    }
+    if (!pending.empty() || keys != key_count) {
+      throw std::runtime_error("key count mismatch");
+    }
+  } catch (std::exception &e) {
+    fmt::print("DiskShard {:0>3}: ignoring hint file - {}\n", this_shard_id(), e.what());
+    ex = std::current_exception();
+  }
+  co_await in.close();
+  co_await f.close();
+
+  if (ex) {
+    _index.clear();
+    _keys.clear();
+    _live_bytes = 0;
+    co_return false;
+  }
+  _end_offset = covered;
+  _hint_offset = covered;
   co_return true;
 }
 
-future<std::set<std::string>> DiskShard::query(const std::string prefix)
+future<> DiskShard::write_hint()
+{
+  // only records already on the disk are included, the rest is replayed from the log,
+  // the index may change while the hint is written (the log replay fixes that),
+  // but a rehash or relocation would make us miss keys, then this attempt is abandoned
+  const uint64_t covered = _end_offset;
+  // the hint must not cover writes a crash could still lose
+  co_await sync_data();
+  const uint64_t generation = _index.generation();
+  const size_t capacity = _index.capacity();
+  const std::string name = get_hint_name();
+  const std::string tmp_name = name + ".tmp";
+
+  file out = co_await open_file_dma(tmp_name, open_flags::rw|open_flags::create|open_flags::truncate);
+  LogWriter writer(out, 1024 * 1024);
+  bool closed = false;
+  std::exception_ptr ex;
+  try {
+    const uint32_t flags = _opts.ordered_index ? HINT_KEYS : 0;
+    char header[HINT_HEADER_SIZE] = {};
+    memcpy(header, HINT_MAGIC, sizeof(HINT_MAGIC));
+    memcpy(header + 8, &HINT_VERSION, sizeof(uint32_t));
+    memcpy(header + 12, &flags, sizeof(uint32_t));
+    memcpy(header + 16, &covered, sizeof(uint64_t));
+    co_await writer.append(header, sizeof(header));
+
+    uint64_t count = 0;
+    std::vector<char> chunk;
+    constexpr size_t CHUNK_SLOTS = 16 * 1024;
+    for (size_t from = 0; from < capacity; from += CHUNK_SLOTS) {
+      // records start before the covered offset end before it too (batches hold whole records)
+      _index.for_each(from, from + CHUNK_SLOTS, [&chunk, &count, covered] (uint32_t fp, uint64_t hash2, DiskIndex::Entry e) {
+        if (e.rec_pos >= covered) {
+          return;
+        }
+        const uint64_t loc = DiskIndex::pack(e.rec_pos, e.rec_size);
+        const size_t offset = chunk.size();
+        chunk.resize(offset + HINT_ENTRY_SIZE);
+        memcpy(chunk.data() + offset, &fp, sizeof(uint32_t));
+        memcpy(chunk.data() + offset + sizeof(uint32_t), &hash2, sizeof(uint64_t));
+        memcpy(chunk.data() + offset + sizeof(uint32_t) + sizeof(uint64_t), &loc, sizeof(uint64_t));
+        ++count;
+      });
+      co_await writer.append(chunk.data(), chunk.size());
+      chunk.clear();
+      if (_index.generation() != generation) {
+        throw std::runtime_error("index rehashed meanwhile");
+      }
+    }
+
+    // keys of the records on the disk
+    uint64_t key_count = 0;
+    if (_opts.ordered_index) {
+      std::string prev;   // last key written
+      std::string last;   // last key visited
+      bool done = false;
+      while (!done) {
+        const std::string after = last;
+        size_t n = 0;
+        done = true;
+        _keys.scan("", after, [&] (std::string_view key) {
+          if (n++ == CHUNK_SLOTS) {
+            done = false;
+            return false;
+          }
+          last.assign(key);
+          const std::optional<IndexMatch> match = find_key(key, DiskIndex::fingerprint(key));
+          if (match && match->rec_pos < covered) {
+            KeyIndex::encode(chunk, prev, key);
+            prev.assign(key);
+            ++key_count;
+          }
+          return true;
+        });
+        co_await writer.append(chunk.data(), chunk.size());
+        chunk.clear();
+      }
+    }
+
+    char footer[HINT_FOOTER_SIZE];
+    memcpy(footer, &count, sizeof(uint64_t));
+    memcpy(footer + sizeof(uint64_t), &key_count, sizeof(uint64_t));
+    co_await writer.append(footer, sizeof(footer));
+    co_await writer.finish();
+    closed = true;
+    co_await out.close();
+    co_await rename_file(tmp_name, name);
+    co_await sync_directory(".");
+    _hint_offset = covered;
+  } catch (...) {
+    ex = std::current_exception();
+  }
+
+  if (ex) {
+    if (!closed) {
+      co_await out.close().handle_exception([] (auto) {});
+    }
+    co_await remove_file(tmp_name).handle_exception([] (auto) {});
+    std::rethrow_exception(ex);
+  }
+}
+
+void DiskShard::relocate(const std::vector<Relocation> &live, uint64_t end, uint64_t delta)
+{
+  _index.relocate([&live, end, delta] (uint64_t rec_pos) {
+    if (rec_pos >= end) {
+      return rec_pos - delta;
+    }
+    const auto it = std::lower_bound(live.begin(), live.end(), rec_pos,
+                                     [](const Relocation &r, uint64_t pos) { return r.old_pos < pos; });
+    assert(it != live.end() && it->old_pos == rec_pos);
+    return it->new_pos;
+  });
+  for (auto &batch : _batches) {
+    batch.offset -= delta;
+  }
+  _tail_offset -= delta;
+  _end_offset -= delta;
+}
+
+future<std::vector<std::string>> DiskShard::query(std::string prefix, std::string after, size_t max)
 {
-  // only use in-memory index for this operation, no need to touch the disk
-  // TODO: avoid linear search using lower_bound, will require changing _data from unordered_map to map
-  std::set<std::string> res;
-  for (auto &[key, val] : _index) {
-    if (key.starts_with(prefix)) {
-       res.insert(key);
+  std::vector<std::string> res;
+  if (_opts.ordered_index) {
+    // visit only the matching key range
+    _keys.scan(prefix, after, [&res, max] (std::string_view key) {
+      if (res.size() == max) {
+        return false;
+      }
+      res.emplace_back(key);
+      return true;
+    });
+    co_return res;
+  }
+
+  // keys are not kept in memory, scan the log for live records with the prefix
+  // and keep the first max of them, pending records are included once their
+  // batch is written
+  if (_tail_offset > _end_offset) {
+    co_await wait_durable(_tail_offset - 1);
+  }
+  while (true) {
+    file f = _f;
+    auto readers = _readers;
+    auto holder = readers->hold();
+    std::set<std::string> first;
+    LogReader reader(f, 0, _end_offset);
+    while (true) {
+      std::optional<LogRecord> rec = co_await reader.next();
+      if (!rec) {
+        break;
+      }
+      if (rec->status == REC_VALID && rec->key.starts_with(prefix) && (after.empty() || rec->key > after) &&
+          (first.size() < max || rec->key < *first.rbegin()) &&
+          _index.find(DiskIndex::fingerprint(rec->key), rec->pos) != DiskIndex::npos) {
+        first.emplace(rec->key);
+        if (first.size() > max) {
+          first.erase(std::prev(first.end()));
+        }
+      }
+      co_await coroutine::maybe_yield();
+    }
+    co_await reader.close();
+    // record offsets changed if compaction switched the file meanwhile
+    if (readers == _readers) {
+      res.assign(first.begin(), first.end());
+      co_return res;
     }
   }
-  co_return res;
 }
 
 
-DiskStorage::DiskStorage()
- : _shards(new seastar::distributed<DiskShard>)
+DiskStorage::DiskStorage(DiskOptions opts)
+ : _opts(opts),
+   _shards(new seastar::distributed<DiskShard>)
 {
 }
 
@@ -208,8 +1214,9 @@ DiskStorage::~DiskStorage() {
 future<> DiskStorage::start()
 {
    //fmt::print("DiskStorage: start\n");
-   co_await _shards->start();
-   co_await _shards->invoke_on_all([] (DiskShard &shard) {return shard.start();});
+   _compaction_sg = co_await create_scheduling_group("compaction", _opts.compaction_shares);
+   co_await _shards->start(_opts);
+   co_await _shards->invoke_on_all([sg = _compaction_sg] (DiskShard &shard) {return shard.start(sg);});
    //fmt::print("DiskStorage: start done\n");
    co_return;
 }
@@ -219,49 +1226,115 @@ future<> DiskStorage::stop() {
    co_await _shards->stop();
    delete _shards;
    _shards = nullptr;
+   co_await destroy_scheduling_group(_compaction_sg);
    co_return;
 }
 
-future<std::string> DiskStorage::get(std::string key)
+future<Value> DiskStorage::get(std::string key)
 {
-  const auto cpu = calc_shard_id(key);
+  const auto cpu = shard_of(key);
   //fmt::print("DiskStorage::get key:{}\n", key);
-  const std::string value = co_await _shards->invoke_on(cpu, &DiskShard::get, key);
+  Value value = co_await _shards->invoke_on(cpu, &DiskShard::get, key);
   co_return value;
 }
 
-future<bool> DiskStorage::set(std::string key, std::string value)
+future<bool> DiskStorage::set(std::string key, Value value)
 {
-  const auto cpu = calc_shard_id(key);
+  const auto cpu = shard_of(key);
   //fmt::print("DiskStorage: set on cpu{} [{},{}]\n", cpu, key, value);
-  const bool success = co_await _shards->invoke_on(cpu, &DiskShard::set, key, value);
+  const bool success = co_await _shards->invoke_on(cpu, &DiskShard::set, std::move(key), std::move(value));
   co_return success;
 }
 
 future<bool> DiskStorage::del(std::string key)
 {
-  const auto cpu = calc_shard_id(key);
+  const auto cpu = shard_of(key);
   //fmt::print("DiskStorage: del on cpu{} [{}]\n", cpu, key);
   const bool success = co_await _shards->invoke_on(cpu, &DiskShard::del, key);
   co_return success;
 }
 
-// calculate union of two sets
-static std::set<std::string> set_reducer(std::set<std::string> a, std::set<std::string> b) {
-  a.insert(b.begin(), b.end());
-  return a;
+future<Value> DiskStorage::get_local(std::string key)
+{
+  return _shards->local().get(std::move(key));
+}
+
+future<bool> DiskStorage::set_local(std::string key, Value value)
+{
+  return _shards->local().set(std::move(key), std::move(value));
+}
+
+future<bool> DiskStorage::del_local(std::string key)
+{
+  return _shards->local().del(std::move(key));
+}
+
+future<std::vector<Value>> DiskStorage::mget_local(std::vector<std::string> keys)
+{
+  return _shards->local().mget(std::move(keys));
+}
+
+future<> DiskStorage::mset_local(std::vector<KeyValue> items)
+{
+  return _shards->local().mset(std::move(items));
+}
+
+future<> DiskStorage::mdel_local(std::vector<std::string> keys)
+{
+  return _shards->local().mdel(std::move(keys));
+}
+
+future<RecoveryStats> DiskStorage::recovery_stats() const
+{
+  return _shards->map_reduce0([] (const DiskShard &shard) {
+    return shard.recovery_stats();
+  }, RecoveryStats(), [] (RecoveryStats total, const RecoveryStats &s) {
+    total.hint_loaded += s.hint_loaded;
+    total.replayed_records += s.replayed_records;
+    return total;
+  });
+}
+
+future<CompactionStats> DiskStorage::compaction_stats() const
+{
+  return _shards->map_reduce0([] (const DiskShard &shard) {
+    return shard.compaction_stats();
+  }, CompactionStats(), [] (CompactionStats total, const CompactionStats &s) {
+    total.runs += s.runs;
+    total.reclaimed_bytes += s.reclaimed_bytes;
+    total.time += s.time;
+    return total;
+  });
+}
+
+future<IoStats> DiskStorage::io_stats() const
+{
+  return _shards->map_reduce0([] (const DiskShard &shard) {
+    const IoStats &s = shard.io_stats();
+    IoStats counters;
+    counters.reads = s.reads;
+    counters.read_bytes = s.read_bytes;
+    counters.writes = s.writes;
+    counters.write_bytes = s.write_bytes;
+    counters.flushes = s.flushes;
+    return counters;
+  }, IoStats(), [] (IoStats total, const IoStats &s) {
+    total.reads += s.reads;
+    total.read_bytes += s.read_bytes;
+    total.writes += s.writes;
+    total.write_bytes += s.write_bytes;
+    total.flushes += s.flushes;
+    return total;
+  });
 }
 
-future<std::set<std::string>> DiskStorage::query(std::string prefix)
+std::unique_ptr<IKeyStream> DiskStorage::query(std::string prefix, std::string after)
 {
-  auto res = co_await _shards->map_reduce0(
-         // Mapper: called on each shard instance
-         [prefix](DiskShard& shard) { return shard.query(prefix); }, 
-         // initial value
-         std::set<std::string>(),
-         // Reduce function
-         set_reducer);
-  co_return res;
+  // each shard returns its keys in order, merged as they are taken
+  return std::make_unique<ShardedKeyStream>(smp::count,
+      [this, prefix = std::move(prefix)] (unsigned shard, std::string after, size_t max) {
+        return _shards->invoke_on(shard, &DiskShard::query, prefix, std::move(after), max);
+      }, std::move(after));
 }
 
 }; // namespace kvdb
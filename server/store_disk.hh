@@ -2,36 +2,262 @@
 
 #include <string>
 #include <set>
-#include <unordered_map>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <optional>
 #include "db.hh"
+#include "disk_log.hh"
+#include "disk_index.hh"
+#include "key_index.hh"
 
 #include <seastar/core/seastar.hh>
 #include <seastar/core/distributed.hh>
 #include <seastar/core/file.hh>
+#include <seastar/core/condition-variable.hh>
+#include <seastar/core/shared_future.hh>
+#include <seastar/core/aligned_buffer.hh>
+#include <seastar/core/semaphore.hh>
+#include <seastar/core/gate.hh>
+#include <seastar/core/shared_ptr.hh>
+#include <seastar/core/scheduling.hh>
+#include <seastar/core/metrics_registration.hh>
+#include "latency_histogram.hh"
 
 using namespace seastar;
 
 namespace kvdb {
 
+/*
+  When a write is acknowledged:
+   - strict: once its commit batch is written and flushed
+   - periodic: once its batch is written (in the device queue), the data
+     file is flushed every sync interval or sync bytes written, whichever
+     comes first, a crash loses the writes of the last interval
+   - none: once its batch is written, the data file is only flushed on stop
+     (cache like data, a crash may lose any recent write)
+*/
+enum class Durability { strict, periodic, none };
+
+// false for an unknown mode name
+bool parse_durability(std::string_view name, Durability &durability);
+const char *durability_name(Durability durability);
+
+/*
+  Disk shard tunables, same for all shards.
+*/
+struct DiskOptions {
+  Durability durability = Durability::strict;
+  // periodic durability: max. time and bytes written between two flushes
+  std::chrono::milliseconds sync_interval{100};
+  uint64_t sync_bytes = 64 * 1024 * 1024;
+
+  // max. amount of record data appended by a single batch write
+  size_t max_batch_bytes = 1024 * 1024;
+  // how long the commit loop waits for more writers to join a batch,
+  // zero means batching only happens while the previous batch is being written
+  std::chrono::microseconds max_batch_delay{0};
+
+  // compact the data file once dead records take this fraction of it (1 disables compaction)
+  double compaction_threshold = 0.5;
+  // ...and the file is at least this large
+  uint64_t compaction_min_bytes = 16 * 1024 * 1024;
+  // CPU/IO shares of the compaction scheduling group (main group has 1000)
+  unsigned compaction_shares = 100;
+
+  // how often the index snapshot (hint file) is refreshed while running (0 - only on stop)
+  std::chrono::seconds hint_interval{60};
+
+  // keep the keys ordered in memory for prefix queries,
+  // otherwise queries scan the data file
+  bool ordered_index = true;
+};
+
+struct CommitStats {
+  uint64_t batches{0};
+  uint64_t ops{0};
+  uint64_t bytes{0};
+
+  double avg_batch_ops() const { return batches ? double(ops) / batches : 0.0; }
+  double avg_batch_bytes() const { return batches ? double(bytes) / batches : 0.0; }
+};
+
+// DMA reads of the request path, batch writes and their flushes
+struct IoStats {
+  uint64_t reads{0};
+  uint64_t read_bytes{0};
+  uint64_t writes{0};
+  uint64_t write_bytes{0};
+  uint64_t flushes{0};
+  LatencyHistogram flush_latency;
+};
+
+struct CompactionStats {
+  uint64_t runs{0};
+  uint64_t reclaimed_bytes{0};
+  std::chrono::milliseconds time{0};
+};
+
+// how the index was built on the last start
+struct RecoveryStats {
+  uint64_t hint_loaded{0};        // shards started from their hint file (0 or 1 for a shard)
+  uint64_t replayed_records{0};   // log records replayed, past the hint if loaded
+};
+
 class DiskShard {
 public:
+  DiskShard(DiskOptions opts) : _opts(opts) {}
 
-  future<std::string> get(std::string key);
-  future<bool> set(std::string key, std::string value);
+  // the value read from the disk is returned as is, no copy
+  future<Value> get(std::string key);
+  future<bool> set(std::string key, Value value);
   future<bool> del(std::string key);
-  future<std::set<std::string>> query(std::string prefix);
+  // batches: the records of all keys are appended to the open batch
+  // (committed together), the records read are coalesced into larger reads
+  future<std::vector<Value>> mget(std::vector<std::string> keys);
+  future<> mset(std::vector<KeyValue> items);
+  future<> mdel(std::vector<std::string> keys);
+  // up to max keys with the prefix following after, in order
+  future<std::vector<std::string>> query(std::string prefix, std::string after, size_t max);
 
-  future<> start();
+  future<> start(scheduling_group compaction_sg);
   future<> stop();
 
+  const CommitStats &commit_stats() const { return _commit_stats; }
+  const CompactionStats &compaction_stats() const { return _compaction_stats; }
+  const IoStats &io_stats() const { return _io_stats; }
+  const RecoveryStats &recovery_stats() const { return _recovery_stats; }
+  uint64_t dead_bytes() const { return _tail_offset - _live_bytes; }
+
 protected:
-  future<> build_db_index();
+  future<> build_db_index(uint64_t pos);
+
+  /*
+    Index lookups: the fingerprint and the secondary hash identify the key
+    in memory, writes never read the records back.
+  */
+  struct IndexMatch {
+    size_t slot;
+    uint64_t rec_pos;
+    uint64_t rec_size;
+  };
+
+  std::optional<IndexMatch> find_key(std::string_view key, uint32_t fp) const;
+  future<> load_tail_block();
+  // DMA read of a record (or a span of them), counted
+  future<temporary_buffer<char>> read(file &f, uint64_t pos, size_t size);
+  void register_metrics();
+
+  /*
+    Hint file: snapshot of the index and the log offset it covers,
+    on start only the log past that offset needs to be replayed.
+  */
+  future<bool> load_hint();
+  future<> write_hint();
+
+  /*
+    Group commit: writers append their records to the open batch and wait
+    until the commit loop writes the whole batch with a single DMA write,
+    followed by a single flush (strict durability, the other modes leave
+    the flushes to the sync loop or the stop).
+  */
+  struct Batch {
+    uint64_t offset{0};            // log offset of the first appended byte
+    std::vector<char> data;        // serialized records, appended at offset
+    size_t ops{0};
+    bool sealed{false};            // picked by the commit loop, no more changes
+    shared_promise<> committed;
+    std::vector<RequestTrace*> traces;   // sampled requests waiting for the batch
+
+    void add_trace(RequestTrace *trace) {
+      if (trace) [[unlikely]] {
+        traces.push_back(trace);
+      }
+    }
+    void trace_stage(const char *name) {
+      for (auto *trace : traces) {
+        trace->stage(name);
+      }
+    }
+  };
+
+  Batch &open_batch(size_t rec_size);
+  uint64_t append_record(Batch &batch, unsigned char status, std::string_view key, std::string_view value);
+  // append the record of a set (a tombstone of a del) superseding the old one
+  // and update the index, returns the batch committing it (none if nothing was deleted)
+  Batch &append_set(std::string_view key, uint32_t fp, std::string_view value, const std::optional<IndexMatch> &old);
+  Batch *append_del(std::string_view key, const std::optional<IndexMatch> &old);
+  future<> wait_durable(uint64_t pos);
+
+  future<> commit_loop();
+  future<> write_batch(Batch &batch);
+  // flush the batches written but not flushed yet (periodic and none durability)
+  future<> sync_data();
+  future<> sync_loop();
+
+  /*
+    Compaction: live records are copied to a new file in the background
+    (compaction scheduling group), records appended meanwhile are copied
+    after them. Writes are paused only for the final catch-up copy, then
+    the index offsets are switched to the new file.
+  */
+  struct Relocation {
+    uint64_t old_pos;   // record position in the current file
+    uint64_t size;      // whole record size
+    uint64_t new_pos;   // record position in the compacted file
+  };
+
+  bool needs_compaction() const;
+  // runs compactions and periodic hint writes
+  future<> maintenance_loop();
+  future<> compact();
+  void relocate(const std::vector<Relocation> &live, uint64_t end, uint64_t delta);
 
 protected:
+  DiskOptions _opts;
   file _f;
-  // [offset, size] for disk record "value" member from key
-  std::unordered_map<std::string, std::pair<uint64_t, uint64_t>> _index;
+  // in-flight reads of _f, compaction closes the old file after them
+  lw_shared_ptr<gate> _readers = make_lw_shared<gate>();
+  // key fingerprint and secondary hash -> record offset and size
+  DiskIndex _index;
+  // all keys, ordered (if enabled)
+  KeyIndex _keys;
+  // end of the data already written to the disk
   uint64_t _end_offset{0};
+  // end of the log including batches waiting for the commit
+  uint64_t _tail_offset{0};
+  // copy of the last, partially filled block of the file (DMA aligned),
+  // appends start from it instead of reading the block back
+  std::unique_ptr<char[], seastar::free_deleter> _tail_buf;
+
+  std::deque<Batch> _batches;
+  condition_variable _commit_cv;
+  future<> _commit_done = make_ready_future<>();
+  bool _stopping{false};
+  // first write error, the shard refuses writes from then on
+  std::exception_ptr _io_error;
+  CommitStats _commit_stats;
+  // held while writing to the file, keeps batch writes and compaction apart
+  semaphore _write_sem{1};
+  // bytes written since the last flush, not durable yet (strict durability: none)
+  uint64_t _unsynced_bytes{0};
+  condition_variable _sync_cv;
+  future<> _sync_done = make_ready_future<>();
+
+  // sum of all live record sizes, the rest of the file is dead
+  uint64_t _live_bytes{0};
+  condition_variable _compaction_cv;
+  future<> _compaction_done = make_ready_future<>();
+  // after a failed compaction, next attempt waits until the log grows past this
+  uint64_t _compaction_retry_offset{0};
+  CompactionStats _compaction_stats;
+
+  // log offset covered by the last hint file written
+  uint64_t _hint_offset{0};
+  RecoveryStats _recovery_stats;
+
+  IoStats _io_stats;
+  seastar::metrics::metric_groups _metrics;
 };
 
 /*
@@ -39,20 +265,33 @@ protected:
 */
 class DiskStorage : public IStorage {
 public:
-  DiskStorage();
+  DiskStorage(DiskOptions opts = {});
   virtual ~DiskStorage();
 
   future<> start() override;
   future<> stop() override;
 
-  future<std::string> get(std::string key) override;
-  future<bool> set(std::string key, std::string value) override;
+  future<Value> get(std::string key) override;
+  future<bool> set(std::string key, Value value) override;
   future<bool> del(std::string key) override;
-  future<std::set<std::string>> query(std::string prefix) override;
+  future<Value> get_local(std::string key) override;
+  future<bool> set_local(std::string key, Value value) override;
+  future<bool> del_local(std::string key) override;
+  future<std::vector<Value>> mget_local(std::vector<std::string> keys) override;
+  future<> mset_local(std::vector<KeyValue> items) override;
+  future<> mdel_local(std::vector<std::string> keys) override;
+  std::unique_ptr<IKeyStream> query(std::string prefix, std::string after) override;
 
-private:
-  unsigned int calc_shard_id(std::string &key) const { return std::hash<std::string>{}(key) % smp::count; }
+  // I/O counters of all shards added up (without the flush latency)
+  future<IoStats> io_stats() const;
+  // recovery counters of all shards added up
+  future<RecoveryStats> recovery_stats() const;
+  // compaction counters of all shards added up
+  future<CompactionStats> compaction_stats() const;
 
+private:
+  DiskOptions _opts;
+  scheduling_group _compaction_sg;
   // data sharded to a number of cores
   seastar::distributed<DiskShard> *_shards;
 };
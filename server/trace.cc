@@ -0,0 +1,96 @@
+#include "trace.hh"
+#include "json_scan.hh"
+#include <cmath>
+#include <seastar/core/print.hh>
+
+namespace kvdb {
+
+std::chrono::nanoseconds RequestTrace::total() const
+{
+  uint64_t ns = 0;
+  for (size_t i = 0; i < stage_count(); ++i) {
+    ns = std::max(ns, _stages[i].ns);
+  }
+  return std::chrono::nanoseconds(ns);
+}
+
+std::string RequestTrace::format() const
+{
+  std::string out = fmt::format("{} {} on shard {}: {:.1f} us", _op, _key, _shard, total().count() / 1000.0);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < stage_count(); ++i) {
+    const Stage &s = _stages[i];
+    // stages of the other shards of a batch may come in any order
+    const uint64_t delta = s.ns > prev ? s.ns - prev : 0;
+    out += fmt::format("{} {} [{}] +{:.1f} us", i ? "," : " -", s.name, s.shard, delta / 1000.0);
+    prev = std::max(prev, s.ns);
+  }
+  return out;
+}
+
+std::string RequestTrace::to_json() const
+{
+  std::string out = fmt::format("{{ \"op\" : \"{}\", \"key\" : \"", _op);
+  write_json_escaped(_key, [&out] (std::string_view chunk) { out += chunk; });
+  out += fmt::format("\", \"shard\" : {}, \"total_us\" : {:.1f}, \"stages\" : [ ", _shard, total().count() / 1000.0);
+  for (size_t i = 0; i < stage_count(); ++i) {
+    const Stage &s = _stages[i];
+    out += fmt::format("{}{{ \"stage\" : \"{}\", \"shard\" : {}, \"us\" : {:.1f} }}", i ? ", " : "", s.name, s.shard, s.ns / 1000.0);
+  }
+  out += " ] }";
+  return out;
+}
+
+void Tracer::configure(const TraceOptions &opts)
+{
+  _opts = opts;
+  if (opts.sample_rate <= 0) {
+    _sample_threshold = 0;
+  } else if (opts.sample_rate >= 1) {
+    _sample_threshold = UINT64_MAX;
+  } else {
+    _sample_threshold = uint64_t(std::ldexp(opts.sample_rate, 64));
+  }
+  // shards sample different requests
+  _random += seastar::this_shard_id() * 0x2545f4914f6cdd1d;
+  _ring.clear();
+  _ring.resize(opts.buffer_size);
+  _next = 0;
+}
+
+void Tracer::finish(std::unique_ptr<RequestTrace> trace)
+{
+  if (_opts.slow_threshold.count() > 0 && trace->total() >= _opts.slow_threshold) {
+    fmt::print("slow request: {}\n", trace->format());
+  }
+  if (!_ring.empty()) {
+    _ring[_next] = std::move(trace);
+    _next = (_next + 1) % _ring.size();
+  }
+}
+
+void Tracer::log_untraced(const char *op, std::chrono::steady_clock::duration took)
+{
+  fmt::print("slow request: {} on shard {}: {:.1f} us (not sampled)\n", op, seastar::this_shard_id(),
+             std::chrono::duration_cast<std::chrono::nanoseconds>(took).count() / 1000.0);
+}
+
+std::vector<const RequestTrace *> Tracer::recent() const
+{
+  std::vector<const RequestTrace *> res;
+  for (size_t i = 0; i < _ring.size(); ++i) {
+    const auto &trace = _ring[(_next + i) % _ring.size()];
+    if (trace) {
+      res.push_back(trace.get());
+    }
+  }
+  return res;
+}
+
+Tracer &local_tracer()
+{
+  static thread_local Tracer tracer;
+  return tracer;
+}
+
+}; // namespace kvdb
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <seastar/core/smp.hh>
+
+namespace kvdb {
+
+/*
+  Stages of a sampled request: a monotonic timestamp (relative to the
+  request start) and the shard of each stage, recorded by the handler,
+  the database and the storage layers as the request passes them. The
+  trace lives with the request on its receiving shard, the shards it
+  visits write their stages into it while the request waits for them.
+*/
+class RequestTrace {
+public:
+  static constexpr size_t MAX_STAGES = 24;
+  static constexpr size_t MAX_KEY = 64;
+
+  struct Stage {
+    const char *name;
+    unsigned shard;
+    uint64_t ns;          // since the request start
+  };
+
+  explicit RequestTrace(const char *op)
+    : _op(op), _shard(seastar::this_shard_id()), _start(std::chrono::steady_clock::now()) {}
+
+  void set_key(std::string_view key) { _key.assign(key.substr(0, MAX_KEY)); }
+
+  void stage(const char *name) { stage_at(name, std::chrono::steady_clock::now()); }
+  void stage_at(const char *name, std::chrono::steady_clock::time_point at) {
+    // stages of a batch may come from several shards at once
+    const size_t i = _count.fetch_add(1, std::memory_order_relaxed);
+    if (i < MAX_STAGES) {
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(at - _start).count();
+      _stages[i] = Stage{name, seastar::this_shard_id(), uint64_t(ns)};
+    }
+  }
+
+  const char *op() const { return _op; }
+  const std::string &key() const { return _key; }
+  unsigned shard() const { return _shard; }
+  size_t stage_count() const { return std::min<size_t>(_count.load(std::memory_order_relaxed), MAX_STAGES); }
+  const Stage &stage(size_t i) const { return _stages[i]; }
+  // time until the last stage
+  std::chrono::nanoseconds total() const;
+
+  // one line: op, key, total and the time spent in each stage
+  std::string format() const;
+  // JSON object with the stage offsets
+  std::string to_json() const;
+
+private:
+  const char *_op;
+  std::string _key;
+  unsigned _shard;
+  std::chrono::steady_clock::time_point _start;
+  std::atomic<size_t> _count{0};
+  Stage _stages[MAX_STAGES];
+};
+
+// trace of the request whose code runs right now on this shard, null if it is not sampled
+inline thread_local RequestTrace *g_current_trace = nullptr;
+
+inline RequestTrace *current_trace() { return g_current_trace; }
+
+/*
+  Makes a trace current while a component is called: a callee takes the
+  current trace before it first suspends and keeps it for its later stages.
+*/
+class TraceScope {
+public:
+  explicit TraceScope(RequestTrace *trace) : _prev(std::exchange(g_current_trace, trace)) {}
+  ~TraceScope() { g_current_trace = _prev; }
+  TraceScope(const TraceScope &) = delete;
+  TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+  RequestTrace *_prev;
+};
+
+// call func() with the trace current
+template <typename Func>
+auto traced(RequestTrace *trace, Func &&func) {
+  TraceScope scope(trace);
+  return func();
+}
+
+// record a stage if the request is traced, a branch otherwise
+inline void trace_stage(RequestTrace *trace, const char *name) {
+  if (trace) [[unlikely]] {
+    trace->stage(name);
+  }
+}
+
+struct TraceOptions {
+  // fraction of the requests traced (0 - tracing off)
+  double sample_rate = 0;
+  // traced requests taking longer are logged with their stages (0 - none)
+  std::chrono::microseconds slow_threshold{0};
+  // last traces kept by each shard
+  size_t buffer_size = 256;
+};
+
+/*
+  Per shard tracer: picks the sampled requests and keeps their traces,
+  once complete, in a ring buffer. Slow ones are also logged.
+*/
+class Tracer {
+public:
+  void configure(const TraceOptions &opts);
+
+  // trace of a new request, null unless it is sampled
+  std::unique_ptr<RequestTrace> start(const char *op) {
+    if (_sample_threshold == 0) [[likely]] {
+      return nullptr;
+    }
+    if (_sample_threshold != UINT64_MAX && next_random() >= _sample_threshold) {
+      return nullptr;
+    }
+    return std::make_unique<RequestTrace>(op);
+  }
+  // completed request
+  void finish(std::unique_ptr<RequestTrace> trace);
+  // completed request not sampled, only logged if slow (without stages)
+  void finish_untraced(const char *op, std::chrono::steady_clock::duration took) {
+    if (_opts.slow_threshold.count() > 0 && took >= _opts.slow_threshold) [[unlikely]] {
+      log_untraced(op, took);
+    }
+  }
+
+  // buffered traces, oldest first
+  std::vector<const RequestTrace *> recent() const;
+
+private:
+  void log_untraced(const char *op, std::chrono::steady_clock::duration took);
+  uint64_t next_random() {
+    // xorshift64, sampling needs no better
+    _random ^= _random << 13;
+    _random ^= _random >> 7;
+    _random ^= _random << 17;
+    return _random;
+  }
+
+  TraceOptions _opts;
+  // a request is sampled if a random number is below (0 - never, max - always)
+  uint64_t _sample_threshold{0};
+  uint64_t _random{0x9e3779b97f4a7c15};
+  std::vector<std::unique_ptr<RequestTrace>> _ring;
+  size_t _next{0};
+};
+
+Tracer &local_tracer();
+
+}; // namespace kvdb
@@ -0,0 +1,418 @@
+/*
+  Disk storage recovery tests, no server involved.
+
+  Torn tail: keys are written and the storage stopped, then the tail of a data file
+  is corrupted the way a partially persisted batch leaves it: the last
+  record has its header and key on the disk, but its value bytes were
+  never written (zeros), so its lengths still look valid. The hint files
+  are removed (as after a crash) and the storage restarted: the corrupted
+  record must be dropped by its checksum, the log truncated right before
+  it, the previous value of its key served again and new writes appended
+  after the truncation must survive the next restart.
+
+  Hint load: the hint files written on stop are kept aside, keys are then
+  added, overwritten and deleted, and the kept hints put back, so the next
+  start loads them and replays the log past the offset they cover. One
+  kept hint also lacks its last key, the way a key overwritten between the
+  entries and the keys pass of a hint write leaves it out: the replay of
+  its new record must put it back into the ordered keys. Values are checked
+  with get, the keys with a query, after this start and the next one.
+
+  Compaction: with a low threshold keys are overwritten and deleted round
+  after round, concurrently, so the compactions run while writes go on
+  (their records are caught up after the copied ones). Every value and the
+  query result are checked while running, after a restart from the hints
+  written since and after a full replay of the compacted files, and no
+  .compact file may be left behind.
+
+  Data files are kept in a separate working directory.
+*/
+
+#include <seastar/core/seastar.hh>
+#include <seastar/core/app-template.hh>
+#include <seastar/core/coroutine.hh>
+#include <seastar/core/file.hh>
+#include <seastar/core/aligned_buffer.hh>
+#include <seastar/core/print.hh>
+#include <seastar/core/loop.hh>
+#include <boost/range/irange.hpp>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <unistd.h>
+
+#include "../server/store_disk.hh"
+#include "../perf/bench_util.hh"
+
+using namespace seastar;
+using namespace kvdb;
+
+namespace bpo = boost::program_options;
+
+static constexpr unsigned KEYS = 100;
+
+static std::string key_name(unsigned i) {
+  return fmt::format("key{:0>4}", i);
+}
+
+static Value make_value(std::string_view s) {
+  return Value(s.data(), s.size());
+}
+
+// zero the last n bytes of the file, the file size stays
+future<> zero_tail(std::string name, uint64_t n) {
+  file f = co_await open_file_dma(name, open_flags::rw);
+  const uint64_t fsize = co_await f.size();
+  const uint64_t alignment = f.disk_write_dma_alignment();
+  const uint64_t start = align_down<uint64_t>(fsize - n, alignment);
+  const uint64_t len = align_up<uint64_t>(fsize, alignment) - start;
+  auto buf = allocate_aligned_buffer<char>(len, alignment);
+  memset(buf.get(), 0, len);
+  temporary_buffer<char> data = co_await f.dma_read<char>(start, fsize - start);
+  memcpy(buf.get(), data.get(), data.size());
+  memset(buf.get() + (fsize - n - start), 0, n);
+  co_await f.dma_write(start, buf.get(), len);
+  co_await f.truncate(fsize);
+  co_await f.flush();
+  co_await f.close();
+}
+
+future<uint64_t> file_size(std::string name) {
+  file f = co_await open_file_dma(name, open_flags::ro);
+  const uint64_t size = co_await f.size();
+  co_await f.close();
+  co_return size;
+}
+
+template <typename T> bool runtime_assert_equal(const T &a, const T &b, const char *test) {
+  if (a != b) {
+    fmt::print("Test {} failed, [expected,result] values don't match!\n{}\n{}\n", test, a, b);
+    return false;
+  }
+  fmt::print("Test {} succeeded!\n", test);
+  return true;
+}
+
+future<std::string> get_string(IStorage &store, std::string key) {
+  Value value = co_await store.get(std::move(key));
+  co_return std::string(value.get(), value.size());
+}
+
+// the query result keys, all of them
+future<std::vector<std::string>> query_keys(IStorage &store, std::string prefix) {
+  std::unique_ptr<IKeyStream> stream = store.query(std::move(prefix), "");
+  std::vector<std::string> keys;
+  while (true) {
+    std::vector<std::string> chunk = co_await stream->next(64);
+    if (chunk.empty()) {
+      break;
+    }
+    keys.insert(keys.end(), chunk.begin(), chunk.end());
+  }
+  co_return keys;
+}
+
+static std::string join(const std::vector<std::string> &keys) {
+  std::string s;
+  for (const auto &key : keys) {
+    s += s.empty() ? key : " " + key;
+  }
+  return s;
+}
+
+// every key has the expected value (empty - deleted), and the query returns exactly these keys
+future<bool> check_store(IStorage &store, const std::map<std::string, std::string> &expected, const char *test) {
+  bool ok = true;
+  std::vector<std::string> live;
+  for (const auto &[key, expected_value] : expected) {
+    const std::string value = co_await get_string(store, key);
+    if (value != expected_value) {
+      fmt::print("Test {} failed, key {} has value '{}' instead of '{}'\n", test, key, value, expected_value);
+      ok = false;
+    }
+    if (!expected_value.empty()) {
+      live.push_back(key);
+    }
+  }
+  const std::string keys = join(co_await query_keys(store, ""));
+  if (keys != join(live)) {
+    fmt::print("Test {} failed, query returned [{}] instead of [{}]\n", test, keys, join(live));
+    ok = false;
+  }
+  if (ok) {
+    fmt::print("Test {} succeeded!\n", test);
+  }
+  co_return ok;
+}
+
+static std::string hint_name(unsigned shard) {
+  return fmt::format("kvdb_data.{:0>3}.hint", shard);
+}
+
+/*
+  Drop the last key of the keys section of a hint file and return it
+  (layout in server/store_disk.cc: 24 bytes header, 20 bytes per entry,
+  front coded keys, 16 bytes footer with the entry and the key count).
+*/
+static std::string drop_last_hint_key(const std::string &name) {
+  constexpr size_t HEADER_SIZE = 24;
+  constexpr size_t ENTRY_SIZE = 20;
+  constexpr size_t FOOTER_SIZE = 16;
+  std::ifstream in(name, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  in.close();
+  if (data.size() < HEADER_SIZE + FOOTER_SIZE) {
+    return "";
+  }
+  const size_t end = data.size() - FOOTER_SIZE;
+  uint64_t count, key_count;
+  memcpy(&count, data.data() + end, sizeof(uint64_t));
+  memcpy(&key_count, data.data() + end + sizeof(uint64_t), sizeof(uint64_t));
+  size_t pos = HEADER_SIZE + count * ENTRY_SIZE;
+  size_t last = pos;
+  std::string key;
+  while (pos + 2 * sizeof(uint16_t) <= end) {
+    uint16_t shared, len;
+    memcpy(&shared, data.data() + pos, sizeof(uint16_t));
+    memcpy(&len, data.data() + pos + sizeof(uint16_t), sizeof(uint16_t));
+    key.resize(shared);
+    key.append(data.data() + pos + 2 * sizeof(uint16_t), len);
+    last = pos;
+    pos += 2 * sizeof(uint16_t) + len;
+  }
+  if (key_count == 0 || pos != end) {
+    return "";
+  }
+  data.erase(last, end - last);
+  --key_count;
+  memcpy(data.data() + data.size() - sizeof(uint64_t), &key_count, sizeof(uint64_t));
+  std::ofstream out(name, std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+  return key;
+}
+
+// all the keys but the victim keep their values
+future<bool> check_keys(IStorage &store, const char *test) {
+  bool ok = true;
+  for (unsigned i = 0; i < KEYS; ++i) {
+    const std::string value = co_await get_string(store, key_name(i));
+    if (value != fmt::format("value{}", i)) {
+      fmt::print("Test {} failed, key {} has value '{}'\n", test, key_name(i), value);
+      ok = false;
+    }
+  }
+  if (ok) {
+    fmt::print("Test {} succeeded!\n", test);
+  }
+  co_return ok;
+}
+
+// a torn record at the tail is dropped by its checksum, the log truncated before it
+future<bool> torn_tail_test() {
+  remove_data_files();
+  // the victim key is written last, its last record ends its shard data file
+  const std::string victim = "victim";
+  const std::string data_name = fmt::format("kvdb_data.{:0>3}.bin", IStorage::shard_of(victim));
+  const std::string last = "last value";
+  const std::string after = "after recovery";
+
+  auto store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  for (unsigned i = 0; i < KEYS; ++i) {
+    co_await store->set(key_name(i), make_value(fmt::format("value{}", i)));
+  }
+  co_await store->set(victim, make_value("first value"));
+  co_await store->set(victim, make_value(last));
+  co_await store->stop();
+
+  const uint64_t fsize = co_await file_size(data_name);
+  co_await zero_tail(data_name, last.size());
+  remove_data_files(true);
+
+  bool ok = true;
+  store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  ok &= co_await check_keys(*store, "#0 (other keys intact)");
+  ok &= runtime_assert_equal(std::string("first value"), co_await get_string(*store, victim), "#1 (corrupted record dropped)");
+  co_await store->set(victim, make_value(after));
+  co_await store->stop();
+  // the corrupted record replaced by the new one
+  ok &= runtime_assert_equal(fsize - last.size() + after.size(), co_await file_size(data_name),
+                             "#2 (log truncated before the corrupted record)");
+
+  remove_data_files(true);
+  store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  ok &= co_await check_keys(*store, "#3 (other keys intact after the next restart)");
+  ok &= runtime_assert_equal(after, co_await get_string(*store, victim), "#4 (append after the truncation)");
+  co_await store->stop();
+  co_return ok;
+}
+
+// the hint loaded, the log past it replayed, keys missing from its keys section put back
+future<bool> hint_test() {
+  namespace fs = std::filesystem;
+  remove_data_files();
+  bool ok = true;
+  // sorts after all the other keys, the last one of its shard
+  const std::string last_key = "zzz";
+  std::map<std::string, std::string> expected;
+
+  auto store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  for (unsigned i = 0; i < KEYS; ++i) {
+    expected[fmt::format("hint{:0>4}", i)] = fmt::format("value{}", i);
+  }
+  expected[last_key] = "first value";
+  for (const auto &[key, value] : expected) {
+    co_await store->set(key, make_value(value));
+  }
+  co_await store->stop();
+
+  // the next stop replaces the hints, keep these
+  fs::create_directories("kept");
+  for (unsigned shard = 0; shard < smp::count; ++shard) {
+    fs::copy_file(hint_name(shard), "kept/" + hint_name(shard), fs::copy_options::overwrite_existing);
+  }
+
+  store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  RecoveryStats stats = co_await store->recovery_stats();
+  ok &= runtime_assert_equal(uint64_t(smp::count), stats.hint_loaded, "#5 (hints loaded)");
+  ok &= runtime_assert_equal(uint64_t(0), stats.replayed_records, "#6 (nothing past the hints)");
+  // new keys, overwrites and deletes, the last key overwritten too
+  uint64_t records = 0;
+  for (unsigned i = 0; i < KEYS / 5; ++i, ++records) {
+    const std::string key = fmt::format("new{:0>4}", i);
+    expected[key] = fmt::format("new value{}", i);
+    co_await store->set(key, make_value(expected[key]));
+  }
+  for (unsigned i = 0; i < KEYS / 10; ++i, ++records) {
+    const std::string key = fmt::format("hint{:0>4}", i);
+    expected[key] = fmt::format("overwritten{}", i);
+    co_await store->set(key, make_value(expected[key]));
+  }
+  for (unsigned i = KEYS / 10; i < KEYS / 5; ++i, ++records) {
+    const std::string key = fmt::format("hint{:0>4}", i);
+    expected[key] = "";
+    co_await store->del(key);
+  }
+  expected[last_key] = "last value";
+  co_await store->set(last_key, make_value(expected[last_key]));
+  ++records;
+  co_await store->stop();
+
+  for (unsigned shard = 0; shard < smp::count; ++shard) {
+    fs::copy_file("kept/" + hint_name(shard), hint_name(shard), fs::copy_options::overwrite_existing);
+  }
+  fs::remove_all("kept");
+  ok &= runtime_assert_equal(last_key, drop_last_hint_key(hint_name(IStorage::shard_of(last_key))),
+                             "#7 (last key dropped from its hint)");
+
+  store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  stats = co_await store->recovery_stats();
+  ok &= runtime_assert_equal(uint64_t(smp::count), stats.hint_loaded, "#8 (kept hints loaded)");
+  ok &= runtime_assert_equal(records, stats.replayed_records, "#9 (log past the hints replayed)");
+  ok &= co_await check_store(*store, expected, "#10 (values and keys after the replay)");
+  co_await store->stop();
+
+  // the hints written on that stop carry the key on
+  store = std::make_unique<DiskStorage>();
+  co_await store->start();
+  ok &= co_await check_store(*store, expected, "#11 (values and keys after the next restart)");
+  co_await store->stop();
+
+  remove_data_files();
+  co_return ok;
+}
+
+// compactions under concurrent overwrites and deletes, nothing lost or left behind
+future<bool> compaction_test() {
+  constexpr unsigned COMPACTION_KEYS = 200;
+  constexpr unsigned MAX_ROUNDS = 200;
+  constexpr size_t VALUE_SIZE = 1000;
+  remove_data_files();
+  bool ok = true;
+  DiskOptions opts;
+  opts.compaction_threshold = 0.3;
+  opts.compaction_min_bytes = 64 * 1024;
+  std::map<std::string, std::string> expected;
+
+  auto store = std::make_unique<DiskStorage>(opts);
+  co_await store->start();
+  // write until the shards have compacted, then a few rounds more
+  unsigned rounds = 0;
+  unsigned extra = 3;
+  while (rounds < MAX_ROUNDS && extra > 0) {
+    co_await max_concurrent_for_each(boost::irange(0u, COMPACTION_KEYS), 32, [&] (unsigned i) -> future<> {
+      const std::string key = fmt::format("comp{:0>4}", i);
+      if ((i + rounds) % 7 == 0) {
+        expected[key] = "";
+        co_await store->del(key);
+      } else {
+        std::string value = fmt::format("round{}-key{}-", rounds, i);
+        value.resize(VALUE_SIZE, 'x');
+        expected[key] = value;
+        co_await store->set(key, make_value(value));
+      }
+    });
+    ++rounds;
+    if ((co_await store->compaction_stats()).runs >= smp::count) {
+      --extra;
+    }
+  }
+  const CompactionStats stats = co_await store->compaction_stats();
+  fmt::print("compaction test: {} rounds, {} compactions reclaimed {} bytes\n", rounds, stats.runs, stats.reclaimed_bytes);
+  ok &= runtime_assert_equal(true, stats.runs > 0 && stats.reclaimed_bytes > 0, "#12 (compactions ran)");
+  ok &= co_await check_store(*store, expected, "#13 (values and keys after the compactions)");
+  co_await store->stop();
+
+  bool leftover = false;
+  for (unsigned shard = 0; shard < smp::count; ++shard) {
+    leftover |= co_await file_exists(fmt::format("kvdb_data.{:0>3}.bin.compact", shard));
+  }
+  ok &= runtime_assert_equal(false, leftover, "#14 (no compaction file left)");
+
+  store = std::make_unique<DiskStorage>(opts);
+  co_await store->start();
+  ok &= runtime_assert_equal(uint64_t(smp::count), (co_await store->recovery_stats()).hint_loaded, "#15 (hints of the compacted files loaded)");
+  ok &= co_await check_store(*store, expected, "#16 (values and keys after a restart)");
+  co_await store->stop();
+
+  remove_data_files(true);
+  store = std::make_unique<DiskStorage>(opts);
+  co_await store->start();
+  ok &= co_await check_store(*store, expected, "#17 (values and keys after a full replay)");
+  co_await store->stop();
+
+  remove_data_files();
+  co_return ok;
+}
+
+int main(int ac, char** av) {
+    app_template app;
+
+    app.add_options()
+        ("dir", bpo::value<std::string>()->default_value("/tmp/kvdb_recovery"), "working directory (its data files are removed!)");
+
+    return app.run(ac, av, [&app] () -> future<int> {
+        auto& config = app.configuration();
+        const auto dir = config["dir"].as<std::string>();
+
+        co_await recursive_touch_directory(dir);
+        if (chdir(dir.c_str()) != 0) {
+            fmt::print("Error: can't change directory to {}\n", dir);
+            co_return -1;
+        }
+
+        fmt::print("========== recovery test ============\n");
+        bool ok = co_await torn_tail_test();
+        ok &= co_await hint_test();
+        ok &= co_await compaction_test();
+        fmt::print("==========     done     ============\n");
+        co_return ok ? 0 : 1;
+    });
+}
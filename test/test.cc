@@ -31,6 +31,11 @@
 
 using namespace seastar;
 
+// a key one byte longer than the longest accepted one
+static const std::string long_key(65536, 'k');
+static const std::string long_key_set = fmt::format("{{ \"key\" : \"{}\", \"value\" : \"x\" }}", long_key);
+static const std::string long_key_resp_set = fmt::format("*3\r\n$3\r\nSET\r\n${}\r\n{}\r\n$1\r\nx\r\n", long_key.size(), long_key);
+
 struct test_info {
   std::string_view path;     // REST API path
   std::string_view body;     // REST API (POST) request body
@@ -45,7 +50,48 @@ struct test_info {
  {"/v1/query",  "{ \"prefix\" : \"22\" }",   200, "[ { \"key\" : \"2222\" }, { \"key\" : \"2233\" } ]"}, // query by key prefix
  {"/v1/delete", "{ \"key\" : \"2222\" }", 200, ""},                                              // delete - key found
  {"/v1/delete", "{ \"key\" : \"2222\" }", 200, ""},                                              // delete - nonexistent key key (already deleted)
- {"/v1/query",  "{ \"prefix\" : \"22\" }",   200, "[ { \"key\" : \"2233\" } ]"}                       // query by key prefix
+ {"/v1/query",  "{ \"prefix\" : \"22\" }",   200, "[ { \"key\" : \"2233\" } ]"},                      // query by key prefix
+ {"/v1/set",    "{ \"key\" : \"2244\", \"value\" : \"dddd\" }", 200, ""},                        // set - another key stored
+ {"/v1/query",  "{ \"prefix\" : \"22\", \"limit\" : 1 }", 200, "[ { \"key\" : \"2233\" } ]"},      // query - first page
+ {"/v1/query",  "{ \"prefix\" : \"22\", \"limit\" : 1, \"cursor\" : \"2233\" }", 200, "[ { \"key\" : \"2244\" } ]"}, // query - next page
+ {"/v1/query",  "{ \"prefix\" : \"22\", \"limit\" : 1, \"cursor\" : \"2244\" }", 200, "[  ]"},    // query - past the last page
+ {"/v1/mset",   "{ \"items\" : [ { \"key\" : \"3311\", \"value\" : \"eeee\" }, { \"key\" : \"3322\", \"value\" : \"ffff\" } ] }", 200, ""}, // mset - keys created
+ {"/v1/mget",   "{ \"keys\" : [ \"3322\", \"1111\", \"3311\" ] }", 200,
+  "[ { \"key\" : \"3322\", \"value\" : \"ffff\" }, { \"key\" : \"1111\", \"value\" : null }, { \"key\" : \"3311\", \"value\" : \"eeee\" } ]"}, // mget - request order, missing key
+ {"/v1/mdelete", "{ \"keys\" : [ \"3311\", \"1111\" ] }", 200, ""},                           // mdelete - found and nonexistent key
+ {"/v1/mget",   "{ \"keys\" : [ \"3311\", \"3322\" ] }", 200,
+  "[ { \"key\" : \"3311\", \"value\" : null }, { \"key\" : \"3322\", \"value\" : \"ffff\" } ]"},   // mget - after mdelete
+ {"/v1/mget",   "{ \"key\" : \"3311\" }", 400, ""},                                               // mget - no key array
+ {"/v1/set",    "{\"value\":\"say \\\"hi\\\"\",\n \"key\":\"4411\"}", 200, ""},                       // set - compact, escaped quotes, member order
+ {"/v1/get",    "{ \"key\" : \"4411\", \"extra\" : [ 1, { \"a\" : \"}\" } ] }", 200,
+  "{ \"key\" : \"4411\", \"value\" : \"say \\\"hi\\\"\" }"},                                        // get - unknown members skipped, reply escaped
+ {"/v1/get",    "{ \"key\" : 4411 }", 400, ""},                                                 // get - key not a string
+ {"/v1/set",    "{ \"key\" : \"4422\", \"value\" : \"x\"", 400, ""},                            // set - truncated body
+ {"/v1/set",    long_key_set, 400, ""}                                                          // set - key too long
+};
+
+// Redis protocol requests and their replies, sent pipelined on a single connection
+struct resp_test_info {
+  std::string_view request;
+  std::string_view reply;
+} resp_tests [] = {
+ {"*1\r\n$4\r\nPING\r\n", "+PONG\r\n"},                                                        // ping
+ {"*3\r\n$3\r\nSET\r\n$4\r\n5511\r\n$4\r\ngg\r\n\r\n", "+OK\r\n"},                                 // set - value with CR LF
+ {"*2\r\n$3\r\nGET\r\n$4\r\n5511\r\n", "$4\r\ngg\r\n\r\n"},                                        // get - key exists
+ {"*2\r\n$3\r\nget\r\n$4\r\n5599\r\n", "$-1\r\n"},                                            // get - nonexistent key, lower case
+ {"*5\r\n$4\r\nMSET\r\n$4\r\n5522\r\n$4\r\nhhhh\r\n$4\r\n5533\r\n$4\r\niiii\r\n", "+OK\r\n"},       // mset - keys created
+ {"*4\r\n$4\r\nMGET\r\n$4\r\n5533\r\n$4\r\n5599\r\n$4\r\n5511\r\n",
+  "*3\r\n$4\r\niiii\r\n$-1\r\n$4\r\ngg\r\n\r\n"},                                                   // mget - request order, missing key
+ {"*6\r\n$4\r\nSCAN\r\n$1\r\n0\r\n$5\r\nMATCH\r\n$3\r\n55*\r\n$5\r\nCOUNT\r\n$1\r\n2\r\n",
+  "*2\r\n$1\r\n1\r\n*2\r\n$4\r\n5511\r\n$4\r\n5522\r\n"},                                       // scan - first page
+ {"*6\r\n$4\r\nSCAN\r\n$1\r\n1\r\n$5\r\nMATCH\r\n$3\r\n55*\r\n$5\r\nCOUNT\r\n$1\r\n2\r\n",
+  "*2\r\n$1\r\n0\r\n*1\r\n$4\r\n5533\r\n"},                                                    // scan - last page
+ {"*3\r\n$3\r\nDEL\r\n$4\r\n5511\r\n$4\r\n5599\r\n", ":1\r\n"},                                  // del - found and nonexistent key
+ {"GET 5511\r\n", "$-1\r\n"},                                                                  // get - inline command, after del
+ {"*3\r\n$3\r\nDEL\r\n$4\r\n5522\r\n$4\r\n5533\r\n", ":2\r\n"},                                  // del - keys of mset
+ {"*1\r\n$6\r\nNOSUCH\r\n", "-ERR unknown command 'NOSUCH'\r\n"},                                 // unknown command
+ {"*2\r\n$3\r\nGET\r\n", "-ERR wrong number of arguments for 'get' command\r\n"},                   // get - no key
+ {long_key_resp_set, "-ERR key too long\r\n"}                                                  // set - key too long
 };
 
 template <typename T> bool runtime_assert_equal(const T &a, const T &b, size_t test_idx) {
@@ -77,6 +123,37 @@ public:
             , _http_client(client){
         }
 
+        future<std::string> read_line() {
+            std::string line;
+            while (true) {
+              seastar::temporary_buffer<char> c = co_await _read_buf.read_exactly(1);
+              if (c.empty() || c[0] == '\n') {
+                break;
+              }
+              if (c[0] != '\r') {
+                line += c[0];
+              }
+            }
+            co_return line;
+        }
+
+        // chunked transfer encoding: hex chunk size line, chunk data, empty chunk at the end
+        future<std::string> read_chunked_body() {
+            std::string body;
+            while (true) {
+              const std::string size_line = co_await read_line();
+              const size_t size = std::stoul(size_line, nullptr, 16);
+              if (size == 0) {
+                co_await read_line();
+                break;
+              }
+              seastar::temporary_buffer<char> buf = co_await _read_buf.read_exactly(size);
+              body.append(buf.get(), buf.size());
+              co_await read_line();
+            }
+            co_return body;
+        }
+
         future< std::tuple<std::string, int> > do_req(const struct test_info &t) {
             std::string request = fmt::format("POST {} HTTP/1.1\r\nHost: 127.0.0.1:10000\r\nContent-Type: application/json\r\nContent-Length: {}\r\n\r\n{}", t.path, t.body.size(), t.body);
 	        // fmt::print("HTTP request:\n[{}]\n", request);
@@ -92,6 +169,11 @@ public:
             auto _rsp = _parser.get_parsed_response();
             auto it = _rsp->_headers.find("Content-Length");
             if (it == _rsp->_headers.end()) {
+               auto te = _rsp->_headers.find("Transfer-Encoding");
+               if (te != _rsp->_headers.end() && te->second == "chunked") {
+                  std::string body = co_await read_chunked_body();
+                  co_return std::make_tuple<std::string, int>(std::move(body), (int)_rsp->_status);
+               }
                fmt::print("Error: HTTP response does not contain: Content-Length\n");
                co_return std::make_tuple<std::string, int>("", -1);
             }
@@ -142,6 +224,28 @@ public:
     }
 };
 
+// all requests are written at once, the replies must come back in order
+future<> run_resp_tests(ipv4_addr server_addr) {
+    connected_socket fd = co_await seastar::connect(make_ipv4_address(server_addr));
+    input_stream<char> in = fd.input();
+    output_stream<char> out = fd.output();
+    for (auto &t : resp_tests) {
+      co_await out.write(t.request.data(), t.request.size());
+    }
+    co_await out.flush();
+
+    size_t test_idx = 0;
+    for (auto &t : resp_tests) {
+      fmt::print("RESP test #{} start.\n", test_idx);
+      seastar::temporary_buffer<char> buf = co_await in.read_exactly(t.reply.size());
+      if (runtime_assert_equal(t.reply, std::string_view(buf.get(), buf.size()), test_idx)) {
+        fmt::print("RESP test #{} succeeded!\n", test_idx);
+      }
+      ++ test_idx;
+    }
+    co_await out.close();
+}
+
 namespace bpo = boost::program_options;
 
 int main(int ac, char** av) {
@@ -150,7 +254,8 @@ int main(int ac, char** av) {
     app_template app(std::move(app_cfg));
 
     app.add_options()
-        ("server,s", bpo::value<std::string>()->default_value("127.0.0.1:10000"), "Server address");
+        ("server,s", bpo::value<std::string>()->default_value("127.0.0.1:10000"), "Server address")
+        ("resp-server", bpo::value<std::string>()->default_value("127.0.0.1:6379"), "Server Redis protocol address, the server runs with --resp-port (empty - no RESP tests)");
 
     return app.run(ac, av, [&app] () -> future<int> {
         auto& config = app.configuration();
@@ -163,6 +268,13 @@ int main(int ac, char** av) {
         http_client client;
         co_await client.connect(ipv4_addr{server});
         co_await client.run();
+
+        const auto resp_server = config["resp-server"].as<std::string>();
+        if (!resp_server.empty()) {
+            fmt::print("========== resp_client ============\n");
+            fmt::print("Server: {}\n", resp_server);
+            co_await run_resp_tests(ipv4_addr{resp_server});
+        }
         fmt::print("==========     done     ============\n");
         co_return 0;
       });